@@ -6,62 +6,338 @@
 // Licensed under the Whatever/Credit License: you may do whatever you want with
 // the code; if you make something cool, credit is appreciated.
 //
+#include <chrono>
 #include <iomanip>
 #include <memory>
-#include <ctime>
 #include <sstream>
 #include <unordered_map>
 
+#include "lib/frame_scheduler.h"
+#include "lib/keyboard.h"
 #include "lib/loader.h"
+#include "lib/machine_image.h"
 #include "lib/memory.h"
 #include "lib/monitor.h"
+#include "lib/pit.h"
+#include "lib/replay.h"
+#include "lib/snapshot.h"
 #include "lib/vga.h"
 #include "lib/x86.h"
+#include "lib/x86_jit.h"
 #include "lib/graphics.h"
 
 using namespace std;
 
 const int kFrameRate = 30;
+const int kCyclesPerFrame = X86::kClockRate / kFrameRate;
 const int kMemSize = 1 << 20;  // 1 MB
 
+// Instructions run by the block translator between checks for video updates.
+const int kJITBatch = 10000;
+
+// Seconds between frame rate statistics, when enabled.
+const int kStatsInterval = 5;
+
 //
 // Remake base class. Contains everything but the hook logic.
 //
+// Unlike the runner, it doesn't rewind: the hooks draw into the remake's
+// window a bit at a time, from guest state that's gone by then, so going back
+// would need a copy of the window for every frame kept.
+//
 class RemakeBase {
  public:
   RemakeBase() :
-      mem_(kMemSize), x86_(&mem_), vga_(&x86_), monitor_(&vga_),
-      regs_(*x86_.getRegisters()) {
+      mem_(kMemSize), x86_(&mem_), vga_(&x86_), pit_(&x86_),
+      keyboard_(&x86_), monitor_(&vga_), regs_(*x86_.getRegisters()),
+      jit_(&x86_), jit_enabled_(false), scheduler_(kFrameRate),
+      stats_enabled_(false), boot_address_(-1), run_ahead_(0),
+      snapshots_(&x86_, &vga_, &pit_, &keyboard_),
+      recorder_(&x86_, &keyboard_, kCyclesPerFrame) {
+  }
+
+  // Runs the game with the block translator instead of the interpreter.
+  // Hooked addresses always return control to runHooks().
+  void setJITEnabled(bool enabled) {
+    jit_enabled_ = enabled;
+  }
+
+  // Prints frame rate statistics every few seconds.
+  void setStatsEnabled(bool enabled) {
+    stats_enabled_ = enabled;
+  }
+
+  // Presents each frame as it will be the given number of frames later if
+  // the input doesn't change, hiding that many frames of input latency. The
+  // machine goes back to the actual frame afterwards, so every presented
+  // frame costs that many more to emulate. The hooks run in the frames ahead
+  // too; whatever they change outside the machine must be put back by
+  // handleRunAheadEnd().
+  void setRunAhead(int frames) {
+    run_ahead_ = frames;
+  }
+
+  // Resumes from the machine image in the given file instead of running
+  // the program's startup code, if it was taken from the same program.
+  // Otherwise the program starts as usual and the image is saved once it
+  // reaches the boot address, for next time.
+  void setBootImageFilename(const string& filename) {
+    boot_image_filename_ = filename;
   }
 
+  // Saves the input to the given file when the game quits.
+  void setRecordFilename(const string& filename) {
+    record_filename_ = filename;
+  }
+
+  // Plays the input back from the given file instead of taking it from the
+  // window, until it ends. The replay decides whether the block translator
+  // is used.
+  void loadReplay(const string& filename) {
+    Replay replay;
+    replay.load(filename);
+    if (replay.cycles_per_frame != kCyclesPerFrame) {
+      FATAL("The replay has a different frame rate");
+    }
+    player_.reset(new ReplayPlayer(&x86_, &keyboard_, replay));
+  }
+
+  // Emulates a frame at a time, presenting each one when it's due and
+  // sleeping in between, until the window is closed or the replay ends.
   void run() {
-    next_video_update_ = 0;
-    while (true) {
-      runHooks();
-      x86_.step();
+    boot();
+    startInput();
+    next_video_update_ = x86_.getCycleCount();
+    scheduler_.start();
+    while (!monitor_.isQuitRequested() && !isReplayFinished()) {
+      runFrame();
+      if (scheduler_.shouldPresent()) {
+        if (run_ahead_ > 0) {
+          runAhead(true);
+        } else {
+          updateMonitor();
+        }
+        if (stats_enabled_) {
+          printStats();
+        }
+      }
+      scheduler_.waitForNextFrame();
+    }
+    finishInput();
+  }
 
-      if (clock() >= next_video_update_) {
-        updateMonitor();
+  // Plays the replay back as fast as possible, without presenting frames but
+  // running ahead if enabled, and prints how fast it ran. Returns whether the
+  // checksums matched.
+  bool runBenchmark() {
+    ASSERT(player_);
+    boot();
+    startInput();
+    next_video_update_ = x86_.getCycleCount();
+    long long start_cycle = x86_.getCycleCount();
+    auto start = chrono::steady_clock::now();
+    while (!player_->isFinished()) {
+      runFrame();
+      if (run_ahead_ > 0) {
+        runAhead(false);
       }
     }
+    double seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+    double guest_seconds =
+        (double)(x86_.getCycleCount() - start_cycle) / X86::kClockRate;
+    cout << fixed << setprecision(2) << player_->getFrame() << " frames in "
+         << seconds << " s, " << guest_seconds / seconds << "x real time"
+         << endl;
+    return finishInput();
+  }
+
+  void runFrame() {
+    next_video_update_ += kCyclesPerFrame;
+    while (x86_.getCycleCount() < next_video_update_) {
+      // Execution stops at hooked addresses, so this runs them on arrival.
+      runHooks();
+      if (jit_enabled_) {
+        jit_.run(kJITBatch);
+      } else {
+        X86::RunResult result =
+            x86_.runFor(next_video_update_ - x86_.getCycleCount());
+        if (result.reason == X86::STOP_ERROR) {
+          FATAL(result.error);
+        }
+      }
+    }
+  }
+
+  // Runs the frames ahead and presents the last one, if asked to. The input
+  // stays the same; keys pressed meanwhile go to the next actual frame.
+  void runAhead(bool present) {
+    int snapshot = snapshots_.take();
+    long long next_video_update = next_video_update_;
+    handleRunAheadStart();
+    setInputPaused(true);
+    for (int i = 0; i < run_ahead_; i++) {
+      runFrame();
+    }
+    setInputPaused(false);
+
+    // Presented before going back, since restoring rewrites VRAM.
+    if (present) {
+      updateMonitor();
+    }
+    snapshots_.restore(snapshot);
+    snapshots_.release(snapshot);
+    next_video_update_ = next_video_update;
+    handleRunAheadEnd();
+  }
+
+  void printStats() {
+    const FrameScheduler::Stats& stats = scheduler_.getStats();
+    if (stats.frames_presented % (kFrameRate * kStatsInterval) == 0) {
+      cout << fixed << setprecision(1) << stats.fps << " fps, "
+           << stats.frames_skipped << " skipped, "
+           << stats.late_frames << " late" << endl;
+    }
   }
 
   virtual void updateMonitor() {
     monitor_.update();
-    next_video_update_ = clock() + (CLOCKS_PER_SEC / kFrameRate);
   }
 
   virtual void runHooks() = 0;
 
  protected:
+  // Loads the program, whose startup code ends at the given address; that's
+  // where the boot image resumes from.
+  void loadProgram(const string& filename, int boot_address) {
+    Loader::loadCOM(filename, &mem_, &x86_);
+    program_filename_ = filename;
+    boot_address_ = boot_address;
+  }
+
+  // Gets to the boot address, from the boot image if there's a valid one.
+  // The startup code always runs in the interpreter, so the image is the
+  // same whether the block translator is enabled or not.
+  void boot() {
+    if (boot_image_filename_.empty()) {
+      return;
+    }
+    ASSERT(boot_address_ != -1);
+    MachineImage image(&x86_, &vga_, &pit_, &keyboard_);
+    unsigned long long program_hash = MachineImage::hashFile(program_filename_);
+    if (image.load(boot_image_filename_, program_hash)) {
+      handleBootImageLoaded();
+      return;
+    }
+
+    AddressBitmap* stop_addresses = x86_.getStopAddresses();
+    bool hooked = stop_addresses->contains(boot_address_);
+    stop_addresses->add(boot_address_);
+    while (x86_.getCS_IP() != boot_address_) {
+      runHooks();
+      X86::RunResult result = x86_.runFor(-1);
+      if (result.reason == X86::STOP_ERROR) {
+        FATAL(result.error);
+      }
+    }
+    if (!hooked) {
+      stop_addresses->remove(boot_address_);
+    }
+    image.save(boot_image_filename_, program_hash);
+    cout << "Saved the boot image to " << boot_image_filename_ << endl;
+  }
+
+  // Called after resuming from the boot image. The hooks the startup code
+  // would have run didn't, so whatever they drew must be drawn here.
+  virtual void handleBootImageLoaded() {
+  }
+
+  // Called around the frames run ahead. The hooks draw them like any other,
+  // so what they drew must be undone at the end, as the machine is.
+  virtual void handleRunAheadStart() {
+  }
+
+  virtual void handleRunAheadEnd() {
+  }
+
+  // Input comes from the replay if there's one, otherwise from the window
+  // through the recorder, so it's recorded even if it isn't saved.
+  void startInput() {
+    if (player_) {
+      jit_enabled_ = player_->getReplay().block_translation;
+      if (!player_->start()) {
+        cerr << "The replay was recorded from a different state." << endl;
+      }
+    } else {
+      recorder_.start();
+      monitor_.setKeyHandler(&recorder_);
+    }
+  }
+
+  void setInputPaused(bool paused) {
+    if (player_) {
+      player_->setPaused(paused);
+    } else {
+      recorder_.setPaused(paused);
+    }
+  }
+
+  bool isReplayFinished() const {
+    return player_ && player_->isFinished();
+  }
+
+  // Reports the replay results or saves the recording. Returns false if the
+  // replay didn't match.
+  bool finishInput() {
+    if (player_) {
+      int mismatch_frame = player_->getMismatchFrame();
+      if (mismatch_frame != -1) {
+        cerr << "The replay diverged at frame " << dec << mismatch_frame
+             << "." << endl;
+        return false;
+      }
+      return true;
+    }
+
+    recorder_.stop();
+    monitor_.setKeyHandler(nullptr);
+    if (!record_filename_.empty()) {
+      Replay replay = recorder_.getReplay();
+      replay.block_translation = jit_enabled_;
+      replay.save(record_filename_);
+      cout << "Saved " << replay.frame_count << " frames to "
+           << record_filename_ << endl;
+    }
+    return true;
+  }
+
   Memory mem_;
   X86 x86_;
   VGA vga_;
+  PIT pit_;
+  Keyboard keyboard_;
   Monitor monitor_;
   Registers& regs_;
+  X86JIT jit_;
+  bool jit_enabled_;
+
+  // Guest time of the next video update, in cycles.
+  long long next_video_update_;
 
+  FrameScheduler scheduler_;
+  bool stats_enabled_;
 
-  int next_video_update_;
+  string program_filename_;
+  int boot_address_;
+  string boot_image_filename_;
+
+  int run_ahead_;
+  MachineSnapshots snapshots_;
+
+  ReplayRecorder recorder_;
+  string record_filename_;
+  unique_ptr<ReplayPlayer> player_;
 };
 
 
@@ -76,7 +352,11 @@ class Remake : public RemakeBase {
   typedef void(T::*AddressHook)();
 
   virtual void runHooks() {
-    auto it = hooks_.find(x86_.getCS_IP());
+    int address = x86_.getCS_IP();
+    if (!x86_.getStopAddresses()->contains(address)) {
+      return;
+    }
+    auto it = hooks_.find(address);
     if (it != hooks_.end()) {
       ((T*)this->*(it->second))();
     }
@@ -84,6 +364,7 @@ class Remake : public RemakeBase {
 
   void addHook(int address, AddressHook hook) {
     hooks_[address] = hook;
+    x86_.getStopAddresses()->add(address);
   }
 
  private:
@@ -107,9 +388,12 @@ class GoodyRemake : public Remake<GoodyRemake> {
   static const int kTileWidth = 25;
   static const int kTileHeight = 30;
 
+  // The "Restart" label, once video, UI, music and lives are set up.
+  static const int kBootAddress = 0x016F;
+
 
   GoodyRemake() {
-    Loader::loadCOM("goody.com", &mem_, &x86_);
+    loadProgram("goody.com", kBootAddress);
 
     addHook(0x36F3, &GoodyRemake::drawUI);
     addHook(0x3851, &GoodyRemake::drawGlyph);
@@ -145,6 +429,20 @@ class GoodyRemake : public Remake<GoodyRemake> {
     }
   }
 
+  virtual void handleBootImageLoaded() {
+    drawUI();
+  }
+
+  // The window only holds what the hooks drew, so it goes back to what it
+  // was before the frames ahead were drawn.
+  virtual void handleRunAheadStart() {
+    window_->saveContents();
+  }
+
+  virtual void handleRunAheadEnd() {
+    window_->restoreContents();
+  }
+
   virtual void updateMonitor() {
     Remake<GoodyRemake>::updateMonitor();
     window_->update();
@@ -184,8 +482,34 @@ class GoodyRemake : public Remake<GoodyRemake> {
 
 int main (int argc, char** argv) {
   GoodyRemake goody;
-
+  bool benchmark = false;
   try {
+    for (int i = 1; i < argc; i++) {
+      string arg = argv[i];
+      string value = (i + 1 < argc) ? argv[i + 1] : "";
+      if (arg == "--jit") {
+        goody.setJITEnabled(true);
+      } else if (arg == "--stats") {
+        goody.setStatsEnabled(true);
+      } else if (arg == "--run-ahead" && !value.empty()) {
+        goody.setRunAhead(stoi(value));
+        i++;
+      } else if (arg == "--boot-image" && !value.empty()) {
+        goody.setBootImageFilename(value);
+        i++;
+      } else if (arg == "--record" && !value.empty()) {
+        goody.setRecordFilename(value);
+        i++;
+      } else if ((arg == "--play" || arg == "--benchmark") && !value.empty()) {
+        goody.loadReplay(value);
+        benchmark = (arg == "--benchmark");
+        i++;
+      }
+    }
+
+    if (benchmark) {
+      return goody.runBenchmark() ? 0 : 1;
+    }
     goody.run();
   } catch (const exception& e) {
     goody.updateMonitor();
@@ -0,0 +1,90 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "address_bitmap.h"
+
+#include "helpers.h"
+
+using namespace std;
+
+AddressBitmap::AddressBitmap()
+  : bits_((kAddressLimit + 63) / 64, 0), count_(0), generation_(0) {
+}
+
+
+void AddressBitmap::add(int address) {
+  ASSERT(address >= 0 && address < kAddressLimit);
+  if (!contains(address)) {
+    bits_[address >> 6] |= (uint64_t)1 << (address & 63);
+    count_++;
+    generation_++;
+  }
+}
+
+
+void AddressBitmap::remove(int address) {
+  ASSERT(address >= 0 && address < kAddressLimit);
+  if (contains(address)) {
+    bits_[address >> 6] &= ~((uint64_t)1 << (address & 63));
+    count_--;
+    generation_++;
+  }
+}
+
+
+void AddressBitmap::clear() {
+  if (count_ != 0) {
+    bits_.assign(bits_.size(), 0);
+    count_ = 0;
+    generation_++;
+  }
+}
+
+
+bool AddressBitmap::empty() const {
+  return count_ == 0;
+}
+
+
+vector<int> AddressBitmap::getAddresses() const {
+  vector<int> addresses;
+  addresses.reserve(count_);
+  for (int i = 0; i < (int)bits_.size(); i++) {
+    if (bits_[i] == 0) {
+      continue;
+    }
+    for (int bit = 0; bit < 64; bit++) {
+      if ((bits_[i] >> bit) & 1) {
+        addresses.push_back(i * 64 + bit);
+      }
+    }
+  }
+  return addresses;
+}
+
+
+vector<int> AddressBitmap::getAddressesNotIn(const AddressBitmap& other) const {
+  vector<int> addresses;
+  for (int i = 0; i < (int)bits_.size(); i++) {
+    uint64_t bits = bits_[i] & ~other.bits_[i];
+    if (bits == 0) {
+      continue;
+    }
+    for (int bit = 0; bit < 64; bit++) {
+      if ((bits >> bit) & 1) {
+        addresses.push_back(i * 64 + bit);
+      }
+    }
+  }
+  return addresses;
+}
+
+
+int AddressBitmap::getGeneration() const {
+  return generation_;
+}
@@ -0,0 +1,55 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __ADDRESS_BITMAP_H__
+#define __ADDRESS_BITMAP_H__
+
+#include <cstdint>
+#include <vector>
+
+//
+// Set of linear addresses, one bit per address, so checking whether an
+// address is in the set is a single bit test. Used for hooks and breakpoints.
+//
+class AddressBitmap {
+ public:
+  // Highest linear address CS:IP can point to, plus one.
+  static const int kAddressLimit = (0xFFFF << 4) + 0x10000;
+
+  AddressBitmap();
+
+  void add(int address);
+  void remove(int address);
+  void clear();
+
+  bool contains(int address) const;
+  bool empty() const;
+
+  // The addresses in the set, in increasing order.
+  std::vector<int> getAddresses() const;
+
+  // The addresses in the set that aren't in the other one, in increasing
+  // order, e.g. those added since a copy was made.
+  std::vector<int> getAddressesNotIn(const AddressBitmap& other) const;
+
+  // Changes whenever the set changes, so users can tell whether anything
+  // they derived from it is stale.
+  int getGeneration() const;
+
+ private:
+  std::vector<uint64_t> bits_;
+  int count_;
+  int generation_;
+};
+
+
+inline bool AddressBitmap::contains(int address) const {
+  return (bits_[address >> 6] >> (address & 63)) & 1;
+}
+
+#endif  // __ADDRESS_BITMAP_H__
@@ -0,0 +1,93 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "decode_cache.h"
+
+using namespace std;
+
+DecodeCache::DecodeCache(Memory* mem)
+  : mem_(mem), entries_(kEntryCount),
+    page_generations_(Memory::kMappedSize >> Memory::kPageBits, 0) {
+  clear();
+  resetStats();
+  mem_->setPageWatcher(this);
+}
+
+
+const X86Base::DecodedInstruction* DecodeCache::find(word cs, word ip,
+                                                     int* length) {
+  int address = (cs << 4) + ip;
+  const Entry& entry = entries_[address & (kEntryCount - 1)];
+
+  if (entry.address != address || entry.cs != cs || entry.ip != ip ||
+      entry.generation != page_generations_[address >> Memory::kPageBits]) {
+    stats_.misses++;
+    return nullptr;
+  }
+
+  stats_.hits++;
+  *length = entry.length;
+  return &entry.decoded;
+}
+
+
+void DecodeCache::insert(word cs, word ip, int length, int generation,
+                         const X86Base::DecodedInstruction& decoded) {
+  int address = (cs << 4) + ip;
+  int page = address >> Memory::kPageBits;
+  if (((address + length - 1) >> Memory::kPageBits) != page ||
+      address + length > mem_->getSize() ||
+      generation != page_generations_[page]) {
+    return;
+  }
+
+  Entry& entry = entries_[address & (kEntryCount - 1)];
+  entry.address = address;
+  entry.generation = generation;
+  entry.cs = cs;
+  entry.ip = ip;
+  entry.length = length;
+  entry.decoded = decoded;
+}
+
+
+void DecodeCache::clear() {
+  for (Entry& entry : entries_) {
+    entry.address = -1;
+  }
+}
+
+
+const int* DecodeCache::watchPage(int address) {
+  int page = address >> Memory::kPageBits;
+  mem_->watchPage(page);
+  return &page_generations_[page];
+}
+
+
+void DecodeCache::invalidatePage(int address) {
+  handlePageWrite(address >> Memory::kPageBits);
+}
+
+
+const DecodeCache::Stats& DecodeCache::getStats() const {
+  return stats_;
+}
+
+
+void DecodeCache::resetStats() {
+  stats_.hits = 0;
+  stats_.misses = 0;
+  stats_.invalidations = 0;
+}
+
+
+void DecodeCache::handlePageWrite(int page) {
+  page_generations_[page]++;
+  stats_.invalidations++;
+}
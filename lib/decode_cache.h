@@ -0,0 +1,83 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __DECODE_CACHE_H__
+#define __DECODE_CACHE_H__
+
+#include "memory.h"
+#include "x86_base.h"
+
+#include <vector>
+
+//
+// Cache of decoded instructions, keyed by CS:IP. Entries are invalidated a
+// page at a time when the memory they were decoded from may have changed.
+//
+class DecodeCache : public PageWatcher {
+ public:
+  struct Stats {
+    long long hits;
+    long long misses;
+    long long invalidations;
+  };
+
+  DecodeCache(Memory* mem);
+
+  // Returns the instruction decoded at CS:IP and its length, or nullptr.
+  const X86Base::DecodedInstruction* find(word cs, word ip, int* length);
+
+  // Adds an instruction, given the generation of its page before it was
+  // decoded, from watchPage(). Instructions that span two pages aren't
+  // cached, and neither are those whose page was written to meanwhile, e.g.
+  // by resolving a memory operand in it.
+  void insert(word cs, word ip, int length, int generation,
+              const X86Base::DecodedInstruction& decoded);
+
+  void clear();
+
+  // Watches the page containing a linear address, and returns its generation,
+  // which changes whenever the page is written to.
+  const int* watchPage(int address);
+
+  // Changes the generation of the page containing a linear address, as if it
+  // was written to.
+  void invalidatePage(int address);
+
+  const Stats& getStats() const;
+  void resetStats();
+
+  virtual void handlePageWrite(int page) override;
+
+ private:
+  struct Entry {
+    int address;
+    int generation;
+    word cs, ip;
+    int length;
+    X86Base::DecodedInstruction decoded;
+  };
+
+  static const int kEntryBits = 14;
+  static const int kEntryCount = 1 << kEntryBits;
+
+  // Highest linear address CS:IP can point to, plus one.
+  static const int kAddressLimit = (0xFFFF << 4) + 0x10000;
+
+  Memory* mem_;
+
+  // Direct-mapped on the linear address.
+  std::vector<Entry> entries_;
+
+  // Incremented every time a page is written to. Entries decoded from an
+  // older generation of their page are stale.
+  std::vector<int> page_generations_;
+
+  Stats stats_;
+};
+
+#endif  // __DECODE_CACHE_H__
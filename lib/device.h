@@ -23,4 +23,39 @@ class IOHandler {
   virtual void handleOUT(int port, byte val) = 0;
 };
 
+
+// Owner of memory mapped with Memory::mapDevice(). Told about writes to
+// [address, address + size) when the CPU gets hold of memory it may write to,
+// i.e. before the write happens. The range may extend past the device's own.
+class MemoryHandler {
+ public:
+  virtual void handleMemoryWrite(int address, int size) = 0;
+};
+
+
+// Receives events scheduled with EventScheduler::schedule(). The cycle is the
+// one the event was scheduled for, which may be slightly earlier than the
+// current one; periodic events should schedule the next one relative to it.
+class EventHandler {
+ public:
+  virtual void handleEvent(int event, long long cycle) = 0;
+};
+
+
+// Told when the CPU's cycle count goes back to 0, e.g. on X86::reset(), so
+// devices can move the cycles they keep back by as much, like the
+// EventScheduler does with pending events.
+class ResetHandler {
+ public:
+  virtual void handleReset(long long cycles) = 0;
+};
+
+
+// Receives key presses and releases, as PC scancode set 1 make codes, e.g.
+// from the host window.
+class KeyHandler {
+ public:
+  virtual void handleKey(byte scancode, bool pressed) = 0;
+};
+
 #endif // __DEVICE_H__
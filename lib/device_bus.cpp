@@ -0,0 +1,53 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "device_bus.h"
+
+#include <cstring>
+
+using namespace std;
+
+DeviceBus::DeviceBus() : io_handlers_(kPorts, nullptr) {
+  for (int i = 0; i < kInterrupts; i++) {
+    int_handlers_[i] = nullptr;
+  }
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+
+void DeviceBus::registerInterruptHandler(InterruptHandler* handler, int num) {
+  ASSERT(num >= 0 && num < kInterrupts);
+  ASSERT(int_handlers_[num] == nullptr);
+  int_handlers_[num] = handler;
+}
+
+
+void DeviceBus::registerIOHandler(IOHandler* handler, int port, int count) {
+  ASSERT(port >= 0 && count > 0 && port + count <= kPorts);
+  for (int i = port; i < port + count; i++) {
+    ASSERT(io_handlers_[i] == nullptr);
+    io_handlers_[i] = handler;
+  }
+}
+
+
+void DeviceBus::registerResetHandler(ResetHandler* handler) {
+  reset_handlers_.push_back(handler);
+}
+
+
+void DeviceBus::reset(long long cycles) {
+  for (ResetHandler* handler : reset_handlers_) {
+    handler->handleReset(cycles);
+  }
+}
+
+
+const DeviceBus::Stats& DeviceBus::getStats() const {
+  return stats_;
+}
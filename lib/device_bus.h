@@ -0,0 +1,92 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __DEVICE_BUS_H__
+#define __DEVICE_BUS_H__
+
+#include "device.h"
+
+#include <vector>
+
+//
+// Routes interrupts and I/O ports to the devices handling them, through
+// tables indexed by interrupt number and port, so dispatching is a single
+// load. Accesses nobody handles are counted rather than logged; reads from
+// unhandled ports return 0xFF, like an empty ISA bus.
+//
+class DeviceBus {
+ public:
+  static const int kInterrupts = 0x100;
+  static const int kPorts = 0x10000;
+
+  struct Stats {
+    long long unhandled_interrupts;
+    long long unhandled_ins;
+    long long unhandled_outs;
+  };
+
+  DeviceBus();
+
+  // Each interrupt and port has at most one handler.
+  void registerInterruptHandler(InterruptHandler* handler, int num);
+  void registerIOHandler(IOHandler* handler, int port, int count = 1);
+
+  // Any number of devices can be told about resets.
+  void registerResetHandler(ResetHandler* handler);
+
+  // Calls the handler of the interrupt. Returns false if there's none.
+  bool interrupt(int num);
+
+  byte in(int port);
+  void out(int port, byte val);
+
+  // Tells every ResetHandler the cycle count went back by cycles.
+  void reset(long long cycles);
+
+  const Stats& getStats() const;
+
+ private:
+  InterruptHandler* int_handlers_[kInterrupts];
+  std::vector<IOHandler*> io_handlers_;
+  std::vector<ResetHandler*> reset_handlers_;
+
+  Stats stats_;
+};
+
+
+inline bool DeviceBus::interrupt(int num) {
+  InterruptHandler* handler = int_handlers_[num & (kInterrupts - 1)];
+  if (handler == nullptr) {
+    stats_.unhandled_interrupts++;
+    return false;
+  }
+  handler->handleInterrupt(num);
+  return true;
+}
+
+
+inline byte DeviceBus::in(int port) {
+  IOHandler* handler = io_handlers_[port & (kPorts - 1)];
+  if (handler == nullptr) {
+    stats_.unhandled_ins++;
+    return 0xFF;
+  }
+  return handler->handleIN(port);
+}
+
+
+inline void DeviceBus::out(int port, byte val) {
+  IOHandler* handler = io_handlers_[port & (kPorts - 1)];
+  if (handler == nullptr) {
+    stats_.unhandled_outs++;
+    return;
+  }
+  handler->handleOUT(port, val);
+}
+
+#endif  // __DEVICE_BUS_H__
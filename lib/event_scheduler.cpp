@@ -0,0 +1,105 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "event_scheduler.h"
+
+#include "device.h"
+
+#include <algorithm>
+#include <climits>
+#include <functional>
+
+using namespace std;
+
+bool EventScheduler::Event::operator>(const Event& other) const {
+  if (cycle != other.cycle) {
+    return cycle > other.cycle;
+  }
+  return sequence > other.sequence;
+}
+
+
+EventScheduler::EventScheduler() : next_cycle_(LLONG_MAX), sequence_(0) {
+}
+
+
+void EventScheduler::schedule(long long cycle, EventHandler* handler,
+                              int event) {
+  Event e = { cycle, sequence_++, handler, event };
+  heap_.push_back(e);
+  push_heap(heap_.begin(), heap_.end(), greater<Event>());
+  if (cycle < next_cycle_) {
+    next_cycle_ = cycle;
+  }
+}
+
+
+void EventScheduler::cancel(EventHandler* handler, int event) {
+  auto end = remove_if(heap_.begin(), heap_.end(), [=](const Event& e) {
+    return e.handler == handler && e.event == event;
+  });
+  if (end == heap_.end()) {
+    return;
+  }
+  heap_.erase(end, heap_.end());
+  make_heap(heap_.begin(), heap_.end(), greater<Event>());
+
+  // next_cycle_ is left as is; checking early is harmless, and it may have
+  // been set by wake().
+}
+
+
+void EventScheduler::clear() {
+  heap_.clear();
+  next_cycle_ = LLONG_MAX;
+}
+
+
+void EventScheduler::wake() {
+  next_cycle_ = 0;
+}
+
+
+void EventScheduler::runDue(long long cycle) {
+  while (!heap_.empty() && heap_.front().cycle <= cycle) {
+    Event e = heap_.front();
+    pop_heap(heap_.begin(), heap_.end(), greater<Event>());
+    heap_.pop_back();
+    e.handler->handleEvent(e.event, e.cycle);
+  }
+  updateNextCycle();
+}
+
+
+void EventScheduler::rebase(long long cycles) {
+  for (Event& e : heap_) {
+    e.cycle -= cycles;
+  }
+  updateNextCycle();
+}
+
+
+vector<EventScheduler::ScheduledEvent>
+EventScheduler::getPendingEvents() const {
+  vector<Event> sorted = heap_;
+  sort(sorted.begin(), sorted.end(), [](const Event& a, const Event& b) {
+    return b > a;
+  });
+
+  vector<ScheduledEvent> events;
+  for (const Event& e : sorted) {
+    ScheduledEvent scheduled = { e.cycle, e.handler, e.event };
+    events.push_back(scheduled);
+  }
+  return events;
+}
+
+
+void EventScheduler::updateNextCycle() {
+  next_cycle_ = heap_.empty() ? LLONG_MAX : heap_.front().cycle;
+}
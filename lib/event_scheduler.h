@@ -0,0 +1,80 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __EVENT_SCHEDULER_H__
+#define __EVENT_SCHEDULER_H__
+
+#include <vector>
+
+class EventHandler;
+
+//
+// Device events due at a given CPU cycle, kept in a min-heap. The CPU only
+// compares its cycle count against getNextCycle() between instructions, and
+// calls runDue() once it's reached, so devices cost nothing in between.
+//
+class EventScheduler {
+ public:
+  EventScheduler();
+
+  // Calls handler->handleEvent(event, cycle) once the cycle count reaches the
+  // given cycle. Events due at the same cycle run in the order they were
+  // scheduled.
+  void schedule(long long cycle, EventHandler* handler, int event);
+
+  // Removes the pending occurrences of an event.
+  void cancel(EventHandler* handler, int event);
+  void clear();
+
+  // Cycle at which something must be done; LLONG_MAX if nothing's pending.
+  long long getNextCycle() const;
+
+  // Makes the next check happen right away, e.g. when an interrupt becomes
+  // deliverable.
+  void wake();
+
+  // Runs the events due at the given cycle, including those they schedule.
+  void runDue(long long cycle);
+
+  // Moves every pending event the given number of cycles earlier, for when
+  // the cycle count is reset.
+  void rebase(long long cycles);
+
+  struct ScheduledEvent {
+    long long cycle;
+    EventHandler* handler;
+    int event;
+  };
+
+  // The pending events, in the order they'll run, e.g. to save them.
+  // Scheduling them again in this order reproduces it.
+  std::vector<ScheduledEvent> getPendingEvents() const;
+
+ private:
+  struct Event {
+    long long cycle;
+    long long sequence;
+    EventHandler* handler;
+    int event;
+
+    bool operator>(const Event& other) const;
+  };
+
+  void updateNextCycle();
+
+  std::vector<Event> heap_;
+  long long next_cycle_;
+  long long sequence_;
+};
+
+
+inline long long EventScheduler::getNextCycle() const {
+  return next_cycle_;
+}
+
+#endif  // __EVENT_SCHEDULER_H__
@@ -0,0 +1,81 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "frame_scheduler.h"
+
+#include "helpers.h"
+
+#include <thread>
+
+using namespace std;
+using namespace std::chrono;
+
+FrameScheduler::FrameScheduler(int frame_rate, int max_skipped_frames)
+  : frame_duration_(duration_cast<Clock::duration>(seconds(1)) / frame_rate),
+    max_skipped_frames_(max_skipped_frames) {
+  ASSERT(frame_rate > 0);
+  start();
+}
+
+
+void FrameScheduler::start() {
+  Clock::time_point now = Clock::now();
+  deadline_ = now + frame_duration_;
+  skipped_in_a_row_ = 0;
+  fps_start_ = now;
+  fps_frames_ = 0;
+  stats_.frames_presented = 0;
+  stats_.frames_skipped = 0;
+  stats_.late_frames = 0;
+  stats_.fps = 0;
+}
+
+
+bool FrameScheduler::shouldPresent() {
+  // Skip if the frame is already too late to be shown on time.
+  Clock::time_point now = Clock::now();
+  if (now > deadline_ && skipped_in_a_row_ < max_skipped_frames_) {
+    skipped_in_a_row_++;
+    stats_.frames_skipped++;
+    return false;
+  }
+  skipped_in_a_row_ = 0;
+  stats_.frames_presented++;
+
+  fps_frames_++;
+  Clock::duration elapsed = now - fps_start_;
+  if (elapsed >= seconds(1)) {
+    stats_.fps = fps_frames_ / duration_cast<duration<double>>(elapsed).count();
+    fps_start_ = now;
+    fps_frames_ = 0;
+  }
+  return true;
+}
+
+
+void FrameScheduler::waitForNextFrame() {
+  Clock::time_point now = Clock::now();
+  if (now < deadline_) {
+    this_thread::sleep_until(deadline_);
+    deadline_ += frame_duration_;
+    return;
+  }
+
+  // Late. Catch up by skipping frames if possible, but don't let the backlog
+  // grow without bound.
+  stats_.late_frames++;
+  deadline_ += frame_duration_;
+  if (now - deadline_ > frame_duration_ * max_skipped_frames_) {
+    deadline_ = now + frame_duration_;
+  }
+}
+
+
+const FrameScheduler::Stats& FrameScheduler::getStats() const {
+  return stats_;
+}
@@ -0,0 +1,65 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __FRAME_SCHEDULER_H__
+#define __FRAME_SCHEDULER_H__
+
+#include <chrono>
+
+//
+// Paces emulated frames against the wall clock. The caller emulates one
+// frame's worth of guest time, asks whether to present it, and then waits for
+// the next frame, sleeping instead of spinning. When the host falls behind,
+// frames are emulated but not presented, up to a limit, so the game keeps its
+// speed; if it falls further behind, the schedule is reset instead of trying
+// to catch up.
+//
+class FrameScheduler {
+ public:
+  struct Stats {
+    long long frames_presented;
+    long long frames_skipped;
+
+    // Frames that finished after their deadline.
+    long long late_frames;
+
+    // Presented frames per second, measured over the last second or so.
+    double fps;
+  };
+
+  FrameScheduler(int frame_rate, int max_skipped_frames = 4);
+
+  // Starts the schedule now.
+  void start();
+
+  // Whether the frame just emulated should be presented, or skipped to catch
+  // up.
+  bool shouldPresent();
+
+  // Sleeps until the next frame is due.
+  void waitForNextFrame();
+
+  const Stats& getStats() const;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  Clock::duration frame_duration_;
+  int max_skipped_frames_;
+
+  // When the current frame is due.
+  Clock::time_point deadline_;
+  int skipped_in_a_row_;
+
+  Clock::time_point fps_start_;
+  long long fps_frames_;
+
+  Stats stats_;
+};
+
+#endif  // __FRAME_SCHEDULER_H__
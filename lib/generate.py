@@ -19,10 +19,12 @@ NON_MANDATORY_OPCODES = PREFIX_OPCODES + NOP_OPCODES
 # Input and output filenames.
 CPP_OUT = "x86_base.cpp"
 H_OUT = "x86_base.h"
+H_T_OUT = "x86_base_t.h"
 GENERATOR_PATH = "generator"
 
 CPP_TEMPLATE = os.path.join(GENERATOR_PATH, CPP_OUT + ".template")
 H_TEMPLATE = os.path.join(GENERATOR_PATH, H_OUT + ".template")
+H_T_TEMPLATE = os.path.join(GENERATOR_PATH, H_T_OUT + ".template")
 OPCODES_TABLE_FILENAME = os.path.join(GENERATOR_PATH, "8086_table.txt")
 
 
@@ -32,11 +34,39 @@ GENERATED_CODE_BEGIN = "// BEGIN GENERATED CODE"
 GENERATED_CODE_END = "// END GENERATED CODE"
 
 
+class Cycles:
+  """8086 clock cycles of an instruction, parsed from the last column of the
+  opcodes table, e.g. "3/16", "4 j16" or "18 r17":
+
+    <reg>[/<mem>]  Cycles with register or immediate operands. If given,
+                   <mem> is used instead when an operand is in memory, plus
+                   the effective address calculation time.
+    j<taken>       Cycles of a conditional transfer when it's taken.
+    r<repeat>      Cycles per iteration with a REP prefix, which replace
+                   <reg>.
+  """
+  def __init__(self, desc):
+    tokens = desc.split()
+    times = tokens[0].split("/")
+    self.reg = int(times[0])
+    self.mem = int(times[1]) if len(times) > 1 else None
+    self.taken = None
+    self.repeat = None
+    for token in tokens[1:]:
+      if token[0] == "j":
+        self.taken = int(token[1:])
+      elif token[0] == "r":
+        self.repeat = int(token[1:])
+      else:
+        assert False, "Bad cycles: " + desc
+
+
 class Opcode:
   def __init__(self):
     self.opcode = None
     self.name = ""
     self.args = []
+    self.cycles = None
 
 
   def getWordSuffix(self, args = None):
@@ -99,6 +129,7 @@ base_opcodes = []
 group_opcodes = collections.defaultdict(list)
 
 for line in file(OPCODES_TABLE_FILENAME, "rb"):
+  line, _, cycles = line.partition(";")
   tokens = line.strip().split()
 
   if len(tokens) < 2 or tokens[1] == "--":
@@ -108,6 +139,8 @@ for line in file(OPCODES_TABLE_FILENAME, "rb"):
   opcode = Opcode()
   opcode.name = tokens[1].upper()
   opcode.args = tokens[2:]
+  if cycles.strip():
+    opcode.cycles = Cycles(cycles)
 
   for i, arg in enumerate(opcode.args):
     if arg[0] == "e" and arg[1:] in REGS_16:
@@ -187,132 +220,267 @@ def addMethod(opcode, args = None):
   return method
 
 
-def getFetchArgCode(args):
+# Opcodes whose first argument is only read. The second one always is, except
+# for XCHG.
+SOURCE_ARG1_OPCODES = ["CMP", "TEST", "PUSH", "MUL", "IMUL", "DIV", "IDIV",
+                       "CALL", "JMP"]
+
+
+def getFetchArgCode(name, args):
   lines = []
   suffixes = ["arg1", "arg2"]
 
   for arg in args:
     suffix = suffixes.pop(0)
+    if suffix == "arg1":
+      source = name in SOURCE_ARG1_OPCODES
+    else:
+      source = name != "XCHG"
+    mem_params = "<kDescribe, true>" if source else "<kDescribe>"
     
     if arg in REGS_16:
-      lines.append("addConstArgDesc(\"%s\");" % arg)
-      lines.append("w%s = getReg16Ptr(R16_%s);" % (suffix, arg))
+      lines.append("w%s = decodeFixedReg_w<kDescribe>(R16_%s);" % (suffix, arg))
     elif arg in REGS_8:
-      lines.append("addConstArgDesc(\"%s\");" % arg)
-      lines.append("b%s = getReg8Ptr(R8_%s);" % (suffix, arg))
+      lines.append("b%s = decodeFixedReg_b<kDescribe>(R8_%s);" % (suffix, arg))
     elif arg in ["Gv"]:
-      lines.append("w%s = decodeReg_w();" % suffix)
+      lines.append("w%s = decodeReg_w<kDescribe>();" % suffix)
     elif arg in ["Ev", "Ew", "Mp"]:
-      lines.append("w%s = decodeRM_w();" % suffix)
+      lines.append("w%s = decodeRM_w%s();" % (suffix, mem_params))
     elif arg in ["Gb"]:
-      lines.append("b%s = decodeReg_b();" % suffix)
+      lines.append("b%s = decodeReg_b<kDescribe>();" % suffix)
     elif arg in ["Eb"]:
-      lines.append("b%s = decodeRM_b();" % suffix)
+      lines.append("b%s = decodeRM_b%s();" % (suffix, mem_params))
     elif arg in ["Sw"]:
-      lines.append("w%s = decodeS();" % suffix)
+      lines.append("w%s = decodeS<kDescribe>();" % suffix)
     elif arg in ["Iv", "Iw"]:
-      lines.append("w%s = decodeI_w();" % suffix)
+      lines.append("w%s = decodeI_w<kDescribe>();" % suffix)
     elif arg in ["Ib"]:
-      lines.append("b%s = decodeI_b();" % suffix)
+      lines.append("b%s = decodeI_b<kDescribe>();" % suffix)
     elif arg in ["Jv"]:
-      lines.append("w%s = decodeJ_w();" % suffix)
+      lines.append("w%s = decodeJ_w<kDescribe>();" % suffix)
     elif arg in ["Jb"]:
-      lines.append("w%s = decodeJ_b();" % suffix)
+      lines.append("w%s = decodeJ_b<kDescribe>();" % suffix)
     elif arg in ["1", "3"]:
       is_byte = not lines or lines[-1][0] == "b"
       if is_byte:
-        lines.append("b%s = addConstArg_b(%s);" % (suffix, arg))
+        lines.append("b%s = addConstArg_b<kDescribe>(%s);" % (suffix, arg))
       else:
-        lines.append("w%s = addConstArg_w(%s);" % (suffix, arg))
+        lines.append("w%s = addConstArg_w<kDescribe>(%s);" % (suffix, arg))
     elif arg in ["Ov", "Ow"]:
-      lines.append("w%s = decodeO_w();" % suffix);
+      lines.append("w%s = decodeO_w%s();" % (suffix, mem_params))
     elif arg in ["Ob"]:
-      lines.append("b%s = decodeO_b();" % suffix);
+      lines.append("b%s = decodeO_b%s();" % (suffix, mem_params))
 
   return lines
 
 
-DISPATCHER = "if (false) {\n"
-for opcode in base_opcodes:  
-  # Generate top-level switch.
-  desc = opcode.name + " " + ", ".join(opcode.args)
-  DISPATCHER += "} else if (opcode_ == 0x%02X) {  // %s\n" % (opcode.opcode,
-                                                              desc.strip())
-  
-  group = None
-  if opcode.name.startswith("GRP"):
-    group = opcode.name
-    DISPATCHER += "  int op = decodeGRP();\n"
-
-    assert group_opcodes.has_key(group)
-    op_group = group_opcodes[group]
-    
-    first = True
-    for subopcode in op_group:
-      if first:
-        cppif = "if "
-        first = False
-      else:
-        cppif = "} else if "
+def getCyclesCode(cycles):
+  """Returns the code accounting for the cycles of an opcode, as a list of
+  lines. It runs after the arguments are decoded."""
+  assert cycles
+  lines = []
+  if cycles.repeat is not None:
+    lines.append("if (rep_opcode_ == 0) {")
+    lines.append("  instruction_cycles_ += %d;" % cycles.reg)
+    lines.append("}")
+    lines.append("rep_cycles_ = %d;" % cycles.repeat)
+  elif cycles.mem is not None:
+    lines.append("instruction_cycles_ += (mem_operand_count_ == 0) ? %d :" %
+                 cycles.reg)
+    lines.append("    %d + ea_cycles_;" % cycles.mem)
+  else:
+    lines.append("instruction_cycles_ += %d;" % cycles.reg)
 
-      args = subopcode.args or opcode.args
-      method = addMethod(subopcode, args)
-      desc = subopcode.name + " " + ", ".join(args)
-      DISPATCHER += "  " + cppif + "(op == 0x%02X) {  // %s\n" % (subopcode.opcode, desc.strip())
-      DISPATCHER += "    opcode_desc_ = \"%s\";\n" % subopcode.name
+  if cycles.taken is not None:
+    lines.append("branch_cycles_ = %d;" % (cycles.taken - cycles.reg))
+  return lines
 
-      for line in getFetchArgCode(args):
-        DISPATCHER += "    " + line + "\n"
-   
-      DISPATCHER += "    handler_ = &X86Base::%s;\n" % method.cpp_name
 
-    DISPATCHER += "  }\n"
+def getOpcodeCode(opcode):
+  """Returns the decoding code for a non-group opcode, as a list of lines."""
+  lines = []
+  method = addMethod(opcode)
+
+  if method.name not in PREFIX_OPCODES:
+    lines.append("opcode_desc_ = \"%s\";" % opcode.name)
+
+  if method.name in SEGMENT_OVERRIDE_OPCODES:
+    # Segment override.
+    assert len(method.name) == 3
+    assert method.name[2] == ":"
+    reg = method.name[:2]
+    lines.append("segment_ = getReg16(R16_%s);" % reg)
+    lines.append("segment_reg_ = R16_%s;" % reg)
+    lines.append("segment_desc_ = \"%s\";" % method.name)
+    lines += getCyclesCode(opcode.cycles)
+
+  elif method.name in REP_OPCODES:
+    # REP opcode.
+    lines.append("rep_opcode_ = opcode_;")
+    lines.append("rep_opcode_desc_ = \"%s \";" % method.name)
+    lines += getCyclesCode(opcode.cycles)
 
   else:
-    method = addMethod(opcode)
-
-    if method.name not in PREFIX_OPCODES:
-      DISPATCHER += "  opcode_desc_ = \"%s\";\n" % opcode.name
-
-    if method.name in SEGMENT_OVERRIDE_OPCODES:
-      # Segment override.
-      assert len(method.name) == 3
-      assert method.name[2] == ":"
-      reg = method.name[:2]
-      DISPATCHER += "  segment_ = *getReg16Ptr(R16_%s);\n" % reg
-      DISPATCHER += "  segment_desc_ = \"%s\";\n" % method.name
-  
-    elif method.name in REP_OPCODES:
-      # REP opcode.
-      DISPATCHER += "  rep_opcode_ = opcode_;\n"
-      DISPATCHER += "  rep_opcode_desc_ = \"%s \";\n" % method.name
-  
+    # General case opcode. Generate code to prepare the arguments.
+    lines += getFetchArgCode(opcode.name, opcode.args)
+    lines += getCyclesCode(opcode.cycles)
+
+    # Call the custom implementation.
+    lines.append("operation_ = OP_%s;" % method.cpp_name)
+
+  return lines
+
+
+def getSubopcodeCode(opcode, subopcode):
+  """Returns the decoding code for an opcode within a group."""
+  args = subopcode.args or opcode.args
+  method = addMethod(subopcode, args)
+
+  lines = ["opcode_desc_ = \"%s\";" % subopcode.name]
+  lines += getFetchArgCode(subopcode.name, args)
+  lines += getCyclesCode(subopcode.cycles or opcode.cycles)
+  lines.append("operation_ = OP_%s;" % method.cpp_name)
+  return lines
+
+
+def getDesc(name, args):
+  return (name + " " + ", ".join(args)).strip()
+
+
+def indent(lines, level):
+  return ["  " * level + line for line in lines]
+
+
+#
+# Generate a switch-based dispatcher. Opcodes and group sub-opcodes are dense,
+# so the compiler turns both levels into jump tables.
+#
+def generateSwitchDispatcher():
+  out = ["switch (opcode_) {"]
+  for opcode in base_opcodes:
+    out.append("  case 0x%02X: {  // %s" % (opcode.opcode,
+                                           getDesc(opcode.name, opcode.args)))
+
+    if opcode.name.startswith("GRP"):
+      group = opcode.name
+      assert group_opcodes.has_key(group)
+
+      out.append("    switch (decodeGRP()) {")
+      for subopcode in group_opcodes[group]:
+        args = subopcode.args or opcode.args
+        out.append("      case 0x%02X: {  // %s" % (subopcode.opcode,
+                                                   getDesc(subopcode.name, args)))
+        out += indent(getSubopcodeCode(opcode, subopcode), 4)
+        out.append("        break;")
+        out.append("      }")
+      out.append("    }")
+
     else:
-      # General case opcode. Generate code to prepare the arguments.
-      for line in getFetchArgCode(opcode.args):
-        DISPATCHER += "  " + line + "\n"
-  
-      # Call the custom implementation.
-      DISPATCHER += "  handler_ = &X86Base::%s;\n" % method.cpp_name
- 
-DISPATCHER += "}"
+      out += indent(getOpcodeCode(opcode), 2)
+
+    out.append("    break;")
+    out.append("  }")
+
+  out.append("}")
+  return out
+
+
+#
+# Generate a "threaded" dispatcher using the GCC computed goto extension. Each
+# opcode and group sub-opcode gets a label, and 256-entry (resp. 8-entry)
+# tables of label addresses are indexed directly.
+#
+def generateThreadedDispatcher():
+  tables = []
+  code = []
+
+  labels = ["&&op_invalid"] * 256
+  for opcode in base_opcodes:
+    label = "op_%02X" % opcode.opcode
+    labels[opcode.opcode] = "&&" + label
+
+    code.append("%s: {  // %s" % (label, getDesc(opcode.name, opcode.args)))
+
+    if opcode.name.startswith("GRP"):
+      group = opcode.name
+      assert group_opcodes.has_key(group)
+
+      group_table = "kGroup%02X" % opcode.opcode
+      group_labels = ["&&op_invalid"] * 8
+      sub_code = []
+      for subopcode in group_opcodes[group]:
+        sub_label = "op_%02X_%d" % (opcode.opcode, subopcode.opcode)
+        group_labels[subopcode.opcode] = "&&" + sub_label
+
+        args = subopcode.args or opcode.args
+        sub_code.append("%s: {  // %s" % (sub_label,
+                                          getDesc(subopcode.name, args)))
+        sub_code += indent(getSubopcodeCode(opcode, subopcode), 1)
+        sub_code.append("  goto op_done;")
+        sub_code.append("}")
+
+      tables.append("static void* const %s[8] = {" % group_table)
+      tables.append("  " + ", ".join(group_labels))
+      tables.append("};")
+
+      code.append("  goto *%s[decodeGRP()];" % group_table)
+      code.append("}")
+      code += sub_code
+
+    else:
+      code += indent(getOpcodeCode(opcode), 1)
+      code.append("  goto op_done;")
+      code.append("}")
+
+  out = ["static void* const kOpcodes[256] = {"]
+  for i in range(0, 256, 8):
+    out.append("  " + ", ".join(labels[i:i + 8]) + ",")
+  out.append("};")
+  out += tables
+  out.append("")
+  out.append("goto *kOpcodes[opcode_];")
+  out += code
+  out.append("op_invalid:")
+  out.append("op_done:")
+  out.append("  ;")
+  return out
+
+
+DISPATCHER = ["#ifdef X86_THREADED_DISPATCH"] + \
+             generateThreadedDispatcher() + \
+             ["#else"] + \
+             generateSwitchDispatcher() + \
+             ["#endif  // X86_THREADED_DISPATCH"]
 
 
 #
-# Generate the cpp file.
+# Generate the cpp file. The decoder moved to the statically dispatched header,
+# so there's nothing to insert.
 #
-cpp_code = insertCode(file(CPP_TEMPLATE, "rb").read(), DISPATCHER, GENERATED_CODE_PLACEHOLDER)
-file(CPP_OUT, "wb").write(cpp_code)
+file(CPP_OUT, "wb").write(file(CPP_TEMPLATE, "rb").read())
 
 
 #
 # Generate the header file.
 #
 declarations = []
+
+# Identifiers for the opcode implementations, so the pending operation can be
+# inspected without comparing member function pointers. The placeholder sits
+# at access specifier indentation.
+declarations.append("public:")
+declarations.append(" enum Operation {")
+declarations.append("   OP_NONE,")
+for mname in sorted(methods.keys()):
+  declarations.append("   OP_%s," % methods[mname].cpp_name)
+declarations.append(" };")
+declarations.append("")
+declarations.append("protected:")
+
 for mname in sorted(methods.keys()):
   method = methods[mname]
 
-  decl = "virtual void %-6s() {" % method.cpp_name
+  decl = " virtual void %-6s() {" % method.cpp_name
   if method.name not in NON_MANDATORY_OPCODES:
     decl += " notImplemented(\"%s\"); " % method.name
   decl += "}" 
@@ -323,3 +491,28 @@ METHODS = "\n".join(declarations)
 
 h_code = insertCode(file(H_TEMPLATE, "rb").read(), METHODS, GENERATED_CODE_PLACEHOLDER)
 file(H_OUT, "wb").write(h_code)
+
+
+#
+# Generate the statically dispatched header: the decoder and a switch calling
+# each opcode implementation on Derived directly, so they can be inlined.
+#
+definitions = []
+definitions.append("template <class Derived>")
+definitions.append("template <bool kDescribe>")
+definitions.append("void X86BaseT<Derived>::decodeOpcode() {")
+definitions += indent(DISPATCHER, 1)
+definitions.append("}")
+definitions.append("")
+definitions.append("template <class Derived>")
+definitions.append("void X86BaseT<Derived>::callHandler() {")
+definitions.append("  switch (operation_) {")
+for mname in sorted(methods.keys()):
+  method = methods[mname]
+  definitions.append("    case OP_%s: self()->Derived::%s(); break;" %
+                     (method.cpp_name, method.cpp_name))
+definitions.append("  }")
+definitions.append("}")
+
+h_t_code = insertCode(file(H_T_TEMPLATE, "rb").read(), "\n".join(definitions), GENERATED_CODE_PLACEHOLDER)
+file(H_T_OUT, "wb").write(h_t_code)
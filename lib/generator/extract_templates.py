@@ -7,11 +7,14 @@ GENERATED_CODE_END = "// END GENERATED CODE"
 
 CPP_OUT = "../x86_base.cpp"
 H_OUT = "../x86_base.h"
+H_T_OUT = "../x86_base_t.h"
 
 CPP_TEMPLATE = "x86_base.cpp.template"
 H_TEMPLATE = "x86_base.h.template"
+H_T_TEMPLATE = "x86_base_t.h.template"
 
-for src, dst in [(CPP_OUT, CPP_TEMPLATE), (H_OUT, H_TEMPLATE)]:
+for src, dst in [(CPP_OUT, CPP_TEMPLATE), (H_OUT, H_TEMPLATE),
+                 (H_T_OUT, H_T_TEMPLATE)]:
   out = []
   begin = False
   end = False
@@ -60,17 +60,32 @@ SDL_Texture* Image::getTexture(SDL_Renderer* renderer) {
 // 
 // A Window.
 //
+static void copyTexture(SDL_Renderer* renderer, SDL_Texture* from,
+                        SDL_Texture* to) {
+  // Replaced rather than blended, so the copy is exact.
+  SDL_BlendMode blend_mode;
+  SDL_GetTextureBlendMode(from, &blend_mode);
+  SDL_SetTextureBlendMode(from, SDL_BLENDMODE_NONE);
+  SDL_SetRenderTarget(renderer, to);
+  SDL_RenderCopy(renderer, from, nullptr, nullptr);
+  SDL_SetTextureBlendMode(from, blend_mode);
+}
+
+
 Window::Window(int width, int height, const string& title) {
   SDL_CreateWindowAndRenderer(width, height, 0, &window_, &renderer_);
   SDL_SetWindowTitle(window_, title.data());
   buffer_ = SDL_CreateTexture(renderer_, SDL_PIXELFORMAT_RGBA8888,
                               SDL_TEXTUREACCESS_TARGET, width, height);
+  saved_ = SDL_CreateTexture(renderer_, SDL_PIXELFORMAT_RGBA8888,
+                             SDL_TEXTUREACCESS_TARGET, width, height);
 
   SDL_SetRenderTarget(renderer_, buffer_);
 }
 
 
 Window::~Window() {
+  SDL_DestroyTexture(saved_);
   SDL_DestroyTexture(buffer_);
   SDL_DestroyRenderer(renderer_);
   SDL_DestroyWindow(window_);
@@ -87,11 +102,17 @@ void Window::update() {
 
   SDL_RenderPresent(renderer_);
   SDL_SetRenderTarget(renderer_, buffer_);
+}
 
-  SDL_Event event;
-  while (SDL_PollEvent(&event)) {
-    // TODO: consume input events and feed them back to the emulator.
-  }
+
+void Window::saveContents() {
+  copyTexture(renderer_, buffer_, saved_);
+  SDL_SetRenderTarget(renderer_, buffer_);
+}
+
+
+void Window::restoreContents() {
+  copyTexture(renderer_, saved_, buffer_);
 }
 
 
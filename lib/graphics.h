@@ -47,12 +47,21 @@ class Window {
 
   void drawImage(Image* image, int x, int y);
 
+  // Presents what's been drawn. Events are left in the queue, which is
+  // shared by all windows, for the Monitor to pass the keys on.
   void update();
 
+  // Keeps a copy of what's been drawn, to go back to with restoreContents(),
+  // e.g. after drawing frames that are then undone. The copy stays on the
+  // GPU.
+  void saveContents();
+  void restoreContents();
+
  private:
   SDL_Window* window_;
   SDL_Renderer* renderer_;
   SDL_Texture* buffer_;
+  SDL_Texture* saved_;
 };
 
 #endif // __GRAPHICS_H__
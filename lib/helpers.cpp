@@ -176,6 +176,56 @@ string strip(const string& str) {
 }
 
 
+void writeVarint(long long value, vector<byte>* out) {
+  ASSERT(value >= 0);
+  while (value >= 0x80) {
+    out->push_back((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+
+long long readVarint(const vector<byte>& in, size_t* position) {
+  long long value = 0;
+  int shift = 0;
+  byte b;
+  do {
+    ASSERT(*position < in.size());
+    b = in[(*position)++];
+    value |= (long long)(b & 0x7F) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return value;
+}
+
+
+void writeUint64(unsigned long long value, vector<byte>* out) {
+  for (int i = 0; i < 8; i++) {
+    out->push_back(value >> (i * 8));
+  }
+}
+
+
+unsigned long long readUint64(const vector<byte>& in, size_t* position) {
+  ASSERT(*position + 8 <= in.size());
+  unsigned long long value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (unsigned long long)in[(*position)++] << (i * 8);
+  }
+  return value;
+}
+
+
+unsigned long long hashBytes(unsigned long long hash, const byte* data,
+                             int size) {
+  for (int i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+
 void saveRGBToPPM(byte* rgb, int width, int height, const string& filename) {
   ofstream file(filename);
   file << "P6\n";
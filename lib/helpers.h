@@ -71,8 +71,10 @@ bool parseBool(const std::string& str);
 int parseNumber(const std::string& str);
 
 
-// ASSERT and related functionality.
-#define ASSERT(COND) assertHelper(COND, #COND, __FILE__, __LINE__)
+// ASSERT and related functionality. The condition is tested inline so passing
+// asserts don't build the message.
+#define ASSERT(COND) \
+  ((COND) ? (void)0 : assertHelper(false, #COND, __FILE__, __LINE__))
 #define FATAL(MSG) fatalHelper(MSG, __FILE__, __LINE__)
 
 void fatalHelper(const std::string& msg, const char* file, int line);
@@ -83,6 +85,23 @@ void assertHelper(bool cond, const std::string& msg, const char* file, int line)
 void saveRGBToPPM(byte* rgb, int width, int height, const std::string& filename);
 
 
+// Variable length encoding of non-negative numbers, 7 bits per byte, for
+// compact binary data. Reading past the end, or writing a negative number,
+// is fatal.
+void writeVarint(long long value, std::vector<byte>* out);
+long long readVarint(const std::vector<byte>& in, size_t* position);
+
+// 8 bytes, little endian, e.g. for hashes.
+void writeUint64(unsigned long long value, std::vector<byte>* out);
+unsigned long long readUint64(const std::vector<byte>& in, size_t* position);
+
+// FNV-1a hash of the given bytes, continuing the given hash; start from
+// kHashSeed.
+const unsigned long long kHashSeed = 0xCBF29CE484222325ULL;
+unsigned long long hashBytes(unsigned long long hash, const byte* data,
+                             int size);
+
+
 // Misc.
 bool fileExists(const std::string& path);
 
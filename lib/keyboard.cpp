@@ -0,0 +1,171 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "keyboard.h"
+#include "x86.h"
+
+using namespace std;
+
+static const int kDataPort = 0x60;
+static const int kStatusPort = 0x64;
+
+// Time between scancodes when several are waiting, about a millisecond.
+static const int kDeliverDelay = X86::kClockRate / 1000;
+
+static const byte kReleased = 0x80;
+static const byte kLeftShift = 0x2A;
+static const byte kRightShift = 0x36;
+
+// ASCII for the scancodes of the US layout, up to the space bar.
+static const int kASCIIKeys = 0x3A;
+static const char kASCII[2][kASCIIKeys + 1] = {
+  "\0\x1b" "1234567890-=" "\b\t" "qwertyuiop[]" "\r\0" "asdfghjkl;'`"
+  "\0\\" "zxcvbnm,./" "\0*\0 ",
+  "\0\x1b" "!@#$%^&*()_+" "\b\t" "QWERTYUIOP{}" "\r\0" "ASDFGHJKL:\"~"
+  "\0|" "ZXCVBNM<>?" "\0*\0 ",
+};
+
+static bool isModifier(byte scancode) {
+  return scancode == 0x1D || scancode == kLeftShift ||
+         scancode == kRightShift || scancode == 0x38 || scancode == 0x3A;
+}
+
+
+Keyboard::Keyboard(X86* x86)
+  : x86_(x86), output_(0), output_full_(false), delivery_scheduled_(false),
+    left_shift_(false), right_shift_(false) {
+  x86_->registerIOHandler(this, kDataPort);
+  x86_->registerIOHandler(this, kStatusPort);
+  x86_->registerInterruptHandler(this, 0x09);
+  x86_->registerInterruptHandler(this, 0x16);
+}
+
+
+void Keyboard::handleKey(byte scancode, bool pressed) {
+  if ((int)queue_.size() == kQueueSize) {
+    return;
+  }
+  queue_.push_back(pressed ? scancode : scancode | kReleased);
+  if (!output_full_ && !delivery_scheduled_) {
+    deliverNext();
+  }
+}
+
+
+void Keyboard::handleInterrupt(int num) {
+  if (num == 0x09) {
+    handleScancode(handleIN(kDataPort));
+    return;
+  }
+
+  ASSERT(num == 0x16);
+  Registers* regs = x86_->getRegisters();
+  if (regs->ah == 0x00 || regs->ah == 0x10) {
+    // Wait for a keystroke by executing INT 16h again, so interrupts keep
+    // being delivered meanwhile.
+    if (buffer_.empty()) {
+      regs->ip -= 2;
+      return;
+    }
+    regs->ax = buffer_.front();
+    buffer_.pop_front();
+  } else if (regs->ah == 0x01 || regs->ah == 0x11) {
+    x86_->setFlag(X86::F_ZF, buffer_.empty());
+    if (!buffer_.empty()) {
+      regs->ax = buffer_.front();
+    }
+  } else if (regs->ah == 0x02) {
+    regs->al = (right_shift_ ? 0x01 : 0) | (left_shift_ ? 0x02 : 0);
+  } else {
+    cerr << "Keyboard: Unknown interrupt command 0x" << Hex8 << (int)regs->ah
+         << endl;
+  }
+}
+
+
+byte Keyboard::handleIN(int port) {
+  if (port == kStatusPort) {
+    return output_full_ ? 0x01 : 0x00;
+  }
+
+  if (output_full_) {
+    output_full_ = false;
+    if (!queue_.empty() && !delivery_scheduled_) {
+      x86_->getEventScheduler()->schedule(
+          x86_->getCycleCount() + kDeliverDelay, this, kDeliverEvent);
+      delivery_scheduled_ = true;
+    }
+  }
+  return output_;
+}
+
+
+void Keyboard::handleOUT(int port, byte val) {
+  // Controller commands and LEDs aren't emulated.
+}
+
+
+void Keyboard::handleEvent(int event, long long cycle) {
+  ASSERT(event == kDeliverEvent);
+  delivery_scheduled_ = false;
+  deliverNext();
+}
+
+
+void Keyboard::saveState(State* state) const {
+  state->queue = queue_;
+  state->output = output_;
+  state->output_full = output_full_;
+  state->delivery_scheduled = delivery_scheduled_;
+  state->left_shift = left_shift_;
+  state->right_shift = right_shift_;
+  state->buffer = buffer_;
+}
+
+
+void Keyboard::restoreState(const State& state) {
+  queue_ = state.queue;
+  output_ = state.output;
+  output_full_ = state.output_full;
+  delivery_scheduled_ = state.delivery_scheduled;
+  left_shift_ = state.left_shift;
+  right_shift_ = state.right_shift;
+  buffer_ = state.buffer;
+}
+
+
+void Keyboard::handleScancode(byte scancode) {
+  bool released = (scancode & kReleased) != 0;
+  scancode &= ~kReleased;
+  if (scancode == kLeftShift) {
+    left_shift_ = !released;
+  } else if (scancode == kRightShift) {
+    right_shift_ = !released;
+  }
+  if (released || isModifier(scancode) ||
+      (int)buffer_.size() == kBufferSize) {
+    return;
+  }
+
+  byte ascii = 0;
+  if (scancode < kASCIIKeys) {
+    ascii = kASCII[left_shift_ || right_shift_][scancode];
+  }
+  buffer_.push_back(scancode << 8 | ascii);
+}
+
+
+void Keyboard::deliverNext() {
+  if (queue_.empty()) {
+    return;
+  }
+  output_ = queue_.front();
+  queue_.pop_front();
+  output_full_ = true;
+  x86_->requestIRQ(1);
+}
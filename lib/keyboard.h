@@ -0,0 +1,80 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __KEYBOARD_H__
+#define __KEYBOARD_H__
+
+#include "device.h"
+
+#include <deque>
+
+class X86;
+
+//
+// Keyboard controller, at ports 60h and 64h. Each key press or release puts
+// its scancode in the output buffer and raises IRQ 1; the next one follows a
+// moment after the previous one is read from port 60h.
+//
+// Also provides the BIOS INT 09h handler, which keeps the shift state and
+// queues keystrokes, and the INT 16h services that read them, for programs
+// that don't install their own.
+//
+class Keyboard : public InterruptHandler, public IOHandler,
+                 public EventHandler, public KeyHandler {
+ public:
+  Keyboard(X86* x86);
+
+  virtual void handleInterrupt(int num) override;
+  virtual byte handleIN(int port) override;
+  virtual void handleOUT(int port, byte val) override;
+  virtual void handleEvent(int event, long long cycle) override;
+
+  // Must be called from the thread running the X86, between instructions.
+  virtual void handleKey(byte scancode, bool pressed) override;
+
+  // The controller and the BIOS buffer, for snapshots. The delivery event is
+  // saved with the X86.
+  struct State {
+    std::deque<byte> queue;
+    byte output;
+    bool output_full;
+    bool delivery_scheduled;
+    bool left_shift, right_shift;
+    std::deque<word> buffer;
+  };
+
+  void saveState(State* state) const;
+  void restoreState(const State& state);
+
+ private:
+  static const int kDeliverEvent = 0;
+
+  // Keystrokes the BIOS buffer holds, like the original 16-byte one.
+  static const int kBufferSize = 15;
+
+  // Scancodes waiting for the output buffer to be read.
+  static const int kQueueSize = 16;
+
+  // Takes the output buffer, as the BIOS INT 09h handler would.
+  void handleScancode(byte scancode);
+  void deliverNext();
+
+  X86* x86_;
+
+  std::deque<byte> queue_;
+  byte output_;
+  bool output_full_;
+  bool delivery_scheduled_;
+
+  bool left_shift_, right_shift_;
+
+  // BIOS keystrokes, as scancode << 8 | ASCII.
+  std::deque<word> buffer_;
+};
+
+#endif  // __KEYBOARD_H__
@@ -33,7 +33,9 @@ void Loader::loadCOM(const string& filename, Memory* mem, X86Base* x86,
   end = size;
 
   file.seekg(0, ios::beg);
-  file.read((char*)mem->getPointer(kCOMOffset), size);
+  byte* data = mem->getPointer(kCOMOffset, size);
+  ASSERT(data != nullptr);
+  file.read((char*)data, size);
 
   *x86->getReg16Ptr(X86::R16_CS) = 0;
   *x86->getReg16Ptr(X86::R16_DS) = 0;
@@ -9,9 +9,10 @@
 #ifndef __LOADER_H__
 #define __LOADER_H__
 
+#include "memory.h"
+
 #include <string>
 
-class Memory;
 class X86Base;
 
 class Loader {
@@ -0,0 +1,351 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "machine_image.h"
+#include "memory.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+const char kMagic[] = "EBRI";
+const int kMagicSize = 4;
+const byte kVersion = 3;
+
+const int kHeaderSize = kMagicSize + 1 + 8;
+
+byte readByte(const vector<byte>& in, size_t* position) {
+  ASSERT(*position < in.size());
+  return in[(*position)++];
+}
+
+
+// Cycles can be negative, e.g. the PIT's start cycles after a reset, so
+// they're zigzag encoded: 0, -1, 1, -2... as 0, 1, 2, 3...
+void writeSigned(long long value, vector<byte>* out) {
+  writeVarint(((unsigned long long)value << 1) ^ (value >> 63), out);
+}
+
+
+long long readSigned(const vector<byte>& in, size_t* position) {
+  unsigned long long value = readVarint(in, position);
+  return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+
+void writeDeque(const deque<byte>& values, vector<byte>* out) {
+  writeVarint(values.size(), out);
+  for (byte value : values) {
+    out->push_back(value);
+  }
+}
+
+
+void writeDeque(const deque<word>& values, vector<byte>* out) {
+  writeVarint(values.size(), out);
+  for (word value : values) {
+    writeVarint(value, out);
+  }
+}
+
+
+void writeCPU(const X86::State& state, vector<byte>* out) {
+  for (word reg : state.regs.regs16) {
+    writeVarint(reg, out);
+  }
+  writeVarint(state.regs.flags, out);
+  writeVarint((unsigned)state.lazy_result, out);
+  out->push_back(state.lazy_is_word);
+  writeVarint(state.lazy_flags, out);
+
+  writeSigned(state.cycle_count, out);
+  out->push_back(state.pending_irqs);
+  writeVarint(state.current_cs, out);
+  writeVarint(state.current_ip, out);
+  writeVarint(state.bytes_fetched, out);
+
+  writeVarint(state.call_stack.size(), out);
+  for (const auto& call : state.call_stack) {
+    writeVarint(call.first, out);
+    writeVarint(call.second, out);
+  }
+}
+
+
+void readCPU(const vector<byte>& in, size_t* position, X86::State* state) {
+  for (word& reg : state->regs.regs16) {
+    reg = readVarint(in, position);
+  }
+  state->regs.flags = readVarint(in, position);
+  state->lazy_result = (unsigned)readVarint(in, position);
+  state->lazy_is_word = readByte(in, position) != 0;
+  state->lazy_flags = readVarint(in, position);
+
+  state->cycle_count = readSigned(in, position);
+  state->pending_irqs = readByte(in, position);
+  state->execute_pending = false;
+  state->current_cs = readVarint(in, position);
+  state->current_ip = readVarint(in, position);
+  state->bytes_fetched = readVarint(in, position);
+
+  int call_stack_size = readVarint(in, position);
+  ASSERT(call_stack_size >= 0 && call_stack_size <= X86::kCallStackSize);
+  state->call_stack.resize(call_stack_size);
+  for (auto& call : state->call_stack) {
+    call.first = readVarint(in, position);
+    call.second = readVarint(in, position);
+  }
+}
+
+
+void writePIT(const PIT::State& state, vector<byte>* out) {
+  for (const PIT::Channel& channel : state.channels) {
+    writeVarint(channel.reload, out);
+    writeVarint(channel.access, out);
+    writeVarint(channel.mode, out);
+    out->push_back(channel.write_high);
+    out->push_back(channel.read_high);
+    out->push_back(channel.low_byte);
+    out->push_back(channel.latched);
+    writeVarint(channel.latch, out);
+    writeSigned(channel.start_cycle, out);
+  }
+  out->push_back(state.port_61);
+}
+
+
+void readPIT(const vector<byte>& in, size_t* position, PIT::State* state) {
+  for (PIT::Channel& channel : state->channels) {
+    channel.reload = readVarint(in, position);
+    channel.access = readVarint(in, position);
+    channel.mode = readVarint(in, position);
+    channel.write_high = readByte(in, position) != 0;
+    channel.read_high = readByte(in, position) != 0;
+    channel.low_byte = readByte(in, position);
+    channel.latched = readByte(in, position) != 0;
+    channel.latch = readVarint(in, position);
+    channel.start_cycle = readSigned(in, position);
+  }
+  state->port_61 = readByte(in, position);
+}
+
+
+void writeKeyboard(const Keyboard::State& state, vector<byte>* out) {
+  writeDeque(state.queue, out);
+  out->push_back(state.output);
+  out->push_back(state.output_full);
+  out->push_back(state.delivery_scheduled);
+  out->push_back(state.left_shift);
+  out->push_back(state.right_shift);
+  writeDeque(state.buffer, out);
+}
+
+
+void readKeyboard(const vector<byte>& in, size_t* position,
+                  Keyboard::State* state) {
+  state->queue.resize(readVarint(in, position));
+  for (byte& value : state->queue) {
+    value = readByte(in, position);
+  }
+  state->output = readByte(in, position);
+  state->output_full = readByte(in, position) != 0;
+  state->delivery_scheduled = readByte(in, position) != 0;
+  state->left_shift = readByte(in, position) != 0;
+  state->right_shift = readByte(in, position) != 0;
+  state->buffer.resize(readVarint(in, position));
+  for (word& value : state->buffer) {
+    value = readVarint(in, position);
+  }
+}
+
+}  // namespace
+
+
+MachineImage::MachineImage(X86* x86, VGA* vga, PIT* pit, Keyboard* keyboard)
+  : x86_(x86), mem_(x86->getMemory()), vga_(vga), pit_(pit),
+    keyboard_(keyboard) {
+}
+
+
+void MachineImage::save(const string& filename,
+                        unsigned long long program_hash) const {
+  X86::State x86;
+  x86_->saveState(&x86);
+
+  // An instruction decoded but not executed yet is decoded again.
+  if (x86.execute_pending) {
+    x86.regs.ip -= x86.bytes_fetched;
+    x86.bytes_fetched = 0;
+  }
+
+  vector<byte> header(kMagic, kMagic + kMagicSize);
+  header.push_back(kVersion);
+  writeUint64(program_hash, &header);
+  header.resize(kMemoryOffset);
+
+  vector<byte> state;
+  writeCPU(x86, &state);
+
+  vector<byte> events;
+  int event_count = 0;
+  for (const auto& event : x86.events.getPendingEvents()) {
+    if (event.handler == pit_ && pit_) {
+      events.push_back(DEVICE_PIT);
+    } else if (event.handler == keyboard_ && keyboard_) {
+      events.push_back(DEVICE_KEYBOARD);
+    } else {
+      continue;
+    }
+    writeVarint(event.event, &events);
+    writeSigned(event.cycle, &events);
+    event_count++;
+  }
+  writeVarint(event_count, &state);
+  state.insert(state.end(), events.begin(), events.end());
+
+  VGA::State vga;
+  vga_->saveState(&vga);
+  state.push_back(vga.mode);
+  state.push_back(vga.palette);
+
+  state.push_back(pit_ != nullptr);
+  if (pit_) {
+    PIT::State pit;
+    pit_->saveState(&pit);
+    writePIT(pit, &state);
+  }
+
+  state.push_back(keyboard_ != nullptr);
+  if (keyboard_) {
+    Keyboard::State keyboard;
+    keyboard_->saveState(&keyboard);
+    writeKeyboard(keyboard, &state);
+  }
+
+  ofstream file(filename, ios::out | ios::binary);
+  file.write((const char*)header.data(), header.size());
+  file.write((const char*)mem_->getRawPointer(0), Memory::kAddressSpace);
+  file.write((const char*)state.data(), state.size());
+  if (!file) {
+    FATAL("Can't write " + filename);
+  }
+}
+
+
+bool MachineImage::load(const string& filename,
+                        unsigned long long program_hash) {
+  ifstream file(filename, ios::in | ios::binary);
+  if (!file) {
+    return false;
+  }
+  vector<byte> header(kHeaderSize);
+  file.read((char*)header.data(), header.size());
+  if (!file) {
+    return false;
+  }
+  if (memcmp(header.data(), kMagic, kMagicSize) != 0) {
+    FATAL(filename + " isn't a machine image");
+  }
+  size_t position = kMagicSize;
+  if (header[position++] != kVersion ||
+      readUint64(header, &position) != program_hash) {
+    return false;
+  }
+
+  // The contents are read into a buffer and copied from there, rather than
+  // mapped: memory is a shared object mapped twice for the wrap-around
+  // mirror, and writing through getPointer() tells watchers and devices
+  // about every page, so decoded and translated code is invalidated.
+  vector<byte> contents(Memory::kAddressSpace);
+  file.seekg(kMemoryOffset);
+  file.read((char*)contents.data(), contents.size());
+  if (!file) {
+    return false;
+  }
+  vector<byte> state((istreambuf_iterator<char>(file)),
+                     istreambuf_iterator<char>());
+
+  // Everything is read before anything is restored. The readers throw if
+  // the image is truncated, like the checks here if it's corrupt; either
+  // way it's as if there was no image.
+  X86::State x86;
+  VGA::State vga;
+  PIT::State pit;
+  Keyboard::State keyboard;
+  try {
+    position = 0;
+    readCPU(state, &position, &x86);
+
+    int event_count = readVarint(state, &position);
+    for (int i = 0; i < event_count; i++) {
+      byte device = readByte(state, &position);
+      int event = readVarint(state, &position);
+      long long cycle = readSigned(state, &position);
+      EventHandler* handler =
+          (device == DEVICE_PIT) ? (EventHandler*)pit_ :
+          (device == DEVICE_KEYBOARD) ? keyboard_ : nullptr;
+      ASSERT(handler);
+      x86.events.schedule(cycle, handler, event);
+    }
+
+    vga.mode = readByte(state, &position);
+    vga.palette = readByte(state, &position);
+
+    ASSERT(readByte(state, &position) == (pit_ != nullptr));
+    if (pit_) {
+      readPIT(state, &position, &pit);
+    }
+
+    ASSERT(readByte(state, &position) == (keyboard_ != nullptr));
+    if (keyboard_) {
+      readKeyboard(state, &position, &keyboard);
+    }
+    ASSERT(position == state.size());
+  } catch (const runtime_error&) {
+    return false;
+  }
+
+  const int region_size = Memory::kRegionSize;
+  for (int address = 0; address < Memory::kAddressSpace;
+       address += region_size) {
+    byte* destination = nullptr;
+    if (address < mem_->getSize()) {
+      destination = mem_->getPointer(address, region_size);
+    }
+    if (!destination) {
+      destination = mem_->getRawPointer(address);
+    }
+    memcpy(destination, &contents[address], region_size);
+  }
+
+  x86_->restoreState(x86);
+  vga_->restoreState(vga);
+  if (pit_) {
+    pit_->restoreState(pit);
+  }
+  if (keyboard_) {
+    keyboard_->restoreState(keyboard);
+  }
+  return true;
+}
+
+
+unsigned long long MachineImage::hashFile(const string& filename) {
+  ifstream file(filename, ios::in | ios::binary);
+  if (!file) {
+    FATAL("Can't read " + filename);
+  }
+  vector<byte> data((istreambuf_iterator<char>(file)),
+                    istreambuf_iterator<char>());
+  return hashBytes(kHashSeed, data.data(), data.size());
+}
@@ -0,0 +1,75 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __MACHINE_IMAGE_H__
+#define __MACHINE_IMAGE_H__
+
+#include "keyboard.h"
+#include "pit.h"
+#include "vga.h"
+#include "x86.h"
+
+#include <string>
+
+//
+// The whole machine saved to a file, e.g. once the program has started up,
+// so later runs can resume from there instead of running the startup code
+// again. An image is tied to the program it was taken from, through a hash
+// of the program file, and to the version of the format.
+//
+// The events of the devices given are saved with the machine; those of
+// anything else, like a replay recorder, aren't.
+//
+// File format, with the counts as varints and the cycles as zigzag encoded
+// ones, since they can be negative:
+//
+//   "EBRI", version byte, hash of the program, 8 bytes little endian
+//   padding up to kMemoryOffset
+//   memory contents, kAddressSpace bytes
+//   CPU: registers, flags, cycle count, pending IRQs, call stack count and
+//        calls, outermost first
+//   events: count, then device (0 PIT, 1 keyboard), event id and cycle
+//   VGA, PIT and keyboard state
+//
+class MachineImage {
+ public:
+  // The PIT and the keyboard are optional, but must be given when loading
+  // if they were when saving.
+  MachineImage(X86* x86, VGA* vga, PIT* pit, Keyboard* keyboard = nullptr);
+
+  // Saves the machine. An instruction decoded but not executed yet, if any,
+  // is decoded again once loaded.
+  void save(const std::string& filename,
+            unsigned long long program_hash) const;
+
+  // Puts the machine the way it was saved. Returns false, leaving it as it
+  // was, if there's no such file, it's from another program or version, or
+  // it's truncated or corrupt. Fatal if the file isn't a machine image.
+  bool load(const std::string& filename, unsigned long long program_hash);
+
+  // Hash of the contents of a file, e.g. the program. Fatal if it can't be
+  // read.
+  static unsigned long long hashFile(const std::string& filename);
+
+ private:
+  // Where the memory contents start, past the header.
+  static const int kMemoryOffset = 4096;
+
+  enum Device {
+    DEVICE_PIT,
+    DEVICE_KEYBOARD,
+  };
+
+  X86* x86_;
+  Memory* mem_;
+  VGA* vga_;
+  PIT* pit_;
+  Keyboard* keyboard_;
+};
+
+#endif  // __MACHINE_IMAGE_H__
@@ -12,41 +12,417 @@
 #include <iostream>
 #include <sstream>
 
+#if !defined(_WIN32)
+#define MEMORY_MIRROR 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
-Memory::Memory(int size) {
+namespace {
+
+const int kAddressSpace = Memory::kAddressSpace;
+const int kMappedSize = Memory::kMappedSize;
+
+// Maps the address space and then the start of it again right after it, both
+// backed by the same shared memory object. Returns nullptr if that isn't
+// possible.
+byte* mapMirroredAddressSpace() {
+#ifdef MEMORY_MIRROR
+  stringstream name;
+  name << "/remakes-memory-" << getpid() << "-" << (void*)&name;
+  int fd = shm_open(name.str().c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1) {
+    return nullptr;
+  }
+  shm_unlink(name.str().c_str());
+
+  byte* data = nullptr;
+  if (ftruncate(fd, kAddressSpace) == 0) {
+    void* base = mmap(nullptr, kMappedSize, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base != MAP_FAILED) {
+      data = (byte*)base;
+      const int kProt = PROT_READ | PROT_WRITE;
+      const int kFlags = MAP_SHARED | MAP_FIXED;
+      if (mmap(data, kAddressSpace, kProt, kFlags, fd, 0) == MAP_FAILED ||
+          mmap(data + kAddressSpace, kMappedSize - kAddressSpace, kProt,
+               kFlags, fd, 0) == MAP_FAILED) {
+        munmap(base, kMappedSize);
+        data = nullptr;
+      }
+    }
+  }
+  close(fd);
+  return data;
+#else
+  return nullptr;
+#endif
+}
+
+}  // namespace
+
+
+template <class AccessPolicy>
+MemoryT<AccessPolicy>::MemoryT(int size)
+  : regions_(kMappedSize >> kRegionBits, Region{REGION_RAM, nullptr}),
+    page_watcher_(nullptr), next_snapshot_id_(0) {
+  ASSERT(size > 0 && size <= kAddressSpace);
   size_ = size;
-  data_ = new byte[size];
-  memset(data_, 0, size_);
+
+  // Without the mirror, addresses past 1MB don't wrap around but are still
+  // safe to access.
+  data_ = mapMirroredAddressSpace();
+  mirrored_ = (data_ != nullptr);
+  if (!mirrored_) {
+    data_ = new byte[kMappedSize];
+    memset(data_, 0, kMappedSize);
+  }
+
+  page_flags_ = new byte[kMappedPages + 1];
+  memset(page_flags_, 0, kMappedPages + 1);
+
+  int ram_end = (size_ + kRegionSize - 1) & ~(kRegionSize - 1);
+  if (ram_end < kAddressSpace) {
+    unmap(ram_end, kAddressSpace - ram_end);
+  }
 }
 
-Memory::~Memory() {
-  delete [] data_;
+template <class AccessPolicy>
+MemoryT<AccessPolicy>::~MemoryT() {
+#ifdef MEMORY_MIRROR
+  if (mirrored_) {
+    munmap(data_, kMappedSize);
+  }
+#endif
+  if (!mirrored_) {
+    delete [] data_;
+  }
   data_ = nullptr;
+
+  delete [] page_flags_;
+  page_flags_ = nullptr;
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::outOfRange(const char* what, int address) const {
+  stringstream ss;
+  ss << "Attempt to " << what << " " << address << ", size is " << size_;
+  FATAL(ss.str());
+}
+
+template <class AccessPolicy>
+int MemoryT<AccessPolicy>::getSize() const {
+  return size_;
 }
 
-byte Memory::read(int address) const {
-  return data_[address];
+template <class AccessPolicy>
+byte* MemoryT<AccessPolicy>::getRawPointer(int address) {
+  ASSERT(address >= 0 && address < kMappedSize);
+  return data_ + address;
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::mapRAM(int address, int size) {
+  map(address, size, REGION_RAM, nullptr);
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::mapROM(int address, int size) {
+  map(address, size, REGION_ROM, nullptr);
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::mapDevice(int address, int size,
+                                      MemoryHandler* handler) {
+  ASSERT(handler != nullptr);
+  map(address, size, REGION_DEVICE, handler);
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::unmap(int address, int size) {
+  map(address, size, REGION_UNMAPPED, nullptr);
+  memset(data_ + address, 0xFF, size);
 }
 
-void Memory::write(int address, byte value) {
-  if (address >= size_) {
-    stringstream ss;
-    ss << "Attempt to write at " << address << ", size is " << size_;
-    FATAL(ss.str());
+template <class AccessPolicy>
+typename MemoryT<AccessPolicy>::RegionType
+MemoryT<AccessPolicy>::getRegionType(int address) const {
+  return regions_[address >> kRegionBits].type;
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::map(int address, int size, RegionType type,
+                                MemoryHandler* handler) {
+  ASSERT(address >= 0 && size > 0 && address + size <= kAddressSpace);
+  ASSERT((address & (kRegionSize - 1)) == 0 && (size & (kRegionSize - 1)) == 0);
+
+  for (int offset = 0; offset < size; offset += kRegionSize) {
+    // The mirror of the first 64K is mapped like what it mirrors.
+    int region_address = address + offset;
+    int copies = (region_address < kMirrorSize) ? 2 : 1;
+    for (int copy = 0; copy < copies; copy++) {
+      int region = (region_address >> kRegionBits) +
+                   copy * (kAddressSpace >> kRegionBits);
+      regions_[region] = Region{type, handler};
+
+      int first_page = region << (kRegionBits - kPageBits);
+      int last_page = first_page + (kRegionSize >> kPageBits) - 1;
+      for (int page = first_page; page <= last_page; page++) {
+        if (type == REGION_RAM) {
+          page_flags_[page] &= ~kNotRAM;
+        } else {
+          page_flags_[page] |= kNotRAM;
+        }
+      }
+    }
   }
-  data_[address] = value;
 }
 
-byte* Memory::getPointer(int address) {
-  if (address >= size_) {
-    stringstream ss;
-    ss << "Attempt to get a pointer to " << address << ", size is " << size_;
-    FATAL(ss.str());
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::setPageWatcher(PageWatcher* watcher) {
+  page_watcher_ = watcher;
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::watchPage(int page) {
+  ASSERT(page >= 0 && page < kMappedPages);
+  page_flags_[page] |= kWatched;
+
+  // Writes through either copy of a mirrored page must be seen.
+  int mirror = getMirrorPage(page);
+  if (mirror != -1) {
+    page_flags_[mirror] |= kMirrorWatched;
+  }
+}
+
+template <class AccessPolicy>
+int MemoryT<AccessPolicy>::getMirrorPage(int page) {
+  const int kMirrorStart = kAddressSpace >> kPageBits;
+  if (page < kMirrorPages) {
+    return page + kMirrorStart;
+  } else if (page >= kMirrorStart && page < kMirrorStart + kMirrorPages) {
+    return page - kMirrorStart;
+  }
+  return -1;
+}
+
+template <class AccessPolicy>
+byte* MemoryT<AccessPolicy>::getPointer(int address, int size) {
+  if (!AccessPolicy::isInRange(address, size, size_)) {
+    outOfRange("get a pointer to", address + size - 1);
+  }
+  int first_page = address >> kPageBits;
+  int last_page = (address + size - 1) >> kPageBits;
+  for (int page = first_page; page <= last_page; page++) {
+    if (page_flags_[page]) {
+      return prepareWrite(address, size);
+    }
   }
   return data_ + address;
 }
 
-int Memory::getSize() const {
-  return size_;
+template <class AccessPolicy>
+byte* MemoryT<AccessPolicy>::prepareWrite(int address, int size) {
+  copyOnWrite(address >> kPageBits, (address + size - 1) >> kPageBits);
+  notifyPageWrite(address >> kPageBits, (address + size - 1) >> kPageBits);
+
+  bool discard = false;
+  MemoryHandler* last_handler = nullptr;
+  for (int region = address >> kRegionBits;
+       region <= (address + size - 1) >> kRegionBits; region++) {
+    const Region& r = regions_[region];
+    if (r.type == REGION_DEVICE && r.handler != last_handler) {
+      r.handler->handleMemoryWrite(address, size);
+      last_handler = r.handler;
+    } else if (r.type == REGION_ROM || r.type == REGION_UNMAPPED) {
+      discard = true;
+    }
+  }
+
+  if (!discard) {
+    return data_ + address;
+  }
+  if (size > (int)sizeof(discarded_)) {
+    return nullptr;
+  }
+  // Writes go to a copy, so the memory reads the same through the pointer.
+  // A word straddling RAM and ROM is discarded as a whole.
+  memcpy(discarded_, data_ + address, size);
+  return discarded_;
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::notifyPageWrite(int page, int next_page) {
+  for (int p = page; p <= next_page; p++) {
+    if ((page_flags_[p] & (kWatched | kMirrorWatched)) == 0) {
+      continue;
+    }
+    // A page and its mirror are written to together.
+    int mirror = getMirrorPage(p);
+    bool notify = (page_flags_[p] & kWatched) != 0;
+    bool notify_mirror = mirror != -1 && (page_flags_[mirror] & kWatched);
+    page_flags_[p] &= ~(kWatched | kMirrorWatched);
+    if (mirror != -1) {
+      page_flags_[mirror] &= ~(kWatched | kMirrorWatched);
+    }
+    if (notify) {
+      page_watcher_->handlePageWrite(p);
+    }
+    if (notify_mirror) {
+      page_watcher_->handlePageWrite(mirror);
+    }
+  }
+}
+
+template <class AccessPolicy>
+int MemoryT<AccessPolicy>::takeSnapshot() {
+  Snapshot snapshot;
+  snapshot.id = next_snapshot_id_++;
+  snapshots_.push_back(snapshot);
+  setAllSnapshotted(true);
+  return snapshot.id;
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::restoreSnapshot(int id) {
+  int index = findSnapshot(id);
+
+  // The oldest copy of each page wins, so restore the newest ones first.
+  for (int s = snapshots_.size() - 1; s >= index; s--) {
+    const Snapshot& snapshot = snapshots_[s];
+    for (size_t i = 0; i < snapshot.pages.size(); i++) {
+      restorePage(snapshot.pages[i], &snapshot.data[i << kPageBits]);
+    }
+  }
+  snapshots_.resize(index + 1);
+
+  // The pages the snapshot holds already read as they did when it was taken.
+  setAllSnapshotted(true);
+  for (int page : snapshots_[index].pages) {
+    setSnapshotted(page, false);
+  }
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::releaseSnapshot(int id) {
+  int index = findSnapshot(id);
+  Snapshot* snapshot = &snapshots_[index];
+
+  // The previous snapshot needs the pages it didn't copy, since they were
+  // unchanged until these were copied.
+  if (index > 0) {
+    Snapshot& previous = snapshots_[index - 1];
+    vector<bool> copied(kMappedPages, false);
+    for (int page : previous.pages) {
+      copied[page] = true;
+    }
+    for (size_t i = 0; i < snapshot->pages.size(); i++) {
+      if (!copied[snapshot->pages[i]]) {
+        previous.pages.push_back(snapshot->pages[i]);
+        previous.data.insert(previous.data.end(),
+                             snapshot->data.begin() + (i << kPageBits),
+                             snapshot->data.begin() + ((i + 1) << kPageBits));
+      }
+    }
+  }
+  snapshots_.erase(snapshots_.begin() + index);
+
+  if (snapshots_.empty()) {
+    setAllSnapshotted(false);
+  } else if (index == (int)snapshots_.size()) {
+    // The previous snapshot is now the last one, so the pages it holds must
+    // not be copied again: a newer copy would win over its own on restore.
+    for (int page : snapshots_.back().pages) {
+      setSnapshotted(page, false);
+    }
+  }
 }
+
+template <class AccessPolicy>
+int MemoryT<AccessPolicy>::getSnapshotPageCount() const {
+  int count = 0;
+  for (const Snapshot& snapshot : snapshots_) {
+    count += snapshot.pages.size();
+  }
+  return count;
+}
+
+template <class AccessPolicy>
+int MemoryT<AccessPolicy>::getStoragePage(int page) const {
+  const int kMirrorStart = kAddressSpace >> kPageBits;
+  if (mirrored_ && page >= kMirrorStart) {
+    return page - kMirrorStart;
+  }
+  return page;
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::setSnapshotted(int page, bool snapshotted) {
+  int mirror = mirrored_ ? getMirrorPage(page) : -1;
+  if (snapshotted) {
+    page_flags_[page] |= kSnapshotted;
+    if (mirror != -1) {
+      page_flags_[mirror] |= kSnapshotted;
+    }
+  } else {
+    page_flags_[page] &= ~kSnapshotted;
+    if (mirror != -1) {
+      page_flags_[mirror] &= ~kSnapshotted;
+    }
+  }
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::setAllSnapshotted(bool snapshotted) {
+  // A single pass over the page flags, a byte per page; the compiler turns
+  // it into wide ORs or ANDs.
+  const byte mask = snapshotted ? kSnapshotted : 0;
+  const byte keep = (byte)~kSnapshotted;
+  for (int page = 0; page < kMappedPages; page++) {
+    page_flags_[page] = (page_flags_[page] & keep) | mask;
+  }
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::copyOnWrite(int page, int last_page) {
+  for (int p = page; p <= last_page; p++) {
+    if ((page_flags_[p] & kSnapshotted) == 0) {
+      continue;
+    }
+    int storage_page = getStoragePage(p);
+    Snapshot& snapshot = snapshots_.back();
+    const byte* data = data_ + (storage_page << kPageBits);
+    snapshot.pages.push_back(storage_page);
+    snapshot.data.insert(snapshot.data.end(), data, data + kPageSize);
+    setSnapshotted(storage_page, false);
+  }
+}
+
+template <class AccessPolicy>
+void MemoryT<AccessPolicy>::restorePage(int page, const byte* data) {
+  int address = page << kPageBits;
+  notifyPageWrite(page, page);
+  const Region& region = regions_[address >> kRegionBits];
+  if (region.type == REGION_DEVICE) {
+    region.handler->handleMemoryWrite(address, kPageSize);
+  }
+  memcpy(data_ + address, data, kPageSize);
+}
+
+template <class AccessPolicy>
+int MemoryT<AccessPolicy>::findSnapshot(int id) const {
+  for (size_t i = 0; i < snapshots_.size(); i++) {
+    if (snapshots_[i].id == id) {
+      return i;
+    }
+  }
+  FATAL("No such snapshot");
+  return -1;
+}
+
+
+template class MemoryT<CheckedMemoryAccess>;
+template class MemoryT<UncheckedMemoryAccess>;
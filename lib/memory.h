@@ -9,25 +9,243 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include "device.h"
 #include "helpers.h"
 
+#include <vector>
+
+//
+// Gets notified when a watched page may have been written to.
+//
+class PageWatcher {
+ public:
+  virtual void handlePageWrite(int page) = 0;
+};
+
+
+//
+// Memory access policies. The checked policy makes accesses outside of the
+// installed memory fatal, for debugging. The unchecked one relies on every
+// address the CPU can form being mapped (see MemoryT), so accesses compile to
+// a plain load or store.
+//
+struct CheckedMemoryAccess {
+  static bool isInRange(int address, int size, int memory_size) {
+    // Addresses in the mirror past 1MB wrap around to the start.
+    return address >= 0 && address + size <= 0x110000 &&
+           (address & 0xFFFFF) + size <= memory_size;
+  }
+};
+
+struct UncheckedMemoryAccess {
+  static bool isInRange(int address, int size, int memory_size) {
+    return true;
+  }
+};
+
+
+//
+// Memory. The whole 20-bit address space is always mapped, followed by a
+// mirror of its first 64K, so linear addresses up to FFFF:FFFF wrap around at
+// 1MB like on an 8086 without masking them. The size is how much of it is
+// installed RAM, e.g. what programs can be loaded into.
+//
+// The address space is divided in 4K regions, which can be RAM, ROM, device
+// memory or unmapped; everything past the installed RAM starts unmapped.
+// Every region is backed by plain storage, so reads never need to know what
+// they're reading from. Writes to RAM go straight to the storage too; a
+// per-page flag check, shared with write watching, diverts the rest:
+//
+//   ROM       Writes are discarded.
+//   Device    The handler is told about writes before they happen.
+//   Unmapped  Reads return FFh and writes are discarded.
 //
-// Memory.
+// The same check implements copy-on-write snapshots of the contents: taking
+// one is a single pass setting a flag on every page, whatever the memory
+// holds, and a page is copied the first time it's written to afterwards.
 //
-class Memory {
+template <class AccessPolicy>
+class MemoryT {
  public:
-  Memory(int size);
-  ~Memory();
+  static const int kAddressSpace = 1 << 20;
+  static const int kMirrorSize = 0x10000;
+  static const int kMappedSize = kAddressSpace + kMirrorSize;
+
+  // Size of the pages that can be watched for writes.
+  static const int kPageBits = 8;
+  static const int kPageSize = 1 << kPageBits;
+
+  // Size of the regions that can be mapped.
+  static const int kRegionBits = 12;
+  static const int kRegionSize = 1 << kRegionBits;
+
+  enum RegionType {
+    REGION_RAM,
+    REGION_ROM,
+    REGION_DEVICE,
+    REGION_UNMAPPED,
+  };
+
+  MemoryT(int size);
+  ~MemoryT();
 
   byte read(int address) const;
   void write(int address, byte value);
 
+  // The returned pointer may be used to write, so it counts as a write to the
+  // page it points to (and the next one, for word accesses). For ROM and
+  // unmapped memory it points to a copy, so writes through it are lost.
   byte* getPointer(int address);
+
+  // Same, for a range of the given size, which counts as a write to every
+  // page it overlaps. Returns nullptr if the range includes ROM or unmapped
+  // memory; the caller should then access it a byte or word at a time.
+  byte* getPointer(int address, int size);
   int getSize() const;
 
+  // Pointer for reading a byte or a word, which doesn't count as a write.
+  const byte* getReadPointer(int address) const;
+
+  // Pointer to the storage at the given address, which doesn't count as a
+  // write. For devices accessing their own memory, and for loading ROMs.
+  byte* getRawPointer(int address);
+
+  // Maps the given range, which must be aligned to kRegionSize, replacing
+  // whatever was mapped there. RAM, ROM and device memory keep the contents
+  // of the storage.
+  void mapRAM(int address, int size);
+  void mapROM(int address, int size);
+  void mapDevice(int address, int size, MemoryHandler* handler);
+  void unmap(int address, int size);
+
+  RegionType getRegionType(int address) const;
+
+  // The watcher is notified the first time a watched page is written to after
+  // watchPage() is called for it. Pages in the mirror and the ones they mirror
+  // are written to together.
+  void setPageWatcher(PageWatcher* watcher);
+  void watchPage(int page);
+
+  // Snapshots of the contents, identified by increasing ids. Each one holds
+  // the pages written to between it and the next one, so restoring a
+  // snapshot costs as much as what was written since, and discards the
+  // snapshots taken after it. Watchers and devices are told about the pages
+  // restored as if they were written to.
+  int takeSnapshot();
+  void restoreSnapshot(int id);
+  void releaseSnapshot(int id);
+
+  // Pages copied by all the snapshots.
+  int getSnapshotPageCount() const;
+
  private:
+  static const int kMappedPages = kMappedSize >> kPageBits;
+  static const int kMirrorPages = kMirrorSize >> kPageBits;
+
+  struct Region {
+    RegionType type;
+    MemoryHandler* handler;
+  };
+
+  // Pages first written to after a snapshot, as they were when it was taken.
+  struct Snapshot {
+    int id;
+    std::vector<int> pages;
+    std::vector<byte> data;
+  };
+
+  // Flags in page_flags_. Any of them sends writes to the page through
+  // prepareWrite().
+  static const byte kWatched = 1;
+  static const byte kMirrorWatched = 2;
+  static const byte kNotRAM = 4;
+  static const byte kSnapshotted = 8;
+
+  static int getMirrorPage(int page);
+
+  void map(int address, int size, RegionType type, MemoryHandler* handler);
+
+  // Notifies watchers and devices of a write to the given range, and returns
+  // where it should go.
+  byte* prepareWrite(int address, int size);
+  void notifyPageWrite(int page, int next_page);
+  void outOfRange(const char* what, int address) const;
+
+  // Snapshot helpers. Pages sharing storage with the mirror are handled as
+  // the page they mirror.
+  int getStoragePage(int page) const;
+  void setSnapshotted(int page, bool snapshotted);
+  void setAllSnapshotted(bool snapshotted);
+  void copyOnWrite(int page, int last_page);
+  void restorePage(int page, const byte* data);
+  int findSnapshot(int id) const;
+
   byte* data_;
   int size_;
+  bool mirrored_;
+
+  std::vector<Region> regions_;
+
+  // Destination of writes that are discarded.
+  byte discarded_[2];
+
+  PageWatcher* page_watcher_;
+  byte* page_flags_;
+
+  // Oldest first; the pages written to go to the last one.
+  std::vector<Snapshot> snapshots_;
+  int next_snapshot_id_;
 };
 
+
+#ifdef MEMORY_CHECKED
+typedef MemoryT<CheckedMemoryAccess> Memory;
+#else
+typedef MemoryT<UncheckedMemoryAccess> Memory;
+#endif
+
+
+template <class AccessPolicy>
+inline byte MemoryT<AccessPolicy>::read(int address) const {
+  if (!AccessPolicy::isInRange(address, 1, size_)) {
+    outOfRange("read at", address);
+  }
+  return data_[address];
+}
+
+
+template <class AccessPolicy>
+inline void MemoryT<AccessPolicy>::write(int address, byte value) {
+  if (!AccessPolicy::isInRange(address, 1, size_)) {
+    outOfRange("write at", address);
+  }
+  if (page_flags_[address >> kPageBits]) {
+    *prepareWrite(address, 1) = value;
+  } else {
+    data_[address] = value;
+  }
+}
+
+
+template <class AccessPolicy>
+inline byte* MemoryT<AccessPolicy>::getPointer(int address) {
+  if (!AccessPolicy::isInRange(address, 1, size_)) {
+    outOfRange("get a pointer to", address);
+  }
+  if (page_flags_[address >> kPageBits] ||
+      page_flags_[(address + 1) >> kPageBits]) {
+    return prepareWrite(address, 2);
+  }
+  return data_ + address;
+}
+
+
+template <class AccessPolicy>
+inline const byte* MemoryT<AccessPolicy>::getReadPointer(int address) const {
+  if (!AccessPolicy::isInRange(address, 1, size_)) {
+    outOfRange("get a pointer to", address);
+  }
+  return data_ + address;
+}
+
 #endif  // __MEMORY_H__
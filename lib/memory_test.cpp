@@ -0,0 +1,110 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "memory.h"
+#include "device.h"
+
+#include <stdexcept>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using namespace std;
+
+
+TEST(MemoryTest, CheckedAccess) {
+  MemoryT<CheckedMemoryAccess> memory(0x1000);
+  memory.write(0xFFF, 1);
+  EXPECT_EQ(1, memory.read(0xFFF));
+  EXPECT_THROW(memory.write(0x1000, 1), runtime_error);
+  EXPECT_THROW(memory.getPointer(0xF00, 0x101), runtime_error);
+}
+
+
+class RecordingMemoryHandler : public MemoryHandler {
+ public:
+  virtual void handleMemoryWrite(int address, int size) override {
+    writes.push_back(address);
+  }
+
+  vector<int> writes;
+};
+
+
+TEST(MemoryTest, Regions) {
+  Memory memory(0x10000);
+  EXPECT_EQ(Memory::REGION_RAM, memory.getRegionType(0xFFFF));
+  EXPECT_EQ(Memory::REGION_UNMAPPED, memory.getRegionType(0x10000));
+
+  memory.unmap(0x3000, Memory::kRegionSize);
+  EXPECT_EQ(0xFF, memory.read(0x3000));
+
+  memory.getRawPointer(0x1000)[0] = 0x12;
+  memory.mapROM(0x1000, Memory::kRegionSize);
+  memory.write(0x1000, 0x34);
+  *memory.getPointer(0x1000) = 0x34;
+  EXPECT_EQ(0x12, memory.read(0x1000));
+  EXPECT_EQ(nullptr, memory.getPointer(0x0F00, 0x200));
+
+  RecordingMemoryHandler handler;
+  memory.mapDevice(0x2000, Memory::kRegionSize, &handler);
+  memory.write(0x2001, 0x56);
+  EXPECT_EQ(0x56, memory.read(0x2001));
+  ASSERT_EQ(1, (int)handler.writes.size());
+  EXPECT_EQ(0x2001, handler.writes[0]);
+}
+
+
+TEST(MemoryTest, Snapshots) {
+  Memory memory(0x10000);
+  memory.write(0x1000, 1);
+  memory.write(0x2000, 1);
+  int first = memory.takeSnapshot();
+  EXPECT_EQ(0, memory.getSnapshotPageCount());
+
+  memory.write(0x1000, 2);
+  memory.write(0x1001, 2);
+  EXPECT_EQ(1, memory.getSnapshotPageCount());
+  int second = memory.takeSnapshot();
+  *memory.getPointer(0x2000, 2) = 3;
+  memory.write(0x1000, 3);
+  EXPECT_EQ(3, memory.getSnapshotPageCount());
+
+  // Releasing the second snapshot hands its copy of 0x2000 to the first one.
+  memory.releaseSnapshot(second);
+  EXPECT_EQ(2, memory.getSnapshotPageCount());
+  EXPECT_THROW(memory.restoreSnapshot(second), runtime_error);
+
+  memory.restoreSnapshot(first);
+  EXPECT_EQ(1, memory.read(0x1000));
+  EXPECT_EQ(0, memory.read(0x1001));
+  EXPECT_EQ(1, memory.read(0x2000));
+
+  // The snapshot stays valid, and can be restored again.
+  memory.write(0x2000, 4);
+  memory.restoreSnapshot(first);
+  EXPECT_EQ(1, memory.read(0x2000));
+  memory.releaseSnapshot(first);
+  EXPECT_EQ(0, memory.getSnapshotPageCount());
+}
+
+
+TEST(MemoryTest, ReleaseNewestSnapshot) {
+  Memory memory(0x10000);
+  memory.write(0x5000, 1);
+  int first = memory.takeSnapshot();
+  memory.write(0x5000, 2);
+  int second = memory.takeSnapshot();
+
+  // The first snapshot already holds the page, so it isn't copied again.
+  memory.releaseSnapshot(second);
+  memory.write(0x5000, 3);
+  EXPECT_EQ(1, memory.getSnapshotPageCount());
+  memory.restoreSnapshot(first);
+  EXPECT_EQ(1, memory.read(0x5000));
+}
@@ -14,8 +14,64 @@
 
 using namespace std;
 
+// PC scancodes of the host keys, from the SDL ones.
+static const struct {
+  SDL_Scancode sdl;
+  byte pc;
+} kScancodes[] = {
+  { SDL_SCANCODE_ESCAPE, 0x01 }, { SDL_SCANCODE_1, 0x02 },
+  { SDL_SCANCODE_2, 0x03 }, { SDL_SCANCODE_3, 0x04 },
+  { SDL_SCANCODE_4, 0x05 }, { SDL_SCANCODE_5, 0x06 },
+  { SDL_SCANCODE_6, 0x07 }, { SDL_SCANCODE_7, 0x08 },
+  { SDL_SCANCODE_8, 0x09 }, { SDL_SCANCODE_9, 0x0A },
+  { SDL_SCANCODE_0, 0x0B }, { SDL_SCANCODE_MINUS, 0x0C },
+  { SDL_SCANCODE_EQUALS, 0x0D }, { SDL_SCANCODE_BACKSPACE, 0x0E },
+  { SDL_SCANCODE_TAB, 0x0F }, { SDL_SCANCODE_Q, 0x10 },
+  { SDL_SCANCODE_W, 0x11 }, { SDL_SCANCODE_E, 0x12 },
+  { SDL_SCANCODE_R, 0x13 }, { SDL_SCANCODE_T, 0x14 },
+  { SDL_SCANCODE_Y, 0x15 }, { SDL_SCANCODE_U, 0x16 },
+  { SDL_SCANCODE_I, 0x17 }, { SDL_SCANCODE_O, 0x18 },
+  { SDL_SCANCODE_P, 0x19 }, { SDL_SCANCODE_LEFTBRACKET, 0x1A },
+  { SDL_SCANCODE_RIGHTBRACKET, 0x1B }, { SDL_SCANCODE_RETURN, 0x1C },
+  { SDL_SCANCODE_LCTRL, 0x1D }, { SDL_SCANCODE_A, 0x1E },
+  { SDL_SCANCODE_S, 0x1F }, { SDL_SCANCODE_D, 0x20 },
+  { SDL_SCANCODE_F, 0x21 }, { SDL_SCANCODE_G, 0x22 },
+  { SDL_SCANCODE_H, 0x23 }, { SDL_SCANCODE_J, 0x24 },
+  { SDL_SCANCODE_K, 0x25 }, { SDL_SCANCODE_L, 0x26 },
+  { SDL_SCANCODE_SEMICOLON, 0x27 }, { SDL_SCANCODE_APOSTROPHE, 0x28 },
+  { SDL_SCANCODE_GRAVE, 0x29 }, { SDL_SCANCODE_LSHIFT, 0x2A },
+  { SDL_SCANCODE_BACKSLASH, 0x2B }, { SDL_SCANCODE_Z, 0x2C },
+  { SDL_SCANCODE_X, 0x2D }, { SDL_SCANCODE_C, 0x2E },
+  { SDL_SCANCODE_V, 0x2F }, { SDL_SCANCODE_B, 0x30 },
+  { SDL_SCANCODE_N, 0x31 }, { SDL_SCANCODE_M, 0x32 },
+  { SDL_SCANCODE_COMMA, 0x33 }, { SDL_SCANCODE_PERIOD, 0x34 },
+  { SDL_SCANCODE_SLASH, 0x35 }, { SDL_SCANCODE_RSHIFT, 0x36 },
+  { SDL_SCANCODE_LALT, 0x38 }, { SDL_SCANCODE_SPACE, 0x39 },
+  { SDL_SCANCODE_CAPSLOCK, 0x3A }, { SDL_SCANCODE_F1, 0x3B },
+  { SDL_SCANCODE_F2, 0x3C }, { SDL_SCANCODE_F3, 0x3D },
+  { SDL_SCANCODE_F4, 0x3E }, { SDL_SCANCODE_F5, 0x3F },
+  { SDL_SCANCODE_F6, 0x40 }, { SDL_SCANCODE_F7, 0x41 },
+  { SDL_SCANCODE_F8, 0x42 }, { SDL_SCANCODE_F9, 0x43 },
+  { SDL_SCANCODE_F10, 0x44 }, { SDL_SCANCODE_UP, 0x48 },
+  { SDL_SCANCODE_LEFT, 0x4B }, { SDL_SCANCODE_RIGHT, 0x4D },
+  { SDL_SCANCODE_DOWN, 0x50 },
+};
+
+static byte getPCScancode(SDL_Scancode scancode) {
+  for (const auto& entry : kScancodes) {
+    if (entry.sdl == scancode) {
+      return entry.pc;
+    }
+  }
+  return 0;
+}
+
+
 Monitor::Monitor(VGA* vga)
-  : vga_(vga), scale_(1), window_(nullptr), renderer_(nullptr) {
+  : vga_(vga), scale_(1), key_handler_(nullptr), quit_requested_(false),
+    window_(nullptr), renderer_(nullptr),
+    texture_(nullptr), texture_width_(0), texture_height_(0),
+    shown_frame_valid_(false) {
 
 }
 
@@ -48,10 +104,24 @@ void Monitor::savePPM(const std::string& filename) {
 }
 
 
+void Monitor::setKeyHandler(KeyHandler* handler) {
+  key_handler_ = handler;
+}
+
+
+bool Monitor::isQuitRequested() const {
+  return quit_requested_;
+}
+
+
 void Monitor::closeWindow() {
   if (!window_) {
     return;
   }
+  if (texture_) {
+    SDL_DestroyTexture(texture_);
+    texture_ = nullptr;
+  }
   SDL_DestroyRenderer(renderer_);
   SDL_DestroyWindow(window_);
   renderer_ = nullptr;
@@ -62,16 +132,81 @@ void Monitor::closeWindow() {
 void Monitor::update() {
   int width, height;
   vga_->getModeSize(width, height);
+  bool texture_created;
+  if (!prepareWindow(width, height, vga_->getPixelAspectRatio(),
+                     &texture_created)) {
+    return;
+  }
+  if (texture_created) {
+    vga_->invalidate();
+  }
+  shown_frame_valid_ = false;
+  bool exposed = pollEvents();
+
+  // Render the rows that changed. Locked pixels don't keep their previous
+  // contents, so every row in the locked span is rendered.
+  int first_row, last_row;
+  bool changed = vga_->getDirtyRows(&first_row, &last_row);
+  if (changed) {
+    SDL_Rect rect = { 0, first_row, width, last_row - first_row + 1 };
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(texture_, &rect, &pixels, &pitch) == 0) {
+      vga_->renderARGB((byte*)pixels, pitch, first_row, last_row);
+      SDL_UnlockTexture(texture_);
+    }
+  }
 
+  if (changed || exposed) {
+    present();
+  }
+}
+
+
+void Monitor::update(const VGA::Frame& frame) {
+  bool texture_created;
+  if (!prepareWindow(frame.width, frame.height, frame.pixel_aspect_ratio,
+                     &texture_created)) {
+    return;
+  }
+  bool exposed = pollEvents();
+
+  // Render the rows that differ from the frame in the texture.
+  int first_row = 0;
+  int last_row = frame.height - 1;
+  bool changed = true;
+  if (shown_frame_valid_ && !texture_created) {
+    changed = VGA::getChangedRows(frame, shown_frame_, &first_row, &last_row);
+  }
+  if (changed) {
+    SDL_Rect rect = { 0, first_row, frame.width, last_row - first_row + 1 };
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(texture_, &rect, &pixels, &pitch) == 0) {
+      VGA::renderFrameARGB(frame, (byte*)pixels, pitch, first_row, last_row);
+      SDL_UnlockTexture(texture_);
+    }
+    shown_frame_ = frame;
+    shown_frame_valid_ = true;
+  }
+
+  if (changed || exposed) {
+    present();
+  }
+}
+
+
+bool Monitor::prepareWindow(int width, int height, float pixel_aspect_ratio,
+                            bool* texture_created) {
   // Unsupported video mode.
   if (width == 0 || height == 0) {
     closeWindow();
-    return;
+    return false;
   }
 
   // If the window size changed, destroy the old window.
   int req_width = scale_*width;
-  int req_height = scale_*height*vga_->getPixelAspectRatio();
+  int req_height = scale_*height*pixel_aspect_ratio;
 
   if (window_) {
     int current_width, current_height;
@@ -86,28 +221,46 @@ void Monitor::update() {
     SDL_CreateWindowAndRenderer(req_width, req_height, 0, &window_, &renderer_);
   }
 
-  // Render to a buffer.
-  byte* buffer = new byte[width*height*3];
-  vga_->renderRGB(buffer);
-
-  // Wrap in a texture.
-  SDL_Surface* surface = 
-      SDL_CreateRGBSurfaceFrom(buffer, width, height, 24, width*3,
-                               0x0000FF, 0x00FF00, 0xFF0000, 0);
-
-  SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer_, surface);
-
-  // Render.
-  SDL_RenderCopy(renderer_, texture, NULL, NULL);
-  SDL_RenderPresent(renderer_);
+  // Create the texture if necessary. It starts out empty.
+  if (texture_ && (texture_width_ != width || texture_height_ != height)) {
+    SDL_DestroyTexture(texture_);
+    texture_ = nullptr;
+  }
+  *texture_created = false;
+  if (!texture_) {
+    texture_ = SDL_CreateTexture(renderer_, SDL_PIXELFORMAT_ARGB8888,
+                                 SDL_TEXTUREACCESS_STREAMING, width, height);
+    texture_width_ = width;
+    texture_height_ = height;
+    *texture_created = true;
+  }
+  return true;
+}
 
-  // Release memory.
-  SDL_DestroyTexture(texture);
-  SDL_FreeSurface(surface);
-  delete [] buffer;
 
+bool Monitor::pollEvents() {
   // Consume events to avoid starving the SDL event queue.
+  bool exposed = false;
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
+    if (event.type == SDL_WINDOWEVENT &&
+        event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+      exposed = true;
+    } else if (event.type == SDL_QUIT) {
+      quit_requested_ = true;
+    } else if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) &&
+               !event.key.repeat && key_handler_) {
+      byte scancode = getPCScancode(event.key.keysym.scancode);
+      if (scancode != 0) {
+        key_handler_->handleKey(scancode, event.type == SDL_KEYDOWN);
+      }
+    }
   }
+  return exposed;
+}
+
+
+void Monitor::present() {
+  SDL_RenderCopy(renderer_, texture_, NULL, NULL);
+  SDL_RenderPresent(renderer_);
 }
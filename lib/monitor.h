@@ -9,30 +9,76 @@
 #ifndef __MONITOR_H__
 #define __MONITOR_H__
 
+#include "device.h"
+#include "vga.h"
+
 #include <string>
 
-class VGA;
 struct SDL_Window;
 struct SDL_Renderer;
+struct SDL_Texture;
 
+//
+// Window showing the VGA output. The frame is kept in a streaming texture, and
+// only the rows that changed are rendered again, straight into it; if none
+// did, the frame isn't presented at all. Updates don't allocate memory.
+//
 class Monitor {
  public:
   Monitor(VGA* vga);
   virtual ~Monitor();
 
+  // Shows the current VGA screen.
   void update();
+
+  // Shows a frame captured with VGA::captureFrame(), possibly on another
+  // thread. Unlike update(), this doesn't access the VGA.
+  void update(const VGA::Frame& frame);
+
   void closeWindow();
 
   void setScale(int scale);
 
   void savePPM(const std::string& filename);
 
+  // Gets the keys pressed and released while the window has the focus,
+  // translated to PC scancodes, as the window events are processed.
+  void setKeyHandler(KeyHandler* handler);
+
+  // Whether the window was closed.
+  bool isQuitRequested() const;
+
  private:
+  // Creates or resizes the window and texture for the given mode. Returns
+  // false if the mode is unsupported. Sets texture_created if the texture is
+  // new, and so needs to be rendered entirely.
+  bool prepareWindow(int width, int height, float pixel_aspect_ratio,
+                     bool* texture_created);
+
+  // Consumes pending events, passing keys on. Returns whether the window was
+  // exposed, so it must be presented even if nothing changed.
+  bool pollEvents();
+
+  void present();
+
   VGA* vga_;
   int scale_;
 
+  KeyHandler* key_handler_;
+  bool quit_requested_;
+
   SDL_Window* window_;
   SDL_Renderer* renderer_;
+
+  // Current frame, in ARGB8888. Recreated when the mode size changes.
+  SDL_Texture* texture_;
+  int texture_width_;
+  int texture_height_;
+
+  // Last frame shown by update(const VGA::Frame&), if it's still what the
+  // texture holds.
+  VGA::Frame shown_frame_;
+  bool shown_frame_valid_;
 };
 
 #endif  // __MONITOR_H__
@@ -0,0 +1,180 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "pit.h"
+#include "x86.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static const int kChannelPort = 0x40;
+static const int kControlPort = 0x43;
+static const int kSpeakerPort = 0x61;
+
+PIT::PIT(X86* x86) : x86_(x86), port_61_(0) {
+  for (int i = 0; i < kChannels; i++) {
+    Channel& channel = channels_[i];
+    channel.reload = 0x10000;
+    channel.access = ACCESS_LOW_HIGH;
+    channel.mode = 3;
+    channel.write_high = false;
+    channel.read_high = false;
+    channel.low_byte = 0;
+    channel.latched = false;
+    channel.latch = 0;
+    channel.start_cycle = x86_->getCycleCount();
+  }
+
+  x86_->registerIOHandler(this, kChannelPort, kControlPort - kChannelPort + 1);
+  x86_->registerIOHandler(this, kSpeakerPort);
+  x86_->registerInterruptHandler(this, 0x08);
+  x86_->registerResetHandler(this);
+
+  // The BIOS leaves channel 0 running at about 18.2 Hz.
+  x86_->getEventScheduler()->schedule(
+      channels_[0].start_cycle + getTimerPeriod(), this, kTimerEvent);
+}
+
+
+void PIT::handleInterrupt(int num) {
+  ASSERT(num == 0x08);
+  x86_->interrupt(0x1C);
+}
+
+
+byte PIT::handleIN(int port) {
+  if (port == kSpeakerPort) {
+    return port_61_;
+  }
+  if (port == kControlPort) {
+    return 0xFF;
+  }
+
+  Channel* channel = &channels_[port - kChannelPort];
+  if (channel->latched) {
+    bool high = channel->read_high;
+    byte val = readByte(channel, channel->latch, &channel->read_high);
+    if (channel->access != ACCESS_LOW_HIGH || high) {
+      channel->latched = false;
+    }
+    return val;
+  }
+  return readByte(channel, getCount(*channel), &channel->read_high);
+}
+
+
+void PIT::handleOUT(int port, byte val) {
+  if (port == kSpeakerPort) {
+    port_61_ = val;
+    return;
+  }
+
+  if (port == kControlPort) {
+    int index = val >> 6;
+    if (index >= kChannels) {
+      return;
+    }
+    Channel* channel = &channels_[index];
+    int access = (val >> 4) & 3;
+    if (access == ACCESS_LATCH) {
+      channel->latch = getCount(*channel);
+      channel->latched = true;
+    } else {
+      channel->access = access;
+      channel->mode = (val >> 1) & 7;
+    }
+    channel->write_high = false;
+    channel->read_high = false;
+    return;
+  }
+
+  int index = port - kChannelPort;
+  Channel* channel = &channels_[index];
+  if (channel->access == ACCESS_LOW) {
+    setReload(index, val);
+  } else if (channel->access == ACCESS_HIGH) {
+    setReload(index, val << 8);
+  } else if (!channel->write_high) {
+    channel->low_byte = val;
+    channel->write_high = true;
+  } else {
+    setReload(index, channel->low_byte | (val << 8));
+    channel->write_high = false;
+  }
+}
+
+
+void PIT::handleEvent(int event, long long cycle) {
+  ASSERT(event == kTimerEvent);
+  x86_->requestIRQ(0);
+  x86_->getEventScheduler()->schedule(cycle + getTimerPeriod(), this,
+                                      kTimerEvent);
+}
+
+
+void PIT::handleReset(long long cycles) {
+  // The counts carry on; only the cycle they're measured from moves.
+  for (Channel& channel : channels_) {
+    channel.start_cycle -= cycles;
+  }
+}
+
+
+void PIT::saveState(State* state) const {
+  copy(channels_, channels_ + kChannels, state->channels);
+  state->port_61 = port_61_;
+}
+
+
+void PIT::restoreState(const State& state) {
+  copy(state.channels, state.channels + kChannels, channels_);
+  port_61_ = state.port_61;
+}
+
+
+long long PIT::getTimerPeriod() const {
+  return (long long)channels_[0].reload * kCyclesPerTick;
+}
+
+
+void PIT::setReload(int index, int reload) {
+  Channel* channel = &channels_[index];
+  channel->reload = (reload == 0) ? 0x10000 : reload;
+  channel->start_cycle = x86_->getCycleCount();
+
+  if (index == 0) {
+    EventScheduler* events = x86_->getEventScheduler();
+    events->cancel(this, kTimerEvent);
+    events->schedule(channel->start_cycle + getTimerPeriod(), this,
+                     kTimerEvent);
+  }
+}
+
+
+word PIT::getCount(const Channel& channel) const {
+  long long elapsed = x86_->getCycleCount() - channel.start_cycle;
+  if (elapsed < 0) {
+    elapsed = 0;
+  }
+  long long ticks = elapsed / kCyclesPerTick;
+  return (word)(channel.reload - ticks % channel.reload);
+}
+
+
+byte PIT::readByte(Channel* channel, word value, bool* high) {
+  if (channel->access == ACCESS_LOW) {
+    return value & 0xFF;
+  }
+  if (channel->access == ACCESS_HIGH) {
+    return value >> 8;
+  }
+  byte val = *high ? (value >> 8) : (value & 0xFF);
+  *high = !*high;
+  return val;
+}
@@ -0,0 +1,91 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __PIT_H__
+#define __PIT_H__
+
+#include "device.h"
+
+class X86;
+
+//
+// 8253 programmable interval timer, at ports 40h-43h. Channel 0 raises IRQ 0
+// every time its counter wraps around, through an event at the cycle that
+// happens, so the timer costs nothing in between. The counters are computed
+// from the cycle count when read; they count down at the same rate in every
+// mode. Channels 1 and 2, the speaker gate at port 61h included, are only
+// stored.
+//
+// Also provides the BIOS INT 08h handler, which calls INT 1Ch, for programs
+// that don't install their own.
+//
+class PIT : public InterruptHandler, public IOHandler, public EventHandler,
+            public ResetHandler {
+ public:
+  // The PIT input clock is a quarter of the CPU one.
+  static const int kCyclesPerTick = 4;
+
+  PIT(X86* x86);
+
+  virtual void handleInterrupt(int num) override;
+  virtual byte handleIN(int port) override;
+  virtual void handleOUT(int port, byte val) override;
+  virtual void handleEvent(int event, long long cycle) override;
+  virtual void handleReset(long long cycles) override;
+
+  // Cycles between timer interrupts.
+  long long getTimerPeriod() const;
+
+  static const int kChannels = 3;
+
+  struct Channel {
+    int reload;  // 1 to 65536.
+    int access;
+    int mode;
+
+    // For ACCESS_LOW_HIGH, whether the next byte is the high one.
+    bool write_high;
+    bool read_high;
+    byte low_byte;
+
+    bool latched;
+    word latch;
+
+    long long start_cycle;
+  };
+
+  // The channels, for snapshots. The timer event is saved with the X86.
+  struct State {
+    Channel channels[kChannels];
+    byte port_61;
+  };
+
+  void saveState(State* state) const;
+  void restoreState(const State& state);
+
+ private:
+  // Access modes of the control word.
+  enum {
+    ACCESS_LATCH = 0,
+    ACCESS_LOW,
+    ACCESS_HIGH,
+    ACCESS_LOW_HIGH,
+  };
+
+  static const int kTimerEvent = 0;
+
+  void setReload(int channel, int reload);
+  word getCount(const Channel& channel) const;
+  byte readByte(Channel* channel, word value, bool* high);
+
+  X86* x86_;
+  Channel channels_[kChannels];
+  byte port_61_;
+};
+
+#endif  // __PIT_H__
@@ -0,0 +1,303 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "replay.h"
+#include "memory.h"
+#include "x86.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+using namespace std;
+
+static const char kMagic[] = "EBRR";
+static const int kMagicSize = 4;
+static const byte kVersion = 1;
+
+void Replay::save(const string& filename) const {
+  vector<byte> data(kMagic, kMagic + kMagicSize);
+  data.push_back(kVersion);
+  writeVarint(cycles_per_frame, &data);
+  writeVarint(frame_count, &data);
+  data.push_back(block_translation);
+  writeUint64(initial_hash, &data);
+
+  int frame = 0;
+  for (const Event& event : events) {
+    writeVarint(event.frame - frame, &data);
+    data.push_back(event.type);
+    if (event.type == CHECKSUM) {
+      writeUint64(event.value, &data);
+    } else {
+      data.push_back(event.value);
+    }
+    frame = event.frame;
+  }
+
+  ofstream file(filename, ios::out | ios::binary);
+  file.write((const char*)data.data(), data.size());
+  if (!file) {
+    FATAL("Can't write " + filename);
+  }
+}
+
+
+void Replay::load(const string& filename) {
+  ifstream file(filename, ios::in | ios::binary);
+  if (!file) {
+    FATAL("Can't read " + filename);
+  }
+  vector<byte> data((istreambuf_iterator<char>(file)),
+                    istreambuf_iterator<char>());
+  if (data.size() < kMagicSize + 1 ||
+      memcmp(data.data(), kMagic, kMagicSize) != 0 ||
+      data[kMagicSize] != kVersion) {
+    FATAL(filename + " isn't a replay");
+  }
+
+  size_t position = kMagicSize + 1;
+  cycles_per_frame = readVarint(data, &position);
+  frame_count = readVarint(data, &position);
+  ASSERT(position < data.size());
+  block_translation = data[position++] != 0;
+  initial_hash = readUint64(data, &position);
+  ASSERT(cycles_per_frame > 0);
+
+  events.clear();
+  int frame = 0;
+  while (position < data.size()) {
+    Event event;
+    frame += readVarint(data, &position);
+    event.frame = frame;
+    ASSERT(position < data.size());
+    event.type = (EventType)data[position++];
+    if (event.type == CHECKSUM) {
+      event.value = readUint64(data, &position);
+    } else {
+      ASSERT(event.type == KEY_PRESS || event.type == KEY_RELEASE);
+      ASSERT(position < data.size());
+      event.value = data[position++];
+    }
+    events.push_back(event);
+  }
+}
+
+
+unsigned long long Replay::hashState(X86* x86) {
+  Registers regs = *x86->getRegisters();
+  regs.flags = x86->getFlags();
+  long long cycles = x86->getCycleCount();
+
+  unsigned long long hash = kHashSeed;
+  hash = hashBytes(hash, (const byte*)&regs, sizeof(regs));
+  hash = hashBytes(hash, (const byte*)&cycles, sizeof(cycles));
+  return hashBytes(hash, x86->getMemory()->getRawPointer(0),
+                   Memory::kAddressSpace);
+}
+
+
+ReplayRecorder::ReplayRecorder(X86* x86, KeyHandler* keyboard,
+                               int cycles_per_frame)
+  : x86_(x86), keyboard_(keyboard), recording_(false), paused_(false),
+    start_cycle_(0) {
+  replay_.cycles_per_frame = cycles_per_frame;
+  replay_.frame_count = 0;
+  replay_.block_translation = false;
+  replay_.initial_hash = 0;
+}
+
+
+ReplayRecorder::~ReplayRecorder() {
+  stop();
+}
+
+
+void ReplayRecorder::start() {
+  stop();
+  replay_.frame_count = 0;
+  replay_.initial_hash = Replay::hashState(x86_);
+  replay_.events.clear();
+  {
+    lock_guard<mutex> lock(pending_keys_mutex_);
+    pending_keys_.clear();
+  }
+
+  start_cycle_ = x86_->getCycleCount();
+  x86_->getEventScheduler()->schedule(
+      start_cycle_ + replay_.cycles_per_frame, this, kFrameEvent);
+  recording_ = true;
+}
+
+
+void ReplayRecorder::stop() {
+  if (recording_) {
+    x86_->getEventScheduler()->cancel(this, kFrameEvent);
+    recording_ = false;
+  }
+}
+
+
+bool ReplayRecorder::isRecording() const {
+  return recording_;
+}
+
+
+void ReplayRecorder::setPaused(bool paused) {
+  paused_ = paused;
+}
+
+
+const Replay& ReplayRecorder::getReplay() const {
+  return replay_;
+}
+
+
+void ReplayRecorder::truncate() {
+  if (!recording_) {
+    return;
+  }
+
+  // The frame event came back with the state, so it tells the next frame.
+  int next_frame = replay_.frame_count + 1;
+  for (const auto& event : x86_->getEventScheduler()->getPendingEvents()) {
+    if (event.handler == this && event.event == kFrameEvent) {
+      next_frame = (event.cycle - start_cycle_) / replay_.cycles_per_frame;
+    }
+  }
+  vector<Replay::Event>& events = replay_.events;
+  while (!events.empty() && events.back().frame >= next_frame) {
+    events.pop_back();
+  }
+  replay_.frame_count = max(next_frame - 1, 0);
+}
+
+
+void ReplayRecorder::handleKey(byte scancode, bool pressed) {
+  lock_guard<mutex> lock(pending_keys_mutex_);
+  pending_keys_.push_back(make_pair(scancode, pressed));
+}
+
+
+void ReplayRecorder::handleEvent(int event, long long cycle) {
+  ASSERT(event == kFrameEvent);
+  x86_->getEventScheduler()->schedule(cycle + replay_.cycles_per_frame, this,
+                                      kFrameEvent);
+  if (paused_) {
+    return;
+  }
+  int frame = (cycle - start_cycle_) / replay_.cycles_per_frame;
+  replay_.frame_count = frame;
+
+  if (frame % Replay::kChecksumInterval == 0) {
+    Replay::Event checksum = { frame, Replay::CHECKSUM,
+                               Replay::hashState(x86_) };
+    replay_.events.push_back(checksum);
+  }
+
+  vector<pair<byte, bool>> keys;
+  {
+    lock_guard<mutex> lock(pending_keys_mutex_);
+    keys.swap(pending_keys_);
+  }
+  for (const auto& key : keys) {
+    Replay::Event event = {
+        frame, key.second ? Replay::KEY_PRESS : Replay::KEY_RELEASE,
+        key.first };
+    replay_.events.push_back(event);
+    keyboard_->handleKey(key.first, key.second);
+  }
+}
+
+
+ReplayPlayer::ReplayPlayer(X86* x86, KeyHandler* keyboard,
+                           const Replay& replay)
+  : x86_(x86), keyboard_(keyboard), replay_(replay), playing_(false),
+    paused_(false), start_cycle_(0), frame_(0), next_event_(0),
+    mismatch_frame_(-1) {
+}
+
+
+ReplayPlayer::~ReplayPlayer() {
+  if (playing_) {
+    x86_->getEventScheduler()->cancel(this, kFrameEvent);
+  }
+}
+
+
+bool ReplayPlayer::start() {
+  if (playing_) {
+    x86_->getEventScheduler()->cancel(this, kFrameEvent);
+  }
+  frame_ = 0;
+  next_event_ = 0;
+  mismatch_frame_ = -1;
+
+  start_cycle_ = x86_->getCycleCount();
+  playing_ = replay_.frame_count > 0;
+  if (playing_) {
+    x86_->getEventScheduler()->schedule(
+        start_cycle_ + replay_.cycles_per_frame, this, kFrameEvent);
+  }
+  return Replay::hashState(x86_) == replay_.initial_hash;
+}
+
+
+bool ReplayPlayer::isFinished() const {
+  return !playing_;
+}
+
+
+void ReplayPlayer::setPaused(bool paused) {
+  paused_ = paused;
+}
+
+
+const Replay& ReplayPlayer::getReplay() const {
+  return replay_;
+}
+
+
+int ReplayPlayer::getFrame() const {
+  return frame_;
+}
+
+
+int ReplayPlayer::getMismatchFrame() const {
+  return mismatch_frame_;
+}
+
+
+void ReplayPlayer::handleEvent(int event, long long cycle) {
+  ASSERT(event == kFrameEvent);
+  x86_->getEventScheduler()->schedule(cycle + replay_.cycles_per_frame, this,
+                                      kFrameEvent);
+  if (paused_) {
+    return;
+  }
+  frame_ = (cycle - start_cycle_) / replay_.cycles_per_frame;
+
+  const vector<Replay::Event>& events = replay_.events;
+  for (; next_event_ < events.size() && events[next_event_].frame <= frame_;
+       next_event_++) {
+    const Replay::Event& event = events[next_event_];
+    if (event.type == Replay::CHECKSUM) {
+      if (event.value != Replay::hashState(x86_) && mismatch_frame_ == -1) {
+        mismatch_frame_ = event.frame;
+      }
+    } else {
+      keyboard_->handleKey(event.value, event.type == Replay::KEY_PRESS);
+    }
+  }
+
+  if (frame_ >= replay_.frame_count) {
+    x86_->getEventScheduler()->cancel(this, kFrameEvent);
+    playing_ = false;
+  }
+}
@@ -0,0 +1,158 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "device.h"
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+class X86;
+
+//
+// Recorded input, to play a session back exactly, e.g. as a regression test
+// or a benchmark. Input reaches the keyboard at frame boundaries in guest
+// time, through X86 events, so what happens doesn't depend on the host's
+// timing or on how the emulation is split in runs. It does depend on the
+// engine: translated code only runs events between blocks, so a replay
+// must be played back the way it was recorded. Checksums of the machine
+// state, recorded every kChecksumInterval frames, tell whether playback
+// still matches.
+//
+// File format, with the counts as varints:
+//
+//   "EBRR", version byte
+//   cycles per frame, frame count
+//   whether it was recorded with the block translator, byte
+//   hash of the initial state, 8 bytes little endian
+//   events: frames since the previous event, type byte, and the scancode
+//     for key events or the 8-byte hash for checksums
+//
+struct Replay {
+  enum EventType {
+    KEY_PRESS = 1,
+    KEY_RELEASE,
+    CHECKSUM,
+  };
+
+  struct Event {
+    int frame;
+    EventType type;
+    unsigned long long value;
+  };
+
+  static const int kChecksumInterval = 30;
+
+  int cycles_per_frame;
+  int frame_count;
+  bool block_translation;
+  unsigned long long initial_hash;
+
+  // In the order they happen; checksums go before the keys of their frame.
+  std::vector<Event> events;
+
+  void save(const std::string& filename) const;
+  void load(const std::string& filename);
+
+  // Hash of the registers, the cycle count and the memory contents.
+  static unsigned long long hashState(X86* x86);
+};
+
+
+//
+// Records the keys it gets, which it hands over to the keyboard at the next
+// frame. Keys can come from any thread, e.g. one presenting the frames while
+// another runs the emulation; they're only passed on while recording.
+//
+class ReplayRecorder : public EventHandler, public KeyHandler {
+ public:
+  ReplayRecorder(X86* x86, KeyHandler* keyboard, int cycles_per_frame);
+  ~ReplayRecorder();
+
+  // Starts a new recording from the current state.
+  void start();
+  void stop();
+  bool isRecording() const;
+
+  // While paused, frames go by without keys or checksums, e.g. while running
+  // ahead of a snapshot that will be restored.
+  void setPaused(bool paused);
+
+  // The recording so far.
+  const Replay& getReplay() const;
+
+  // Drops the frames recorded after the current state, once the machine has
+  // gone back to an earlier one, e.g. with a RewindBuffer. The recording
+  // goes on from there.
+  void truncate();
+
+  virtual void handleKey(byte scancode, bool pressed) override;
+  virtual void handleEvent(int event, long long cycle) override;
+
+ private:
+  static const int kFrameEvent = 0;
+
+  X86* x86_;
+  KeyHandler* keyboard_;
+
+  Replay replay_;
+  bool recording_;
+  bool paused_;
+  long long start_cycle_;
+
+  std::mutex pending_keys_mutex_;
+  std::vector<std::pair<byte, bool>> pending_keys_;
+};
+
+
+//
+// Plays a replay back, from the state it was recorded from.
+//
+class ReplayPlayer : public EventHandler {
+ public:
+  ReplayPlayer(X86* x86, KeyHandler* keyboard, const Replay& replay);
+  ~ReplayPlayer();
+
+  // Starts playing from the current state. Returns whether it's the one the
+  // replay was recorded from; if it isn't, the checksums won't match either.
+  bool start();
+  bool isFinished() const;
+
+  // Like ReplayRecorder::setPaused().
+  void setPaused(bool paused);
+
+  const Replay& getReplay() const;
+
+  // Frames played so far.
+  int getFrame() const;
+
+  // Frame of the first checksum that didn't match, or -1.
+  int getMismatchFrame() const;
+
+  virtual void handleEvent(int event, long long cycle) override;
+
+ private:
+  static const int kFrameEvent = 0;
+
+  X86* x86_;
+  KeyHandler* keyboard_;
+  Replay replay_;
+
+  bool playing_;
+  bool paused_;
+  long long start_cycle_;
+  int frame_;
+  size_t next_event_;
+  int mismatch_frame_;
+};
+
+#endif  // __REPLAY_H__
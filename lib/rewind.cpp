@@ -0,0 +1,179 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "rewind.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+RewindBuffer::RewindBuffer(X86* x86, VGA* vga, PIT* pit, Keyboard* keyboard,
+                           int max_size)
+  : x86_(x86), mem_(x86->getMemory()), vga_(vga), pit_(pit),
+    keyboard_(keyboard), max_size_(max_size), size_(0),
+    latest_(Memory::kAddressSpace) {
+}
+
+
+void RewindBuffer::capture() {
+  if (entries_.empty()) {
+    memcpy(latest_.data(), mem_->getRawPointer(0), latest_.size());
+  } else {
+    Entry& previous = entries_.back();
+    encodeDelta(&previous.delta);
+    size_ += previous.delta.size();
+  }
+
+  entries_.emplace_back();
+  Entry& entry = entries_.back();
+  x86_->saveState(&entry.x86);
+  vga_->saveState(&entry.vga);
+  if (pit_) {
+    pit_->saveState(&entry.pit);
+  }
+  if (keyboard_) {
+    keyboard_->saveState(&entry.keyboard);
+  }
+  size_ += getStateSize(entry);
+
+  while (entries_.size() > 1 && getSize() > max_size_) {
+    dropOldest();
+  }
+}
+
+
+int RewindBuffer::rewind(int entries) {
+  if (entries_.empty() || entries <= 0) {
+    return 0;
+  }
+  entries = min<int>(entries, entries_.size());
+
+  // Go back from the newest contents one delta at a time.
+  for (int i = 1; i < entries; i++) {
+    size_ -= getStateSize(entries_.back());
+    entries_.pop_back();
+
+    Entry& previous = entries_.back();
+    applyDelta(previous.delta);
+    size_ -= previous.delta.size();
+    previous.delta.clear();
+  }
+  restoreMemory();
+
+  const Entry& entry = entries_.back();
+  x86_->restoreState(entry.x86);
+  vga_->restoreState(entry.vga);
+  if (pit_) {
+    pit_->restoreState(entry.pit);
+  }
+  if (keyboard_) {
+    keyboard_->restoreState(entry.keyboard);
+  }
+  return entries;
+}
+
+
+void RewindBuffer::clear() {
+  entries_.clear();
+  size_ = 0;
+}
+
+
+int RewindBuffer::getEntryCount() const {
+  return entries_.size();
+}
+
+
+int RewindBuffer::getSize() const {
+  return size_ + latest_.size();
+}
+
+
+void RewindBuffer::encodeDelta(vector<byte>* delta) {
+  const byte* current = mem_->getRawPointer(0);
+  byte* latest = latest_.data();
+  const int size = latest_.size();
+
+  int position = 0;
+  while (true) {
+    // Skip the unchanged bytes, a word at a time while possible.
+    int unchanged_start = position;
+    while (position + 8 <= size &&
+           memcmp(current + position, latest + position, 8) == 0) {
+      position += 8;
+    }
+    while (position < size && current[position] == latest[position]) {
+      position++;
+    }
+    if (position == size) {
+      break;
+    }
+
+    // The changed bytes go on until a long enough unchanged run.
+    int changed_start = position;
+    int unchanged = 0;
+    while (position < size && unchanged < kMinUnchangedRun) {
+      unchanged = (current[position] == latest[position]) ? unchanged + 1 : 0;
+      position++;
+    }
+    position -= unchanged;
+
+    writeVarint(changed_start - unchanged_start, delta);
+    writeVarint(position - changed_start, delta);
+    for (int i = changed_start; i < position; i++) {
+      delta->push_back(current[i] ^ latest[i]);
+      latest[i] = current[i];
+    }
+  }
+}
+
+
+void RewindBuffer::applyDelta(const vector<byte>& delta) {
+  byte* latest = latest_.data();
+  int position = 0;
+  size_t i = 0;
+  while (i < delta.size()) {
+    position += readVarint(delta, &i);
+    int changed = readVarint(delta, &i);
+    for (int j = 0; j < changed; j++) {
+      latest[position++] ^= delta[i++];
+    }
+  }
+}
+
+
+void RewindBuffer::restoreMemory() {
+  // Writing through getPointer() tells watchers and devices about the pages,
+  // so decoded and translated code is invalidated.
+  const int page_size = Memory::kPageSize;
+  for (int address = 0; address < (int)latest_.size(); address += page_size) {
+    const byte* data = &latest_[address];
+    if (memcmp(mem_->getRawPointer(address), data, page_size) == 0) {
+      continue;
+    }
+    byte* destination = mem_->getPointer(address, page_size);
+    if (!destination) {
+      destination = mem_->getRawPointer(address);
+    }
+    memcpy(destination, data, page_size);
+  }
+}
+
+
+void RewindBuffer::dropOldest() {
+  Entry& oldest = entries_.front();
+  size_ -= getStateSize(oldest) + oldest.delta.size();
+  entries_.pop_front();
+}
+
+
+int RewindBuffer::getStateSize(const Entry& entry) {
+  return sizeof(Entry) +
+         entry.x86.call_stack.size() * sizeof(entry.x86.call_stack[0]);
+}
@@ -0,0 +1,97 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __REWIND_H__
+#define __REWIND_H__
+
+#include "keyboard.h"
+#include "pit.h"
+#include "vga.h"
+#include "x86.h"
+
+#include <deque>
+#include <vector>
+
+//
+// Rolling history of the machine state, e.g. one entry per frame, to go back
+// in time. Only the latest memory contents are kept in full; each older entry
+// keeps its contents as the XOR against the next entry's, with the runs of
+// unchanged bytes left out, so an entry costs little more than the bytes
+// written to since the one before. The oldest entries are dropped to stay
+// within the given size.
+//
+class RewindBuffer {
+ public:
+  // The PIT and the keyboard are optional.
+  RewindBuffer(X86* x86, VGA* vga, PIT* pit, Keyboard* keyboard,
+               int max_size);
+
+  // Adds the current state as the newest entry. Must be called between
+  // instructions or with one pending, like MachineSnapshots::take().
+  void capture();
+
+  // Puts the machine back the way it was the given number of entries ago,
+  // counting the newest one as 1, or as far back as there is. The entries
+  // newer than that are dropped. Returns how many entries were gone back.
+  int rewind(int entries);
+
+  void clear();
+
+  int getEntryCount() const;
+
+  // Bytes used by the entries and the latest contents, not counting the
+  // few pending device events each one holds.
+  int getSize() const;
+
+ private:
+  struct Entry {
+    // Holds the call stack only if the X86 tracks it.
+    X86::State x86;
+    VGA::State vga;
+    PIT::State pit;
+    Keyboard::State keyboard;
+
+    // XOR of these contents against the next entry's, as a sequence of
+    // (unchanged bytes, changed bytes, changed bytes XOR) records with the
+    // counts as varints. Empty for the newest entry.
+    std::vector<byte> delta;
+  };
+
+  // Runs of fewer unchanged bytes are stored as changed bytes, since the
+  // record would be bigger.
+  static const int kMinUnchangedRun = 4;
+
+  // Encodes the XOR of the memory contents against latest_ into delta, and
+  // copies them to latest_.
+  void encodeDelta(std::vector<byte>* delta);
+  void applyDelta(const std::vector<byte>& delta);
+
+  // Writes the pages of latest_ that differ to memory.
+  void restoreMemory();
+
+  void dropOldest();
+
+  // Bytes used by an entry, besides its delta.
+  static int getStateSize(const Entry& entry);
+
+  X86* x86_;
+  Memory* mem_;
+  VGA* vga_;
+  PIT* pit_;
+  Keyboard* keyboard_;
+  int max_size_;
+
+  // Oldest first.
+  std::deque<Entry> entries_;
+  int size_;
+
+  // Memory contents of the newest entry.
+  std::vector<byte> latest_;
+};
+
+#endif  // __REWIND_H__
@@ -0,0 +1,83 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "snapshot.h"
+
+using namespace std;
+
+MachineSnapshots::MachineSnapshots(X86* x86, VGA* vga, PIT* pit,
+                                   Keyboard* keyboard)
+  : x86_(x86), mem_(x86->getMemory()), vga_(vga), pit_(pit),
+    keyboard_(keyboard) {
+}
+
+
+MachineSnapshots::~MachineSnapshots() {
+  clear();
+}
+
+
+int MachineSnapshots::take() {
+  int id = mem_->takeSnapshot();
+  Snapshot& snapshot = snapshots_[id];
+  x86_->saveState(&snapshot.x86);
+  vga_->saveState(&snapshot.vga);
+  if (pit_) {
+    pit_->saveState(&snapshot.pit);
+  }
+  if (keyboard_) {
+    keyboard_->saveState(&snapshot.keyboard);
+  }
+  return id;
+}
+
+
+void MachineSnapshots::restore(int id) {
+  auto it = snapshots_.find(id);
+  ASSERT(it != snapshots_.end());
+
+  // Memory goes first, so the pending instruction's memory operands and the
+  // VGA see the restored contents.
+  mem_->restoreSnapshot(id);
+  snapshots_.erase(next(it), snapshots_.end());
+
+  const Snapshot& snapshot = it->second;
+  x86_->restoreState(snapshot.x86);
+  vga_->restoreState(snapshot.vga);
+  if (pit_) {
+    pit_->restoreState(snapshot.pit);
+  }
+  if (keyboard_) {
+    keyboard_->restoreState(snapshot.keyboard);
+  }
+}
+
+
+void MachineSnapshots::release(int id) {
+  auto it = snapshots_.find(id);
+  ASSERT(it != snapshots_.end());
+  mem_->releaseSnapshot(id);
+  snapshots_.erase(it);
+}
+
+
+void MachineSnapshots::clear() {
+  while (!snapshots_.empty()) {
+    release(snapshots_.begin()->first);
+  }
+}
+
+
+bool MachineSnapshots::contains(int id) const {
+  return snapshots_.count(id) != 0;
+}
+
+
+int MachineSnapshots::getCount() const {
+  return snapshots_.size();
+}
@@ -0,0 +1,63 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "keyboard.h"
+#include "pit.h"
+#include "vga.h"
+#include "x86.h"
+
+#include <map>
+
+//
+// Snapshots of the whole machine: the CPU, the memory contents and the
+// devices. They're cheap to take, since memory pages are only copied when
+// they're written to afterwards, and cheap to restore shortly after they
+// were taken; see Memory::takeSnapshot().
+//
+class MachineSnapshots {
+ public:
+  // The PIT and the keyboard are optional.
+  MachineSnapshots(X86* x86, VGA* vga, PIT* pit, Keyboard* keyboard = nullptr);
+  ~MachineSnapshots();
+
+  // Returns the id of the new snapshot. Ids increase.
+  int take();
+
+  // Puts the machine back the way it was when the snapshot was taken, which
+  // must be between instructions or with one pending. The snapshot stays,
+  // so it can be restored again; the ones taken after it are released.
+  void restore(int id);
+
+  void release(int id);
+  void clear();
+
+  bool contains(int id) const;
+  int getCount() const;
+
+ private:
+  struct Snapshot {
+    X86::State x86;
+    VGA::State vga;
+    PIT::State pit;
+    Keyboard::State keyboard;
+  };
+
+  X86* x86_;
+  Memory* mem_;
+  VGA* vga_;
+  PIT* pit_;
+  Keyboard* keyboard_;
+
+  // By id, which is the same as the memory snapshot's.
+  std::map<int, Snapshot> snapshots_;
+};
+
+#endif  // __SNAPSHOT_H__
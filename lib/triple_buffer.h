@@ -0,0 +1,61 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __TRIPLE_BUFFER_H__
+#define __TRIPLE_BUFFER_H__
+
+#include <atomic>
+
+//
+// Hands values over from one producer thread to one consumer thread without
+// locks or waiting. The producer fills its buffer and publishes it; the
+// consumer always gets the latest published buffer, skipping older ones.
+// Neither side ever touches the buffer the other one is using.
+//
+template <class T>
+class TripleBuffer {
+ public:
+  TripleBuffer() : write_(0), middle_(1), read_(2) {}
+
+  // Producer side.
+  T* getWriteBuffer() {
+    return &buffers_[write_];
+  }
+
+  void publish() {
+    write_ = middle_.exchange(write_ | kFresh, std::memory_order_acq_rel) &
+             kIndexMask;
+  }
+
+  // Consumer side. Makes the latest published buffer the read buffer, if
+  // there's one that wasn't consumed yet, and returns whether there was.
+  bool consume() {
+    if ((middle_.load(std::memory_order_relaxed) & kFresh) == 0) {
+      return false;
+    }
+    read_ = middle_.exchange(read_, std::memory_order_acq_rel) & kIndexMask;
+    return true;
+  }
+
+  const T& getReadBuffer() const {
+    return buffers_[read_];
+  }
+
+ private:
+  // middle_ holds the index of the buffer between the two sides, plus
+  // kFresh if it was published and not consumed yet.
+  static const int kIndexMask = 3;
+  static const int kFresh = 4;
+
+  T buffers_[3];
+  int write_;
+  std::atomic<int> middle_;
+  int read_;
+};
+
+#endif  // __TRIPLE_BUFFER_H__
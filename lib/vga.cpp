@@ -45,8 +45,13 @@ static const byte kCGAColors[2][4][3] = {
 
 
 
-VGA::VGA(X86* x86) : x86_(x86), mode_(0) {
+VGA::VGA(X86* x86)
+  : x86_(x86), mode_(0), cga_palette_(0), cga_table_(&getCGATable(0)),
+    dirty_first_row_(0),
+    dirty_last_row_(kRows - 1) {
   x86_->registerInterruptHandler(this, 0x10);
+  x86_->registerIOHandler(this, kStatusPort);
+  x86_->getMemory()->mapDevice(kVRAMAddress, kVRAMSize, this);
 }
 
  
@@ -65,18 +70,76 @@ void VGA::handleInterrupt(int num) {
 
 
 byte VGA::handleIN(int port) {
+  if (port == kStatusPort) {
+    return getStatus();
+  }
   cerr << "VGA: Unhandled IN 0x" << Hex16 << (int)port << endl;
   return 0;
 }
 
 
+byte VGA::getStatus() const {
+  // Where the beam is, from the cycle count. Vertical retrace is reported
+  // for the whole vertical blanking interval.
+  int cycle = x86_->getCycleCount() % (kScanlines * kCyclesPerScanline);
+  int scanline = cycle / kCyclesPerScanline;
+  if (scanline >= kRows) {
+    return kStatusRetrace | kStatusVerticalRetrace;
+  }
+  if (cycle % kCyclesPerScanline >= kVisibleCyclesPerScanline) {
+    return kStatusRetrace;
+  }
+  return 0;
+}
+
+
 void VGA::handleOUT(int port, byte val) {
   cerr << "VGA: Unhandled OUT 0x" << Hex16 << (int)port << endl;
 }
 
 
+void VGA::handleMemoryWrite(int address, int size) {
+  // Offsets in VRAM of the first and last byte written, clipped to it.
+  int first = address - kVRAMAddress;
+  int last = first + size - 1;
+  if (first < 0) {
+    first = 0;
+  }
+  if (last >= kVRAMSize) {
+    last = kVRAMSize - 1;
+  }
+
+  for (int offset = first; offset <= last; offset++) {
+    // The end of each bank, past the last row, isn't displayed.
+    int bank = offset / kBankSize;
+    int row = (offset % kBankSize) / kBytesPerRow;
+    if (row < kRows / 2) {
+      int screen_row = row * 2 + bank;
+      if (dirty_first_row_ == -1 || screen_row < dirty_first_row_) {
+        dirty_first_row_ = screen_row;
+      }
+      if (screen_row > dirty_last_row_) {
+        dirty_last_row_ = screen_row;
+      }
+    }
+
+    // Skip to the last byte of the row.
+    int row_end = bank * kBankSize + (row + 1) * kBytesPerRow;
+    int bank_end = (bank + 1) * kBankSize;
+    offset = (row_end < bank_end ? row_end : bank_end) - 1;
+  }
+}
+
+
+void VGA::invalidate() {
+  dirty_first_row_ = 0;
+  dirty_last_row_ = kRows - 1;
+}
+
+
 void VGA::setVideoMode(int mode) {
   mode_ = mode;
+  invalidate();
   
   if (mode_ == MODE_CGA_320x200) {
     clearVRAM();
@@ -88,8 +151,8 @@ void VGA::setVideoMode(int mode) {
 
 void VGA::clearVRAM() {
   if (mode_ == MODE_CGA_320x200) {
-    byte* vram = x86_->getMem8Ptr(0xB800, 0);
-    memset(vram, 0, 16384);
+    memset(getWritableVRAM(), 0, kVRAMSize);
+    invalidate();
   } else {
     cerr << "VGA: Unsupported video mode 0x" << Hex8 << mode_ << endl;
   }
@@ -98,10 +161,11 @@ void VGA::clearVRAM() {
 
 void VGA::randomVRAM() {
   if (mode_ == MODE_CGA_320x200) {
-    byte* vram = x86_->getMem8Ptr(0xB800, 0);
-    for (int i = 0; i < 16384; i++) {
+    byte* vram = getWritableVRAM();
+    for (int i = 0; i < kVRAMSize; i++) {
       *vram++ = rand() & 0xFF;
     }
+    invalidate();
   } else {
     cerr << "VGA: Unsupported video mode 0x" << Hex8 << mode_ << endl;
   }
@@ -112,33 +176,155 @@ void VGA::setPalette(int palette) {
   if (mode_ == MODE_CGA_320x200) {
     clog << "Setting CGA palette " << palette << endl;
     cga_palette_ = palette;
+    cga_table_ = &getCGATable(palette);
+    invalidate();
   }
 }
 
 
+void VGA::saveState(State* state) const {
+  state->mode = mode_;
+  state->palette = cga_palette_;
+}
+
+
+void VGA::restoreState(const State& state) {
+  mode_ = state.mode;
+  cga_palette_ = state.palette;
+  cga_table_ = &getCGATable(cga_palette_);
+  invalidate();
+}
+
+
 void VGA::renderRGB(byte* buffer) {
   if (mode_ != MODE_CGA_320x200) {
     clog << "Can't render screen in mode " << (int)mode_ << endl;
     return;
   }
 
+  for (int row = 0; row < kRows; row++) {
+    CGAtoRGB(getRow(getVRAM(), row), cga_palette_, 320,
+             buffer + row * 320 * 3);
+  }
+}
+
+
+bool VGA::getDirtyRows(int* first_row, int* last_row) const {
+  if (dirty_first_row_ == -1 || mode_ != MODE_CGA_320x200) {
+    return false;
+  }
+  *first_row = dirty_first_row_;
+  *last_row = dirty_last_row_;
+  return true;
+}
+
+
+void VGA::renderARGB(byte* pixels, int pitch, int first_row, int last_row) {
+  renderRowsARGB(getVRAM(), *cga_table_, pixels, pitch, first_row, last_row);
+  if (first_row <= dirty_first_row_ && last_row >= dirty_last_row_) {
+    dirty_first_row_ = dirty_last_row_ = -1;
+  }
+}
+
+
+bool VGA::captureFrame(Frame* frame) {
+  if (dirty_first_row_ == -1) {
+    return false;
+  }
+  getModeSize(frame->width, frame->height);
+  frame->pixel_aspect_ratio = getPixelAspectRatio();
+  frame->palette = cga_palette_;
+  memcpy(frame->vram, getVRAM(), kVRAMSize);
+  dirty_first_row_ = dirty_last_row_ = -1;
+  return true;
+}
+
+
+bool VGA::getChangedRows(const Frame& frame, const Frame& previous,
+                         int* first_row, int* last_row) {
+  if (frame.width != previous.width || frame.height != previous.height ||
+      frame.palette != previous.palette) {
+    *first_row = 0;
+    *last_row = kRows - 1;
+    return true;
+  }
+
+  *first_row = -1;
+  for (int row = 0; row < kRows; row++) {
+    if (memcmp(getRow(frame.vram, row), getRow(previous.vram, row),
+               kBytesPerRow) != 0) {
+      if (*first_row == -1) {
+        *first_row = row;
+      }
+      *last_row = row;
+    }
+  }
+  return *first_row != -1;
+}
+
+
+void VGA::renderFrameARGB(const Frame& frame, byte* pixels, int pitch,
+                          int first_row, int last_row) {
+  renderRowsARGB(frame.vram, getCGATable(frame.palette), pixels, pitch,
+                 first_row, last_row);
+}
+
+
+void VGA::renderRowsARGB(const byte* vram, const CGATable& table,
+                         byte* pixels, int pitch, int first_row,
+                         int last_row) {
+  for (int row = first_row; row <= last_row; row++) {
+    CGAtoARGB(getRow(vram, row), table, kBytesPerRow, (uint32_t*)pixels);
+    pixels += pitch;
+  }
+}
+
+
+const byte* VGA::getRow(const byte* vram, int row) {
   // CGA VRAM is "interlaced". The first bank contains the even rows and
   // the second bank (8K after) contains the odd rows.
-  byte* vram_b1 = x86_->getMem8Ptr(0xB800, 0);
-  byte* vram_b2 = vram_b1 + 8192;
-  for (int y = 0; y < 200; y += 2) {
-    CGAtoRGB(vram_b1, cga_palette_, 320, buffer);
-    buffer += 320*3;
-    vram_b1 += 80;
+  return vram + (row & 1) * kBankSize + (row >> 1) * kBytesPerRow;
+}
+
 
-    CGAtoRGB(vram_b2, cga_palette_, 320, buffer);
-    buffer += 320*3;
-    vram_b2 += 80;
+static bool buildCGATables(VGA::CGATable* tables) {
+  for (int palette = 0; palette < 2; palette++) {
+    for (int value = 0; value < 256; value++) {
+      // The leftmost pixel is in the high bits.
+      for (int px = 0; px < 4; px++) {
+        const byte* color = kCGAColors[palette][(value >> (6 - px * 2)) & 3];
+        tables[palette].pixels[value][px] =
+            0xFF000000 | (color[0] << 16) | (color[1] << 8) | color[2];
+      }
+    }
   }
+  return true;
 }
 
 
-void VGA::CGAtoRGB(byte* cga, int palette, int npixels, byte* rgb) {
+const VGA::CGATable& VGA::getCGATable(int palette) {
+  // Built on first use, which is thread safe.
+  static CGATable tables[2];
+  static bool built = buildCGATables(tables);
+  (void)built;
+  return tables[palette & 1];
+}
+
+
+void VGA::CGAtoARGB(const byte* cga, const CGATable& table, int nbytes,
+                    uint32_t* argb) {
+  // A lookup per byte, instead of masking and shifting out every pixel.
+  for (int i = 0; i < nbytes; i++) {
+    const uint32_t* pixels = table.pixels[cga[i]];
+    *argb++ = pixels[0];
+    *argb++ = pixels[1];
+    *argb++ = pixels[2];
+    *argb++ = pixels[3];
+  }
+}
+
+
+void VGA::CGAtoRGB(const byte* cga, int palette, int npixels, byte* rgb) {
   while (npixels) {
     // 4 pixels per byte.
     byte mask = 0b11000000;
@@ -160,6 +346,16 @@ void VGA::CGAtoRGB(byte* cga, int palette, int npixels, byte* rgb) {
 }
 
 
+byte* VGA::getVRAM() {
+  return x86_->getMemory()->getRawPointer(kVRAMAddress);
+}
+
+
+byte* VGA::getWritableVRAM() {
+  return x86_->getMemory()->getPointer(kVRAMAddress, kVRAMSize);
+}
+
+
 void VGA::getModeSize(int& width, int& height) {
   width = height = 0;
   if (mode_ == MODE_CGA_320x200) {
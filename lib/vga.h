@@ -11,33 +11,129 @@
 
 #include "device.h"
 
+#include <cstdint>
+
 class X86;
 
-class VGA : public InterruptHandler, public IOHandler {
+//
+// CGA adapter. VRAM is mapped as device memory, so writes to it mark the
+// rows they touch as dirty and only those need to be converted again.
+//
+class VGA : public InterruptHandler, public IOHandler, public MemoryHandler {
  public:
+  // CGA VRAM, at B800:0000. Even rows are in the first 8K bank and odd rows
+  // in the second one.
+  static const int kVRAMAddress = 0xB8000;
+  static const int kVRAMSize = 0x4000;
+  static const int kBankSize = 0x2000;
+  static const int kBytesPerRow = 80;
+  static const int kRows = 200;
+
+  // A copy of the screen, which can be rendered without the VGA, e.g. on
+  // another thread. Width and height are 0 for unsupported modes.
+  struct Frame {
+    int width;
+    int height;
+    float pixel_aspect_ratio;
+    byte palette;
+    byte vram[kVRAMSize];
+  };
+
   VGA(X86* x86);
  
   virtual void handleInterrupt(int num);
   virtual byte handleIN(int port);
   virtual void handleOUT(int port, byte val);
+  virtual void handleMemoryWrite(int address, int size) override;
 
   virtual void getModeSize(int& width, int& height);
   virtual float getPixelAspectRatio();
   virtual void renderRGB(byte* buffer);
 
+  // Gets the first and last rows that changed since they were last rendered
+  // with renderARGB(). Returns false if none did.
+  bool getDirtyRows(int* first_row, int* last_row) const;
+
+  // Renders the given rows as 32-bit ARGB pixels (SDL_PIXELFORMAT_ARGB8888),
+  // with rows pitch bytes apart, and marks them as clean.
+  void renderARGB(byte* pixels, int pitch, int first_row, int last_row);
+
+  // Marks the whole screen as dirty, e.g. when the previous frame was lost.
+  void invalidate();
+
+  // Copies the screen into the frame and marks it as clean. Returns false,
+  // without copying, if nothing changed since it was last captured or
+  // rendered.
+  bool captureFrame(Frame* frame);
+
+  // Gets the first and last rows that differ between two frames. Returns
+  // false if none do.
+  static bool getChangedRows(const Frame& frame, const Frame& previous,
+                             int* first_row, int* last_row);
+
+  // Like renderARGB(), for a frame.
+  static void renderFrameARGB(const Frame& frame, byte* pixels, int pitch,
+                              int first_row, int last_row);
+
   void setVideoMode(int mode);
   void setPalette(int palette);
 
+  // Mode and palette, for snapshots. VRAM is part of the memory.
+  struct State {
+    byte mode;
+    byte palette;
+  };
+
+  void saveState(State* state) const;
+  void restoreState(const State& state);
+
   void clearVRAM();
   void randomVRAM();
 
-  static void CGAtoRGB(byte* cga, int palette, int npixels, byte* rgb);
+  // The 4 ARGB pixels of every CGA byte, in one of the palettes.
+  struct CGATable {
+    uint32_t pixels[256][4];
+  };
+
+  static const CGATable& getCGATable(int palette);
+
+  // Converts bytes of CGA pixels to ARGB pixels, through the table.
+  static void CGAtoARGB(const byte* cga, const CGATable& table, int nbytes,
+                        uint32_t* argb);
+
+  // Converts CGA pixels to RGB straight from the palette colors.
+  static void CGAtoRGB(const byte* cga, int palette, int npixels, byte* rgb);
 
  private:
+  // CGA status register: retrace bits, computed from the cycle count. The
+  // CGA scans 262 lines of 912 dots, 3 per CPU cycle, 640 of them visible.
+  static const int kStatusPort = 0x3DA;
+  static const int kStatusRetrace = 0x01;
+  static const int kStatusVerticalRetrace = 0x08;
+  static const int kScanlines = 262;
+  static const int kCyclesPerScanline = 304;
+  static const int kVisibleCyclesPerScanline = 213;
+
+  byte getStatus() const;
+
+  byte* getVRAM();
+
+  // Same, but counts as a write to the memory, e.g. for snapshots.
+  byte* getWritableVRAM();
+  static const byte* getRow(const byte* vram, int row);
+  static void renderRowsARGB(const byte* vram, const CGATable& table,
+                             byte* pixels, int pitch, int first_row,
+                             int last_row);
+
   X86* x86_;
 
   byte mode_;
   byte cga_palette_;
+  const CGATable* cga_table_;
+
+  // Rows changed since the last renderARGB(), -1 if none.
+  int dirty_first_row_;
+  int dirty_last_row_;
 };
 
 #endif // __VGA_H__
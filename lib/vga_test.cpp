@@ -0,0 +1,50 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "vga.h"
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using namespace std;
+
+
+TEST(VGATest, CGATable) {
+  // Black, green/cyan, red/magenta, brown/gray.
+  const byte kPixels = 0x1B;
+  EXPECT_EQ(0xFF000000, VGA::getCGATable(0).pixels[kPixels][0]);
+  EXPECT_EQ(0xFF00AA00, VGA::getCGATable(0).pixels[kPixels][1]);
+  EXPECT_EQ(0xFFAA0000, VGA::getCGATable(0).pixels[kPixels][2]);
+  EXPECT_EQ(0xFFAA5500, VGA::getCGATable(0).pixels[kPixels][3]);
+  EXPECT_EQ(0xFF00AAAA, VGA::getCGATable(1).pixels[kPixels][1]);
+  EXPECT_EQ(0xFFAA00AA, VGA::getCGATable(1).pixels[kPixels][2]);
+  EXPECT_EQ(0xFFAAAAAA, VGA::getCGATable(1).pixels[kPixels][3]);
+}
+
+
+TEST(VGATest, CGAtoARGBMatchesRGB) {
+  // Every byte value, in both palettes.
+  const int kBytes = 256;
+  vector<byte> cga(kBytes);
+  for (int i = 0; i < kBytes; i++) {
+    cga[i] = i;
+  }
+
+  for (int palette = 0; palette < 2; palette++) {
+    vector<uint32_t> argb(kBytes * 4);
+    VGA::CGAtoARGB(&cga[0], VGA::getCGATable(palette), kBytes, &argb[0]);
+
+    vector<byte> rgb(kBytes * 4 * 3);
+    VGA::CGAtoRGB(&cga[0], palette, kBytes * 4, &rgb[0]);
+    for (int i = 0; i < kBytes * 4; i++) {
+      EXPECT_EQ(0xFF000000 | rgb[i * 3] << 16 | rgb[i * 3 + 1] << 8 |
+                rgb[i * 3 + 2], argb[i]);
+    }
+  }
+}
@@ -11,6 +11,9 @@
 #include "device.h"
 #include "memory.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -57,7 +60,9 @@ const bool X86::byte_parity_[256] = {
 // x86 CPU.
 //
 X86::X86(Memory* mem)
-  : mem_(mem), debug_level_(0) {
+  : mem_(mem), pending_irqs_(0), debug_level_(0), cycle_count_(0),
+    decode_cache_(mem), decode_cache_enabled_(true), tracking_mode_(TRACK_OFF),
+    stop_on_interrupt_(false), lazy_flags_(0) {
   reset();
 }
 
@@ -73,13 +78,23 @@ Memory* X86::getMemory() {
 void X86::reset() {
   X86Base::reset();
 
+  memset(&regs_, 0, sizeof(regs_));
   regs_.cs = 0;
   regs_.ip = 0x0100;
 
   regs_.ss = 0;
   regs_.sp = 0xFFFF;
 
-  call_stack_.clear();
+  lazy_flags_ = 0;
+
+  // Pending events keep their distance from the current cycle.
+  events_.rebase(cycle_count_);
+  bus_.reset(cycle_count_);
+  cycle_count_ = 0;
+  pending_irqs_ = 0;
+
+  call_stack_top_ = 0;
+  call_stack_depth_ = 0;
 }
 
 void X86::refetch() {
@@ -91,30 +106,8 @@ void X86::refetch() {
   fetchAndDecode();
 }
 
-byte X86::fetch() {
-  byte val = mem_->read(getCS_IP());
-  regs_.ip++;
-  bytes_fetched_++;
-
-  if (debug_level_ >= 2) {
-    clog << Addr(current_cs_, current_ip_) << " " << Hex8 << (int)val << endl;
-  }
-  return val;
-}
-
-
-int X86::getCS_IP() const {
-  return getLinearAddress(regs_.cs, regs_.ip);
-}
-
-
-int X86::getSS_SP() const {
-  return getLinearAddress(regs_.ss, regs_.sp);
-}
-
-
-int X86::getLinearAddress(word segment, word offset) const {
-  return (segment << 4) + offset;
+void X86::logFetch(byte val) {
+  clog << Addr(current_cs_, current_ip_) << " " << Hex8 << (int)val << endl;
 }
 
 
@@ -130,6 +123,7 @@ void X86::invalidOpcode() {
 
 
 void X86::outputCurrentOperation(std::ostream& os) {
+  describeCurrentOperation();
   os << Addr(current_cs_, current_ip_) << " ";
 
   byte* code = getMem8Ptr(current_cs_, current_ip_);
@@ -138,14 +132,26 @@ void X86::outputCurrentOperation(std::ostream& os) {
 }
 
 
+void X86::describeCurrentOperation() {
+  if (!described_ && isExecutePending()) {
+    bytes_fetched_ = 0;
+  }
+  Base::describeCurrentOperation();
+}
+
+
+long long X86::getCycleCount() const {
+  return cycle_count_;
+}
+
+
 int X86::getBytesFetched() const {
   return bytes_fetched_;
 }
 
 
 void X86::fetchAndDecode() {
-  bytes_fetched_ = 0;
-  X86Base::fetchAndDecode();
+  decode();
 
   if (debug_level_ >= 1) {
     outputCurrentOperation(clog);
@@ -153,32 +159,222 @@ void X86::fetchAndDecode() {
 }
 
 
-bool X86::isExecutePending() const {
-  return (handler_ != nullptr);
+void X86::decode() {
+  bytes_fetched_ = 0;
+
+  const DecodedInstruction* decoded = nullptr;
+  if (decode_cache_enabled_) {
+    decoded = decode_cache_.find(regs_.cs, regs_.ip, &bytes_fetched_);
+  }
+
+  if (decoded) {
+    ASSERT(operation_ == OP_NONE);
+    Base::clearExecutionState();
+    Base::restoreDecodedInstruction(*decoded);
+    regs_.ip += bytes_fetched_;
+  } else if (decode_cache_enabled_) {
+    // The page is watched before decoding, so the entry isn't added if
+    // decoding wrote to it, e.g. by resolving a memory operand the
+    // instruction may write its own bytes through.
+    int generation =
+        *decode_cache_.watchPage(getLinearAddress(regs_.cs, regs_.ip));
+    Base::fetchAndDecode();
+
+    DecodedInstruction decoded;
+    saveDecodedInstruction(&decoded);
+    decode_cache_.insert(current_cs_, current_ip_, bytes_fetched_, generation,
+                         decoded);
+  } else {
+    Base::fetchAndDecode();
+  }
 }
 
 
-word* X86::getReg16Ptr(int reg) {
-  ASSERT(reg >= 0);
-  ASSERT(reg <= R16_COUNT);
-  return &regs_.regs16[reg];
+X86::RunResult X86::runFor(long long cycles, int instructions) {
+  RunResult result;
+  result.reason = STOP_BUDGET;
+  result.instructions = 0;
+
+  long long start_cycles = cycle_count_;
+  long long end_cycles = (cycles == -1) ? LLONG_MAX : start_cycles + cycles;
+  bool first = true;
+  while (cycle_count_ < end_cycles && result.instructions != instructions) {
+    if (!isExecutePending()) {
+      if (cycle_count_ >= events_.getNextCycle()) {
+        serviceEvents();
+      }
+      if (!first && stop_addresses_.contains(getCS_IP())) {
+        result.reason = STOP_ADDRESS;
+        break;
+      }
+    }
+    first = false;
+
+    int operation;
+    try {
+      if (!isExecutePending()) {
+        X86::fetchAndDecode();
+      }
+      operation = operation_;
+      Base::execute();
+    } catch (const runtime_error& e) {
+      result.reason = STOP_ERROR;
+      result.error = e.what();
+      break;
+    }
+    result.instructions++;
+
+    if (operation == OP_INT && stop_on_interrupt_) {
+      result.reason = STOP_INTERRUPT;
+      break;
+    }
+  }
+
+  result.cycles = cycle_count_ - start_cycles;
+  return result;
 }
 
 
-byte* X86::getReg8Ptr(int reg) {
-  ASSERT(reg >= 0);
-  ASSERT(reg <= R8_COUNT);
-  return &regs_.regs8[reg];
+AddressBitmap* X86::getStopAddresses() {
+  return &stop_addresses_;
 }
 
 
-word* X86::getMem16Ptr(word segment, word offset) {
-  return (word*)mem_->getPointer(getLinearAddress(segment, offset));
+void X86::setStopOnInterrupt(bool stop) {
+  stop_on_interrupt_ = stop;
 }
 
 
-byte* X86::getMem8Ptr(word segment, word offset) {
-  return mem_->getPointer(getLinearAddress(segment, offset));
+void X86::saveState(State* state) const {
+  state->regs = regs_;
+  state->lazy_result = lazy_result_;
+  state->lazy_is_word = lazy_is_word_;
+  state->lazy_flags = lazy_flags_;
+
+  state->cycle_count = cycle_count_;
+  state->events = events_;
+  state->pending_irqs = pending_irqs_;
+
+  state->execute_pending = isExecutePending();
+  if (state->execute_pending) {
+    saveDecodedInstruction(&state->pending);
+  }
+  state->current_cs = current_cs_;
+  state->current_ip = current_ip_;
+  state->bytes_fetched = bytes_fetched_;
+
+  if (tracking_mode_ == TRACK_CALL_STACK) {
+    state->call_stack = getCallStack();
+  } else {
+    state->call_stack.clear();
+  }
+}
+
+
+void X86::restoreState(const State& state) {
+  regs_ = state.regs;
+  lazy_result_ = state.lazy_result;
+  lazy_is_word_ = state.lazy_is_word;
+  lazy_flags_ = state.lazy_flags;
+
+  cycle_count_ = state.cycle_count;
+  events_ = state.events;
+  pending_irqs_ = state.pending_irqs;
+
+  // Memory operands are resolved again from the restored registers.
+  clearExecutionState();
+  if (state.execute_pending) {
+    Base::restoreDecodedInstruction(state.pending);
+  }
+  current_cs_ = state.current_cs;
+  current_ip_ = state.current_ip;
+  bytes_fetched_ = state.bytes_fetched;
+
+  copy(state.call_stack.begin(), state.call_stack.end(), call_stack_);
+  call_stack_depth_ = state.call_stack.size();
+  call_stack_top_ = call_stack_depth_ % kCallStackSize;
+}
+
+
+EventScheduler* X86::getEventScheduler() {
+  return &events_;
+}
+
+
+void X86::requestIRQ(int irq) {
+  ASSERT(irq >= 0 && irq < 8);
+  pending_irqs_ |= 1 << irq;
+  if (getFlag(F_IF)) {
+    events_.wake();
+  }
+}
+
+
+void X86::serviceEvents() {
+  ASSERT(!isExecutePending());
+  events_.runDue(cycle_count_);
+
+  if (pending_irqs_ != 0 && getFlag(F_IF)) {
+    int irq = 0;
+    while ((pending_irqs_ & (1 << irq)) == 0) {
+      irq++;
+    }
+    pending_irqs_ &= ~(1 << irq);
+    interrupt(8 + irq);
+  }
+}
+
+
+int X86::decodeAt(word cs, word ip, DecodedInstruction* decoded) {
+  ASSERT(!isExecutePending());
+
+  word saved_cs = regs_.cs;
+  word saved_ip = regs_.ip;
+  regs_.cs = cs;
+  regs_.ip = ip;
+
+  try {
+    decode();
+  } catch (...) {
+    regs_.cs = saved_cs;
+    regs_.ip = saved_ip;
+    clearExecutionState();
+    throw;
+  }
+  saveDecodedInstruction(decoded);
+  int length = bytes_fetched_;
+
+  regs_.cs = saved_cs;
+  regs_.ip = saved_ip;
+  clearExecutionState();
+
+  return length;
+}
+
+
+const int* X86::watchCodePage(word cs, word ip) {
+  return decode_cache_.watchPage(getLinearAddress(cs, ip));
+}
+
+
+void X86::invalidateCodePage(int address) {
+  decode_cache_.invalidatePage(address);
+}
+
+
+void X86::setDecodeCacheEnabled(bool enabled) {
+  decode_cache_enabled_ = enabled;
+  decode_cache_.clear();
+}
+
+
+const DecodeCache::Stats& X86::getDecodeCacheStats() const {
+  return decode_cache_.getStats();
+}
+
+
+bool X86::isExecutePending() const {
+  return (operation_ != OP_NONE);
 }
 
 
@@ -198,12 +394,8 @@ void X86::setDebugLevel(int debug_level) {
 }
 
 
-bool X86::getFlag(word mask) const {
-  return (regs_.flags & mask) == mask;
-}
-
-
 void X86::setFlag(word mask, bool value) {
+  lazy_flags_ &= ~mask;
   if (value) {
     regs_.flags |= mask;
   } else {
@@ -224,6 +416,31 @@ void X86::POP() {
 }
 
 
+void X86::PUSHF() {
+  doPush(getFlags());
+}
+
+
+void X86::POPF() {
+  setFlags(doPop());
+  if (pending_irqs_ != 0 && getFlag(F_IF)) {
+    events_.wake();
+  }
+}
+
+
+void X86::LAHF() {
+  regs_.ah = getFlags() & 0xFF;
+}
+
+
+void X86::SAHF() {
+  // SF, ZF, AF, PF and CF.
+  const word kMask = 0xD5;
+  setFlags((getFlags() & ~kMask) | (regs_.ah & kMask));
+}
+
+
 word X86::doPop() {
   word val = *(word*)mem_->getPointer(getSS_SP());
   regs_.sp += 2;
@@ -239,41 +456,156 @@ void X86::doPush(word val) {
 
 
 void X86::registerInterruptHandler(InterruptHandler* handler, int num) {
-  ASSERT(int_handlers_.count(num) == 0);
-  int_handlers_[num] = handler;
+  bus_.registerInterruptHandler(handler, num);
+}
+
+
+void X86::registerIOHandler(IOHandler* handler, int port, int count) {
+  bus_.registerIOHandler(handler, port, count);
 }
 
 
-void X86::registerIOHandler(IOHandler* handler, int num) {
-  ASSERT(io_handlers_.count(num) == 0);
-  io_handlers_[num] = handler;
+void X86::registerResetHandler(ResetHandler* handler) {
+  bus_.registerResetHandler(handler);
+}
+
+
+DeviceBus* X86::getDeviceBus() {
+  return &bus_;
+}
+
+
+bool X86::interrupt(int num) {
+  // Only the vectors below 40h are taken from the table: a COM program runs
+  // from 0000:0100, so the rest of the table is the program itself.
+  const word* vector = (const word*)mem_->getReadPointer(num * 4);
+  if (num < kProgramVectors && (vector[0] != 0 || vector[1] != 0)) {
+    doPush(getFlags());
+    setFlag(F_IF, false);
+    setFlag(F_TF, false);
+    doPush(regs_.cs);
+    doPush(regs_.ip);
+    regs_.ip = vector[0];
+    regs_.cs = vector[1];
+    return true;
+  }
+
+  materializeFlags();
+  return bus_.interrupt(num);
 }
 
 
 void X86::adjustFlagZSP(byte value) {
-  setFlag(F_ZF, value == 0);
-  setFlag(F_SF, (value & 0x80) == 0x80);
-  setFlag(F_PF, byte_parity_[value]);
+  setLazyFlags(value, false, kFlagsZSP);
 }
 
 
 void X86::adjustFlagZSP(word value) {
-  setFlag(F_ZF, value == 0);
-  setFlag(F_SF, (value & 0x8000) == 0x8000);
-  setFlag(F_PF, byte_parity_[value & 0xFF]);
+  setLazyFlags(value, true, kFlagsZSP);
+}
+
+
+void X86::setLazyFlags(int result, bool is_word, word mask) {
+  // Flags pending from the previous operation that this one doesn't set.
+  word stale = lazy_flags_ & ~mask;
+  if (stale) {
+    regs_.flags = (regs_.flags & ~stale) | (computeLazyFlags() & stale);
+  }
+
+  lazy_result_ = result;
+  lazy_is_word_ = is_word;
+  lazy_flags_ = mask;
 }
 
 
-void X86::addEntryPoint() {
-  entry_points_.insert(getCS_IP());
+word X86::computeLazyFlags() const {
+  int value = lazy_result_ & (lazy_is_word_ ? 0xFFFF : 0xFF);
+  int sign = lazy_is_word_ ? 0x8000 : 0x80;
+  int carry = lazy_is_word_ ? 0x10000 : 0x100;
+
+  // OF is only ever pending for logic operations, which clear it.
+  word flags = 0;
+  if (value == 0) {
+    flags |= F_ZF;
+  }
+  if (value & sign) {
+    flags |= F_SF;
+  }
+  if (byte_parity_[value & 0xFF]) {
+    flags |= F_PF;
+  }
+  if (lazy_result_ & carry) {
+    flags |= F_CF;
+  }
+  return flags;
 }
 
 
-const vector<pair<word, word>>& X86::getCallStack() const {
-  return call_stack_;
+word X86::getFlags() const {
+  if (lazy_flags_ == 0) {
+    return regs_.flags;
+  }
+  return (regs_.flags & ~lazy_flags_) | (computeLazyFlags() & lazy_flags_);
 }
 
-const unordered_set<int>& X86::getEntryPoints() const {
+
+void X86::setFlags(word flags) {
+  regs_.flags = flags;
+  lazy_flags_ = 0;
+}
+
+
+void X86::materializeFlags() {
+  if (lazy_flags_) {
+    setFlags(getFlags());
+  }
+}
+
+
+void X86::setTrackingMode(TrackingMode mode) {
+  tracking_mode_ = mode;
+  if (mode < TRACK_CALL_STACK) {
+    call_stack_depth_ = 0;
+  }
+  if (mode < TRACK_ENTRY_POINTS) {
+    entry_points_.clear();
+  }
+}
+
+
+X86::TrackingMode X86::getTrackingMode() const {
+  return tracking_mode_;
+}
+
+
+void X86::pushCall() {
+  call_stack_[call_stack_top_] = {regs_.cs, regs_.ip - bytes_fetched_};
+  call_stack_top_ = (call_stack_top_ + 1) % kCallStackSize;
+  if (call_stack_depth_ < kCallStackSize) {
+    call_stack_depth_++;
+  }
+}
+
+
+void X86::popCall() {
+  if (call_stack_depth_ > 0) {
+    call_stack_top_ = (call_stack_top_ + kCallStackSize - 1) % kCallStackSize;
+    call_stack_depth_--;
+  }
+}
+
+
+vector<pair<word, word>> X86::getCallStack() const {
+  vector<pair<word, word>> call_stack;
+  for (int i = call_stack_depth_; i > 0; i--) {
+    call_stack.push_back(
+        call_stack_[(call_stack_top_ + kCallStackSize - i) % kCallStackSize]);
+  }
+  return call_stack;
+}
+
+
+const AddressBitmap& X86::getEntryPoints() const {
   return entry_points_;
 }
 
@@ -283,8 +615,7 @@ void X86::ADD_w() {
   int result = (*warg1) + (*warg2);
   *warg1 = result & 0xFFFF;
 
-  setFlag(F_CF, (result & 0x10000) != 0);
-  adjustFlagZSP(*warg1);
+  setLazyFlags(result, true, kFlagsArith);
 }
 
 void X86::ADC_b() {
@@ -293,8 +624,7 @@ void X86::ADC_b() {
   int result = (*barg1) + (*barg2) + getFlag(F_CF);
   *barg1 = result & 0xFF;
 
-  setFlag(F_CF, (result & 0x100) != 0);
-  adjustFlagZSP(*barg1);
+  setLazyFlags(result, false, kFlagsArith);
 }
 
 void X86::ADD_b() {
@@ -303,8 +633,7 @@ void X86::ADD_b() {
   int result = (*barg1) + (*barg2);
   *barg1 = result & 0xFF;
 
-  setFlag(F_CF, (result & 0x100) != 0);
-  adjustFlagZSP(*barg1);
+  setLazyFlags(result, false, kFlagsArith);
 }
 
 
@@ -315,52 +644,48 @@ void X86::ADD_wb() {
   int result = (*warg1) + (*barg2);
   *warg1 = result & 0xFFFF;
 
-  setFlag(F_CF, (result & 0x10000) != 0);
-  adjustFlagZSP(*warg1);
+  setLazyFlags(result, true, kFlagsArith);
 }
 
 
 void X86::SUB_b() {
   CHECK_BARGS();
 
-  bool borrow = (*barg1) < (*barg2);
-  *barg1 -= *barg2;
+  // A borrow leaves the result negative, setting the carry bit.
+  int result = (*barg1) - (*barg2);
+  *barg1 = result & 0xFF;
 
-  setFlag(F_CF, borrow);
-  adjustFlagZSP(*barg1);
+  setLazyFlags(result, false, kFlagsArith);
 }
 
 
 void X86::SUB_w() {
   CHECK_WARGS();
 
-  bool borrow = (*warg1) < (*warg2);
-  *warg1 -= *warg2;
+  int result = (*warg1) - (*warg2);
+  *warg1 = result & 0xFFFF;
 
-  setFlag(F_CF, borrow);
-  adjustFlagZSP(*warg1);
+  setLazyFlags(result, true, kFlagsArith);
 }
 
 
 void X86::SBB_w() {
   CHECK_WARGS();
 
-  bool borrow = (*warg1) < (*warg2) + (int)getFlag(F_CF);
-  *warg1 -= *warg2 + (int)getFlag(F_CF);
+  int result = (*warg1) - ((*warg2) + (int)getFlag(F_CF));
+  *warg1 = result & 0xFFFF;
 
-  setFlag(F_CF, borrow);
-  adjustFlagZSP(*warg1);
+  setLazyFlags(result, true, kFlagsArith);
 }
 
 
 void X86::SBB_b() {
   CHECK_BARGS();
 
-  bool borrow = (*barg1) < (*barg2) + (int)getFlag(F_CF);
-  *barg1 -= *barg2 + (int)getFlag(F_CF);
+  int result = (*barg1) - ((*barg2) + (int)getFlag(F_CF));
+  *barg1 = result & 0xFF;
 
-  setFlag(F_CF, borrow);
-  adjustFlagZSP(*barg1);
+  setLazyFlags(result, false, kFlagsArith);
 }
 
 
@@ -376,6 +701,14 @@ void X86::MOV_b() {
 }
 
 
+void X86::XCHG_b() {
+  CHECK_BARGS();
+  byte tmp = *barg1;
+  *barg1 = *barg2;
+  *barg2 = tmp;
+}
+
+
 void X86::XCHG_w() {
   CHECK_WARGS();
   word tmp = *warg1;
@@ -401,6 +734,9 @@ void X86::CLI() {
 
 void X86::STI() {
   setFlag(F_IF, true);
+  if (pending_irqs_ != 0) {
+    events_.wake();
+  }
 }
 
 
@@ -463,9 +799,147 @@ void X86::STOSB() {
 }
 
 
+// Number of elements of the given size that can be accessed starting at
+// offset, in the direction given by DF, before the offset wraps around.
+static int getElementsBeforeWrap(word offset, int size, bool backwards) {
+  return (backwards ? offset : 0xFFFF - offset) / size + 1;
+}
+
+
+// First offset of a chunk of count elements, in the direction given by DF.
+static int getChunkStart(word offset, int size, int count, bool backwards) {
+  return backwards ? offset - size * (count - 1) : offset;
+}
+
+
+bool X86::executeRep() {
+  switch (operation_) {
+    case OP_MOVSB: return repMove(1);
+    case OP_MOVSW: return repMove(2);
+    case OP_STOSB: return repStore();
+    case OP_CMPSB: return repCompare();
+  }
+  return false;
+}
+
+
+bool X86::repMove(int size) {
+  bool backwards = getFlag(F_DF);
+  while (regs_.cx != 0) {
+    int count = min<int>(regs_.cx,
+                         min(getElementsBeforeWrap(regs_.si, size, backwards),
+                             getElementsBeforeWrap(regs_.di, size, backwards)));
+    int length = size * count;
+    int src = getLinearAddress(
+        segment_, getChunkStart(regs_.si, size, count, backwards));
+    int dst = getLinearAddress(
+        regs_.es, getChunkStart(regs_.di, size, count, backwards));
+    if (src + length > mem_->getSize() || dst + length > mem_->getSize()) {
+      return false;
+    }
+
+    byte* src_ptr = mem_->getPointer(src, length);
+    byte* dst_ptr = mem_->getPointer(dst, length);
+    if (src_ptr == nullptr || dst_ptr == nullptr) {
+      return false;
+    }
+
+    // If the destination starts inside the source in the direction of the
+    // copy, elements written earlier are read again, so copy them one by one.
+    bool sequential = backwards ? (dst < src && dst + length > src)
+                                : (dst > src && dst < src + length);
+    if (sequential) {
+      for (int i = 0; i < count; i++) {
+        int offset = backwards ? length - size * (i + 1) : size * i;
+        memmove(dst_ptr + offset, src_ptr + offset, size);
+      }
+    } else {
+      memmove(dst_ptr, src_ptr, length);
+    }
+
+    int inc_dec = backwards ? -length : length;
+    regs_.si += inc_dec;
+    regs_.di += inc_dec;
+    regs_.cx -= count;
+  }
+  return true;
+}
+
+
+bool X86::repStore() {
+  bool backwards = getFlag(F_DF);
+  while (regs_.cx != 0) {
+    int count = min<int>(regs_.cx,
+                         getElementsBeforeWrap(regs_.di, 1, backwards));
+    int dst = getLinearAddress(
+        regs_.es, getChunkStart(regs_.di, 1, count, backwards));
+    if (dst + count > mem_->getSize()) {
+      return false;
+    }
+
+    byte* dst_ptr = mem_->getPointer(dst, count);
+    if (dst_ptr == nullptr) {
+      return false;
+    }
+    memset(dst_ptr, regs_.al, count);
+
+    regs_.di += backwards ? -count : count;
+    regs_.cx -= count;
+  }
+  return true;
+}
+
+
+bool X86::repCompare() {
+  // Skip the elements that don't end the loop without computing flags. The
+  // one that does, or the last one, is left to CMPSB() so flags and the
+  // REPZ/REPNZ termination are handled as usual.
+  bool backwards = getFlag(F_DF);
+  bool repeat_while_equal = (rep_opcode_ == 0xF3);
+  while (regs_.cx > 1) {
+    int count = min<int>(regs_.cx - 1,
+                         min(getElementsBeforeWrap(regs_.si, 1, backwards),
+                             getElementsBeforeWrap(regs_.di, 1, backwards)));
+    int src = getLinearAddress(
+        segment_, getChunkStart(regs_.si, 1, count, backwards));
+    int dst = getLinearAddress(
+        regs_.es, getChunkStart(regs_.di, 1, count, backwards));
+    if (src + count > mem_->getSize() || dst + count > mem_->getSize()) {
+      break;
+    }
+
+    const byte* src_ptr = mem_->getPointer(src, count);
+    const byte* dst_ptr = mem_->getPointer(dst, count);
+    if (src_ptr == nullptr || dst_ptr == nullptr) {
+      break;
+    }
+
+    int skipped = 0;
+    while (skipped < count) {
+      int offset = backwards ? count - 1 - skipped : skipped;
+      if ((src_ptr[offset] == dst_ptr[offset]) != repeat_while_equal) {
+        break;
+      }
+      skipped++;
+    }
+
+    regs_.si += backwards ? -skipped : skipped;
+    regs_.di += backwards ? -skipped : skipped;
+    regs_.cx -= skipped;
+
+    if (skipped < count) {
+      break;
+    }
+  }
+  return false;
+}
+
+
 void X86::CALL_w() {
   CHECK_WARG1();
-  call_stack_.push_back({regs_.cs, regs_.ip - bytes_fetched_});
+  if (tracking_mode_ == TRACK_CALL_STACK) {
+    pushCall();
+  }
 
   doPush(regs_.ip);
   regs_.ip = *warg1;
@@ -508,8 +982,7 @@ void X86::XOR_b() {
   CHECK_BARGS();
   *barg1 ^= *barg2;
 
-  adjustFlagZSP(*barg1);
-  setFlag(F_OF | F_CF, false);
+  setLazyFlags(*barg1, false, kFlagsLogic);
 }
 
 
@@ -517,8 +990,7 @@ void X86::OR_b() {
   CHECK_BARGS();
   *barg1 |= *barg2;
 
-  adjustFlagZSP(*barg1);
-  setFlag(F_OF | F_CF, false);
+  setLazyFlags(*barg1, false, kFlagsLogic);
 }
 
 
@@ -526,8 +998,7 @@ void X86::OR_w() {
   CHECK_WARGS();
   *warg1 |= *warg2;
 
-  adjustFlagZSP(*warg1);
-  setFlag(F_OF | F_CF, false);
+  setLazyFlags(*warg1, true, kFlagsLogic);
 }
 
 
@@ -535,8 +1006,7 @@ void X86::AND_b() {
   CHECK_BARGS();
   *barg1 &= *barg2;
 
-  adjustFlagZSP(*barg1);
-  setFlag(F_OF | F_CF, false);
+  setLazyFlags(*barg1, false, kFlagsLogic);
 }
 
 
@@ -547,6 +1017,12 @@ void X86::TEST_b() {
 }
 
 
+void X86::TEST_w() {
+  CHECK_WARGS();
+  setLazyFlags(*warg1 & *warg2, true, kFlagsLogic);
+}
+
+
 void X86::CMP_b() {
   byte val = *barg1;
   SUB_b();
@@ -563,43 +1039,59 @@ void X86::CMP_w() {
 
 void X86::INT() {
   CHECK_BARG1();
-  byte intval = *barg1;
-  
-  auto handler = int_handlers_.find(intval);
-  if (handler != int_handlers_.end()) {
-    handler->second->handleInterrupt(intval);
-  } else {
-    cerr << "No interrupt handler for 0x" << Hex8 << (int)intval << endl;
+  interrupt(*barg1);
+}
+
+
+void X86::IRET() {
+  regs_.ip = doPop();
+  regs_.cs = doPop();
+  setFlags(doPop());
+  if (pending_irqs_ != 0 && getFlag(F_IF)) {
+    events_.wake();
+  }
+}
+
+
+void X86::HLT() {
+  // Idle until the next event rather than spinning through the time until
+  // then. Nothing would ever wake the CPU with interrupts disabled.
+  long long next_event = events_.getNextCycle();
+  if (getFlag(F_IF) && next_event != LLONG_MAX && next_event > cycle_count_) {
+    cycle_count_ = next_event;
   }
 }
 
 
 void X86::IN_b() {
   CHECK_BARGS();
+  *barg1 = bus_.in(*barg2);
+}
 
-  auto handler = io_handlers_.find(*barg2);
-  if (handler != io_handlers_.end()) {
-    *barg1 = handler->second->handleIN(*barg2);
-  } else {
-    cerr << "No I/O handler for 0x" << Hex8 << (int)(*barg2) << endl;
-  }
+
+void X86::IN_bw() {
+  CHECK_BARG1();
+  CHECK_WARG2();
+  *barg1 = bus_.in(*warg2);
 }
 
 
 void X86::OUT_b() {
   CHECK_BARGS();
+  bus_.out(*barg1, *barg2);
+}
 
-  auto handler = io_handlers_.find(*barg1);
-  if (handler != io_handlers_.end()) {
-    handler->second->handleOUT(*barg1, *barg2);
-  } else {
-    cerr << "No I/O handler for 0x" << Hex8 << (int)(*barg1) << endl;
-  }
+
+void X86::OUT_wb() {
+  CHECK_WBARGS();
+  bus_.out(*warg1, *barg2);
 }
 
 
 void X86::RET() {
-  call_stack_.pop_back();
+  if (tracking_mode_ == TRACK_CALL_STACK) {
+    popCall();
+  }
   regs_.ip = doPop(); 
 }
 
@@ -9,17 +9,18 @@
 #ifndef __X86_H__
 #define __X86_H__
 
-#include "x86_base.h"
+#include "x86_base_t.h"
+#include "address_bitmap.h"
+#include "decode_cache.h"
+#include "device_bus.h"
+#include "event_scheduler.h"
 #include "helpers.h"
+#include "memory.h"
 
-#include <unordered_map>
-#include <unordered_set>
+#include <string>
+#include <vector>
 #include <iostream>
 
-class Memory;
-class InterruptHandler;
-class IOHandler;
-
 //
 // Registers.
 //
@@ -44,10 +45,18 @@ struct Registers {
 
 
 //
-// x86 CPU.
+// x86 CPU. The accessors below are defined inline and called without going
+// through the vtable by X86BaseT, so they're inlined in the decoder and the
+// opcode implementations.
 //
-class X86 : public X86Base {
+class X86 : public X86BaseT<X86> {
+  friend class X86BaseT<X86>;
+  typedef X86BaseT<X86> Base;
+
  public:
+  // Clock frequency of the original 8086, in Hz.
+  static const int kClockRate = 4772727;
+
   X86(Memory* mem);
 
   Registers* getRegisters();
@@ -59,8 +68,119 @@ class X86 : public X86Base {
   void refetch();
   bool isExecutePending() const;
 
+  // Why runFor() returned.
+  enum StopReason {
+    STOP_BUDGET,     // The cycles or instructions budget was used up.
+    STOP_ADDRESS,    // Execution reached a stop address.
+    STOP_INTERRUPT,  // An INT was executed, with setStopOnInterrupt() on.
+    STOP_ERROR,      // An instruction failed, e.g. it's not implemented.
+  };
+
+  struct RunResult {
+    StopReason reason;
+    int instructions;
+    long long cycles;
+
+    // For STOP_ERROR. The instruction that failed is left pending.
+    std::string error;
+  };
+
+  // Runs until the given number of cycles or instructions has been executed
+  // (-1 for no limit), or until one of the stop conditions. An instruction
+  // already pending is executed first. The stop address execution starts at,
+  // if any, is ignored.
+  RunResult runFor(long long cycles, int instructions = -1);
+
+  // Addresses (linear) where runFor() and the block translator stop, e.g.
+  // hooks and breakpoints.
+  AddressBitmap* getStopAddresses();
+
+  void setStopOnInterrupt(bool stop);
+
+  // Instructions are decoded once and then executed from the decode cache,
+  // unless it's disabled.
+  void setDecodeCacheEnabled(bool enabled);
+  const DecodeCache::Stats& getDecodeCacheStats() const;
+
+  // Decodes the instruction at CS:IP without executing it. Registers are left
+  // untouched. Returns the length of the instruction.
+  int decodeAt(word cs, word ip, DecodedInstruction* decoded);
+
+  // Returns the write generation of the page containing CS:IP, which changes
+  // whenever code in that page may have been modified.
+  const int* watchCodePage(word cs, word ip);
+
+  // Changes the generation of the page containing a linear address, e.g. so
+  // code translated from it is translated again.
+  void invalidateCodePage(int address);
+
+  // Devices, on the bus. An IOHandler can take a range of ports.
   virtual void registerInterruptHandler(InterruptHandler* handler, int num);
-  virtual void registerIOHandler(IOHandler* handler, int num);
+  virtual void registerIOHandler(IOHandler* handler, int port, int count = 1);
+  void registerResetHandler(ResetHandler* handler);
+  DeviceBus* getDeviceBus();
+
+  // Transfers control to the handler of an interrupt: the one the program
+  // installed in the interrupt vector table if there's one, otherwise the
+  // registered InterruptHandler. Returns false if there's neither. Only
+  // interrupts below kProgramVectors are looked up in the table.
+  static const int kProgramVectors = 0x40;
+  bool interrupt(int num);
+
+  // Device events, timed in cycles. runFor() and the block translator run
+  // them between instructions, once the cycle count reaches the next one.
+  EventScheduler* getEventScheduler();
+  long long getNextEventCycle() const;
+
+  // Raises hardware interrupt line 0-7, delivered as INT 08h-0Fh between
+  // instructions while interrupts are enabled. The lowest line goes first.
+  void requestIRQ(int irq);
+
+  // Runs the events due and delivers a pending interrupt, if possible. Must
+  // be called between instructions.
+  void serviceEvents();
+
+  // Debugging aids, off by default so they cost nothing in a remake. Each
+  // mode includes the ones before it.
+  enum TrackingMode {
+    TRACK_OFF,
+    TRACK_ENTRY_POINTS,  // Targets of taken jumps and calls.
+    TRACK_CALL_STACK,    // The last kCallStackSize calls not yet returned.
+  };
+
+  static const int kCallStackSize = 256;
+
+  void setTrackingMode(TrackingMode mode);
+  TrackingMode getTrackingMode() const;
+
+  // Outermost call first.
+  std::vector<std::pair<word, word>> getCallStack() const;
+  const AddressBitmap& getEntryPoints() const;
+
+  // Everything that changes as the CPU runs, for snapshots. Memory isn't
+  // included, and neither are debugging settings like stop addresses.
+  struct State {
+    Registers regs;
+    int lazy_result;
+    bool lazy_is_word;
+    word lazy_flags;
+
+    long long cycle_count;
+    EventScheduler events;
+    byte pending_irqs;
+
+    // The instruction decoded but not executed yet, if any.
+    bool execute_pending;
+    DecodedInstruction pending;
+    word current_cs, current_ip;
+    int bytes_fetched;
+
+    // As getCallStack() returns it. Only kept with TRACK_CALL_STACK.
+    std::vector<std::pair<word, word>> call_stack;
+  };
+
+  void saveState(State* state) const;
+  void restoreState(const State& state);
 
  public:
 
@@ -81,11 +201,22 @@ class X86 : public X86Base {
 
   int getBytesFetched() const;
   void outputCurrentOperation(std::ostream& os);
+  virtual void describeCurrentOperation() override;
 
   virtual void setFlag(word mask, bool value);
 
-  const std::vector<std::pair<word, word>>& getCallStack() const;
-  const std::unordered_set<int>& getEntryPoints() const;
+  // Arithmetic and logic instructions record their result and leave ZF, SF,
+  // PF, CF and OF to be computed when read. getFlags() returns the complete
+  // flags; regs_.flags only holds them after materializeFlags(). Code that
+  // writes regs_.flags directly should use setFlags() instead.
+  word getFlags() const;
+  void setFlags(word flags);
+  void materializeFlags();
+
+  // Clock cycles executed since reset, according to the 8086 timings. This is
+  // the time base for anything that must happen at a given guest time.
+  long long getCycleCount() const;
+  void addCycles(int cycles);
 
   void addEntryPoint();
 
@@ -101,6 +232,7 @@ class X86 : public X86Base {
 
   virtual word* getMem16Ptr(word segment, word offset) override;
   virtual byte* getMem8Ptr(word segment, word offset) override;
+  virtual const word* getMem16ReadPtr(word segment, word offset) override;
 
   virtual bool getFlag(word mask) const override;
 
@@ -125,14 +257,18 @@ class X86 : public X86Base {
   virtual void DEC_w() override;
   virtual void INC_b() override;
   virtual void INC_w() override;
+  virtual void HLT() override;
   virtual void INT() override;
   virtual void IN_b() override;
+  virtual void IN_bw() override;
+  virtual void IRET() override;
   virtual void JB() override;
   virtual void JMP_b() override;
   virtual void JMP_w() override;
   virtual void JNB() override;
   virtual void JNZ() override;
   virtual void JZ() override;
+  virtual void LAHF() override;
   virtual void LDS() override;
   virtual void LOOP() override;
   virtual void MOVSB() override;
@@ -144,12 +280,16 @@ class X86 : public X86Base {
   virtual void OR_b() override;
   virtual void OR_w() override;
   virtual void OUT_b() override;
+  virtual void OUT_wb() override;
   virtual void POP() override;
+  virtual void POPF() override;
   virtual void PUSH() override;
+  virtual void PUSHF() override;
   virtual void RCL_b() override;
   virtual void RCL_w() override;
   virtual void RCR_b() override;
   virtual void RET() override;
+  virtual void SAHF() override;
   virtual void SBB_b() override;
   virtual void SBB_w() override;
   virtual void SHL_b() override;
@@ -162,17 +302,35 @@ class X86 : public X86Base {
   virtual void SUB_b() override;
   virtual void SUB_w() override;
   virtual void TEST_b() override;
+  virtual void TEST_w() override;
+  virtual void XCHG_b() override;
   virtual void XCHG_w() override;
   virtual void XOR_b() override;
 
  private:
+  // Fetches and decodes the instruction at CS:IP, through the decode cache.
+  void decode();
+
+  void logFetch(byte val);
+
+  // Bulk implementations of REP MOVSB, MOVSW, STOSB and CMPSB, called by
+  // X86BaseT::execute(). Ranges are processed in chunks that don't wrap
+  // around the 64K segment offsets.
+  bool executeRep();
+  bool repMove(int size);
+  bool repStore();
+  bool repCompare();
+
   // Memory and registers.
   Memory* mem_;
   Registers regs_;
 
   // Interrupt and I/O handlers.
-  std::unordered_map<int, InterruptHandler*> int_handlers_;
-  std::unordered_map<int, IOHandler*> io_handlers_;
+  DeviceBus bus_;
+
+  // Device events, and the interrupt lines raised but not delivered yet.
+  EventScheduler events_;
+  byte pending_irqs_;
 
   // Debugging and logging.
   int debug_level_;
@@ -180,14 +338,123 @@ class X86 : public X86Base {
   // Number of times fetch() is called.
   int bytes_fetched_;
 
-  // Call stack tracking.
-  std::vector<std::pair<word, word>> call_stack_;
+  long long cycle_count_;
+
+  // Decoded instructions.
+  DecodeCache decode_cache_;
+  bool decode_cache_enabled_;
+
+  // Tracking. The call stack is a ring buffer; once it's full, the oldest
+  // calls are overwritten.
+  void pushCall();
+  void popCall();
 
-  // Entry points.
-  std::unordered_set<int> entry_points_;
+  TrackingMode tracking_mode_;
+  std::pair<word, word> call_stack_[kCallStackSize];
+  int call_stack_top_;
+  int call_stack_depth_;
+  AddressBitmap entry_points_;
+
+  // runFor() stop conditions.
+  AddressBitmap stop_addresses_;
+  bool stop_on_interrupt_;
+
+  // Lazily evaluated flags: the flags in lazy_flags_ are computed from the
+  // result of the last operation, which keeps the carry out in bit 8 or 16.
+  void setLazyFlags(int result, bool is_word, word mask);
+  word computeLazyFlags() const;
+
+  int lazy_result_;
+  bool lazy_is_word_;
+  word lazy_flags_;
+
+  static const word kFlagsZSP = F_ZF | F_SF | F_PF;
+  static const word kFlagsArith = kFlagsZSP | F_CF;
+  static const word kFlagsLogic = kFlagsArith | F_OF;
 
   // Parity flag lookup table.
   static const bool byte_parity_[256];
 };
 
+
+inline byte X86::fetch() {
+  byte val = mem_->read(getCS_IP());
+  regs_.ip++;
+  bytes_fetched_++;
+
+  if (debug_level_ >= 2) {
+    logFetch(val);
+  }
+  return val;
+}
+
+
+inline int X86::getCS_IP() const {
+  return getLinearAddress(regs_.cs, regs_.ip);
+}
+
+
+inline int X86::getSS_SP() const {
+  return getLinearAddress(regs_.ss, regs_.sp);
+}
+
+
+inline int X86::getLinearAddress(word segment, word offset) const {
+  return (segment << 4) + offset;
+}
+
+
+inline word* X86::getReg16Ptr(int reg) {
+  ASSERT(reg >= 0);
+  ASSERT(reg <= R16_COUNT);
+  return &regs_.regs16[reg];
+}
+
+
+inline byte* X86::getReg8Ptr(int reg) {
+  ASSERT(reg >= 0);
+  ASSERT(reg <= R8_COUNT);
+  return &regs_.regs8[reg];
+}
+
+
+inline word* X86::getMem16Ptr(word segment, word offset) {
+  return (word*)mem_->getPointer(getLinearAddress(segment, offset));
+}
+
+
+inline byte* X86::getMem8Ptr(word segment, word offset) {
+  return mem_->getPointer(getLinearAddress(segment, offset));
+}
+
+
+inline const word* X86::getMem16ReadPtr(word segment, word offset) {
+  return (const word*)mem_->getReadPointer(getLinearAddress(segment, offset));
+}
+
+
+inline void X86::addCycles(int cycles) {
+  cycle_count_ += cycles;
+}
+
+
+inline long long X86::getNextEventCycle() const {
+  return events_.getNextCycle();
+}
+
+
+inline void X86::addEntryPoint() {
+  if (tracking_mode_ != TRACK_OFF) {
+    entry_points_.add(getCS_IP());
+  }
+}
+
+
+inline bool X86::getFlag(word mask) const {
+  if ((lazy_flags_ & mask) == 0) {
+    return (regs_.flags & mask) == mask;
+  }
+  return (getFlags() & mask) == mask;
+}
+
 #endif  // __X86_H__
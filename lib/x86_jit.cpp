@@ -0,0 +1,938 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#include "x86_jit.h"
+#include "memory.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define X86_JIT_NATIVE 1
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+//
+// Minimal x86-64 assembler. Code is assembled into a temporary buffer and
+// then linked at its final address.
+//
+// Translated code keeps a pointer to the guest Registers in RBX and a pointer
+// to the Context in R12; RAX and RCX are scratch.
+//
+class X86JIT::Assembler {
+ public:
+  typedef int Label;
+
+  Label newLabel() {
+    labels_.push_back(-1);
+    return labels_.size() - 1;
+  }
+
+  void bind(Label label) {
+    labels_[label] = code_.size();
+  }
+
+  int getSize() const {
+    return code_.size();
+  }
+
+  int getOffset(Label label) const {
+    return labels_[label];
+  }
+
+  void emit8(int val) {
+    code_.push_back(val & 0xFF);
+  }
+
+  void emit16(int val) {
+    emit8(val);
+    emit8(val >> 8);
+  }
+
+  void emit32(int val) {
+    emit16(val);
+    emit16(val >> 16);
+  }
+
+  void emit64(uint64_t val) {
+    emit32((int)val);
+    emit32((int)(val >> 32));
+  }
+
+  void emitRel32(Label label) {
+    rel_fixups_.push_back(make_pair((int)code_.size(), label));
+    emit32(0);
+  }
+
+  void emitAbs64(Label label) {
+    abs_fixups_.push_back(make_pair((int)code_.size(), label));
+    emit64(0);
+  }
+
+  void align(int alignment) {
+    while (code_.size() % alignment) {
+      emit8(0xCC);  // INT3
+    }
+  }
+
+  // Copies the code to its final address, resolving labels.
+  void link(byte* dest) {
+    memcpy(dest, code_.data(), code_.size());
+    for (const auto& fixup : rel_fixups_) {
+      int32_t rel = labels_[fixup.second] - (fixup.first + 4);
+      memcpy(dest + fixup.first, &rel, 4);
+    }
+    for (const auto& fixup : abs_fixups_) {
+      uint64_t abs = (uint64_t)(dest + labels_[fixup.second]);
+      memcpy(dest + fixup.first, &abs, 8);
+    }
+  }
+
+  //
+  // Instructions. "reg" operands are [RBX + offset], "ctx" operands are
+  // [R12 + offset].
+  //
+
+  // JMP rel32.
+  void jmp(Label label) {
+    emit8(0xE9);
+    emitRel32(label);
+  }
+
+  // Jcc rel32.
+  void jcc(int cc, Label label) {
+    emit8(0x0F);
+    emit8(0x80 | cc);
+    emitRel32(label);
+  }
+
+  // JMP [RIP + slot].
+  void jmpIndirect(Label slot) {
+    emit8(0xFF);
+    emit8(0x25);
+    emitRel32(slot);
+  }
+
+  // MOV RAX/RSI, imm64.
+  void movRAX(const void* val) {
+    emit8(0x48);
+    emit8(0xB8);
+    emit64((uint64_t)val);
+  }
+
+  void movRSI(const void* val) {
+    emit8(0x48);
+    emit8(0xBE);
+    emit64((uint64_t)val);
+  }
+
+  // CL/CX = reg.
+  void loadCL(int offset) {
+    emitRBX(0x8A, 1, offset);
+  }
+
+  void loadCX(int offset) {
+    emit8(0x66);
+    emitRBX(0x8B, 1, offset);
+  }
+
+  // ECX = zero-extended byte reg.
+  void loadCXFromByte(int offset) {
+    emit8(0x0F);
+    emitRBX(0xB6, 1, offset);
+  }
+
+  // CL/CX = imm.
+  void movCL(byte val) {
+    emit8(0xB1);
+    emit8(val);
+  }
+
+  void movCX(word val) {
+    emit8(0x66);
+    emit8(0xB9);
+    emit16(val);
+  }
+
+  // <op> reg, CL/CX, where op is the 8-bit form of an ALU opcode taking
+  // r/m, r operands.
+  void aluCL(int op, int offset) {
+    emitRBX(op, 1, offset);
+  }
+
+  void aluCX(int op, int offset) {
+    emit8(0x66);
+    emitRBX(op + 1, 1, offset);
+  }
+
+  // MOV word reg, imm16.
+  void movRegImm16(int offset, word val) {
+    emit8(0x66);
+    emitRBX(0xC7, 0, offset);
+    emit16(val);
+  }
+
+  // INC/DEC (ext 0/1) byte or word reg.
+  void incDec8(int ext, int offset) {
+    emitRBX(0xFE, ext, offset);
+  }
+
+  void incDec16(int ext, int offset) {
+    emit8(0x66);
+    emitRBX(0xFF, ext, offset);
+  }
+
+  // TEST word reg, imm16.
+  void testRegImm16(int offset, word val) {
+    emit8(0x66);
+    emitRBX(0xF7, 0, offset);
+    emit16(val);
+  }
+
+  // Replaces the guest flags in mask with the host flags.
+  void mergeFlags(int flags_offset, word mask) {
+    emit8(0x9C);              // PUSHFQ
+    emit8(0x58);              // POP RAX
+    emit8(0x25);              // AND EAX, mask
+    emit32(mask);
+    emit8(0x0F);              // MOVZX ECX, word flags
+    emitRBX(0xB7, 1, flags_offset);
+    emit8(0x81);              // AND ECX, ~mask
+    emit8(0xE1);
+    emit32(~mask);
+    emit8(0x09);              // OR ECX, EAX
+    emit8(0xC1);
+    emit8(0x66);              // MOV word flags, CX
+    emitRBX(0x89, 1, flags_offset);
+  }
+
+  // CMP/SUB qword ctx, imm8.
+  void cmpCtxImm8(int offset, int val) {
+    emitR12(0x83, 7, offset);
+    emit8(val);
+  }
+
+  void subCtxImm8(int offset, int val) {
+    emitR12(0x83, 5, offset);
+    emit8(val);
+  }
+
+  // ADD qword ctx, imm32.
+  void addCtxImm32(int offset, int val) {
+    emitR12(0x81, 0, offset);
+    emit32(val);
+  }
+
+  // MOV qword ctx, RAX.
+  void storeCtxRAX(int offset) {
+    emitR12(0x89, 0, offset);
+  }
+
+  // MOV qword ctx, 0.
+  void clearCtx(int offset) {
+    emitR12(0xC7, 0, offset);
+    emit32(0);
+  }
+
+  void prologue(int regs_offset) {
+    emit8(0x53);                            // PUSH RBX
+    emit8(0x41); emit8(0x54);               // PUSH R12
+    emit8(0x48); emit8(0x83); emit8(0xEC);  // SUB RSP, 8
+    emit8(0x08);
+    emit8(0x49); emit8(0x89); emit8(0xFC);  // MOV R12, RDI
+    emitR12(0x8B, 3, regs_offset);          // MOV RBX, ctx
+  }
+
+  void epilogue() {
+    emit8(0x48); emit8(0x83); emit8(0xC4);  // ADD RSP, 8
+    emit8(0x08);
+    emit8(0x41); emit8(0x5C);               // POP R12
+    emit8(0x5B);                            // POP RBX
+    emit8(0xC3);                            // RET
+  }
+
+  // Calls fn(ctx, arg) and tests the result.
+  void callWithContext(const void* fn, const void* arg) {
+    emit8(0x4C); emit8(0x89); emit8(0xE7);  // MOV RDI, R12
+    movRSI(arg);
+    movRAX(fn);
+    emit8(0xFF); emit8(0xD0);               // CALL RAX
+    emit8(0x85); emit8(0xC0);               // TEST EAX, EAX
+  }
+
+  // CMP dword [RAX], imm32.
+  void cmpAtRAX(int val) {
+    emit8(0x81);
+    emit8(0x38);
+    emit32(val);
+  }
+
+ private:
+  // <opcode> with a [RBX + disp8] operand.
+  void emitRBX(int opcode, int reg, int offset) {
+    emit8(opcode);
+    emit8(0x43 | (reg << 3));
+    emit8(offset);
+  }
+
+  // REX.W <opcode> with a [R12 + disp8] operand.
+  void emitR12(int opcode, int reg, int offset) {
+    emit8(0x49);
+    emit8(opcode);
+    emit8(0x44 | (reg << 3));
+    emit8(0x24);
+    emit8(offset);
+  }
+
+  vector<byte> code_;
+  vector<int> labels_;
+  vector<pair<int, Label>> rel_fixups_;
+  vector<pair<int, Label>> abs_fixups_;
+};
+
+
+// Condition codes.
+static const int kCondZ = 0x4;
+static const int kCondNZ = 0x5;
+static const int kCondL = 0xC;
+static const int kCondGE = 0xD;
+
+// ALU opcodes, r/m8, r8 form.
+static const int kOpADD = 0x00;
+static const int kOpOR = 0x08;
+static const int kOpAND = 0x20;
+static const int kOpSUB = 0x28;
+static const int kOpXOR = 0x30;
+static const int kOpCMP = 0x38;
+static const int kOpTEST = 0x84;
+static const int kOpMOV = 0x88;
+
+// Flags each kind of instruction sets, matching the X86 implementation.
+static const word kFlagsArith = X86Base::F_CF | X86Base::F_ZF |
+                                X86Base::F_SF | X86Base::F_PF;
+static const word kFlagsLogic = kFlagsArith | X86Base::F_OF;
+static const word kFlagsIncDec = X86Base::F_ZF | X86Base::F_SF |
+                                 X86Base::F_PF;
+
+
+static bool isControlTransfer(const X86Base::DecodedInstruction& decoded) {
+  switch (decoded.operation) {
+    case X86Base::OP_CALL_p: case X86Base::OP_CALL_w:
+    case X86Base::OP_INT: case X86Base::OP_INTO: case X86Base::OP_IRET:
+    case X86Base::OP_JA: case X86Base::OP_JB: case X86Base::OP_JBE:
+    case X86Base::OP_JCXZ: case X86Base::OP_JG: case X86Base::OP_JGE:
+    case X86Base::OP_JL: case X86Base::OP_JLE: case X86Base::OP_JMP_b:
+    case X86Base::OP_JMP_p: case X86Base::OP_JMP_w: case X86Base::OP_JNB:
+    case X86Base::OP_JNO: case X86Base::OP_JNS: case X86Base::OP_JNZ:
+    case X86Base::OP_JO: case X86Base::OP_JPE: case X86Base::OP_JPO:
+    case X86Base::OP_JS: case X86Base::OP_JZ:
+    case X86Base::OP_LOOP: case X86Base::OP_LOOPNZ: case X86Base::OP_LOOPZ:
+    case X86Base::OP_RET: case X86Base::OP_RETF: case X86Base::OP_RETF_w:
+    case X86Base::OP_RET_w:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+X86JIT::X86JIT(X86* x86)
+  : x86_(x86), regs_(x86->getRegisters()), code_(nullptr), code_used_(0),
+    block_table_(kBlockTableSize, nullptr),
+    stop_addresses_(x86->getStopAddresses()),
+    stop_addresses_generation_(stop_addresses_->getGeneration()),
+    translated_stop_addresses_(*stop_addresses_),
+    tracking_mode_(x86->getTrackingMode()) {
+  ctx_.regs = regs_;
+  ctx_.budget = 0;
+  ctx_.cycles = 0;
+  ctx_.cycle_bias = 0;
+  ctx_.exit = nullptr;
+  ctx_.jit = this;
+
+  stats_.blocks_translated = 0;
+  stats_.blocks_invalidated = 0;
+  stats_.flushes = 0;
+
+#ifdef X86_JIT_NATIVE
+  int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_JIT
+  flags |= MAP_JIT;
+#endif
+  void* code = mmap(nullptr, kCodeSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    flags, -1, 0);
+  if (code != MAP_FAILED) {
+    code_ = (byte*)code;
+  }
+#endif
+}
+
+
+X86JIT::~X86JIT() {
+#ifdef X86_JIT_NATIVE
+  if (code_) {
+    munmap(code_, kCodeSize);
+  }
+#endif
+}
+
+
+bool X86JIT::isSupported() {
+#ifdef X86_JIT_NATIVE
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+int X86JIT::run(int instructions) {
+  if (stop_addresses_->getGeneration() != stop_addresses_generation_) {
+    for (int address :
+         stop_addresses_->getAddressesNotIn(translated_stop_addresses_)) {
+      x86_->invalidateCodePage(address);
+    }
+    stop_addresses_generation_ = stop_addresses_->getGeneration();
+    translated_stop_addresses_ = *stop_addresses_;
+  }
+  if (x86_->getTrackingMode() != tracking_mode_) {
+    tracking_mode_ = x86_->getTrackingMode();
+    flush();
+  }
+
+  ctx_.budget = instructions;
+
+  // Finish an instruction decoded by someone else first.
+  if (x86_->isExecutePending() && ctx_.budget > 0) {
+    x86_->execute();
+    ctx_.budget--;
+  }
+
+  bool first = (ctx_.budget == instructions);
+  while (ctx_.budget > 0) {
+    if (x86_->getCycleCount() >= x86_->getNextEventCycle()) {
+      x86_->serviceEvents();
+    }
+
+    int address = x86_->getCS_IP();
+    if (!first && isStopAddress(address)) {
+      break;
+    }
+    first = false;
+
+    Block* block = nullptr;
+    if (code_) {
+      block = getBlock(regs_->cs, regs_->ip);
+    }
+    if (block == nullptr || block->instruction_count > ctx_.budget) {
+      x86_->step();
+      ctx_.budget--;
+      continue;
+    }
+
+    // Translated code works on regs_.flags directly.
+    x86_->materializeFlags();
+
+    ctx_.exit = nullptr;
+    startCycles();
+    block->entry(&ctx_);
+    flushCycles();
+
+    if (pending_exception_) {
+      exception_ptr e = pending_exception_;
+      pending_exception_ = nullptr;
+      rethrow_exception(e);
+    }
+
+    if (ctx_.exit) {
+      chain((const Exit*)ctx_.exit);
+    }
+  }
+
+  return instructions - ctx_.budget;
+}
+
+
+void X86JIT::flush() {
+  blocks_.clear();
+  for (Block*& block : block_table_) {
+    block = nullptr;
+  }
+  code_used_ = 0;
+  stats_.flushes++;
+}
+
+
+const X86JIT::Stats& X86JIT::getStats() const {
+  return stats_;
+}
+
+
+void X86JIT::startCycles() {
+  long long bias = x86_->getNextEventCycle() - x86_->getCycleCount();
+  if (bias > kMaxCycleBias) {
+    bias = kMaxCycleBias;
+  }
+  ctx_.cycle_bias = bias;
+  ctx_.cycles = -bias;
+}
+
+
+void X86JIT::flushCycles() {
+  // Translated instructions count their cycles in the context.
+  x86_->addCycles(ctx_.cycles + ctx_.cycle_bias);
+  ctx_.cycles = 0;
+  ctx_.cycle_bias = 0;
+}
+
+
+bool X86JIT::isStopAddress(int address) const {
+  return stop_addresses_->contains(address);
+}
+
+
+int X86JIT::getRegisterOffset(const void* arg) const {
+  ptrdiff_t offset = (const byte*)arg - (const byte*)regs_;
+  if (offset < 0 || offset >= (ptrdiff_t)sizeof(Registers)) {
+    return -1;
+  }
+  return offset;
+}
+
+
+X86JIT::Block* X86JIT::getBlock(word cs, word ip) {
+  int address = x86_->getLinearAddress(cs, ip);
+  Block* block = block_table_[address & (kBlockTableSize - 1)];
+  if (block && block->cs == cs && block->ip == ip) {
+    if (*block->generation_ptr == block->generation) {
+      return block;
+    }
+    stats_.blocks_invalidated++;
+  }
+  return translate(cs, ip);
+}
+
+
+void X86JIT::chain(const Exit* exit) {
+  if (exit->is_jump && tracking_mode_ != X86::TRACK_OFF) {
+    // A chained jump wouldn't come back here to record its entry point.
+    x86_->addEntryPoint();
+    return;
+  }
+
+  if (isStopAddress(x86_->getCS_IP())) {
+    return;
+  }
+
+  // Translating the target may flush the code buffer, exit included.
+  long long flushes = stats_.flushes;
+  Block* target = getBlock(regs_->cs, regs_->ip);
+  if (target && stats_.flushes == flushes) {
+    *exit->slot = target->chain_entry;
+  }
+}
+
+
+X86JIT::Block* X86JIT::translate(word cs, word ip) {
+  struct Instruction {
+    X86Base::DecodedInstruction decoded;
+    word ip;
+    word next_ip;
+    bool crosses_page;
+  };
+
+  int start_address = x86_->getLinearAddress(cs, ip);
+  int page = start_address >> Memory::kPageBits;
+
+  // Leave anything too close to the end of memory to the interpreter.
+  if (start_address + Memory::kPageSize > x86_->getMemory()->getSize()) {
+    return nullptr;
+  }
+
+  // Decode the block.
+  vector<Instruction> instructions;
+  word next_ip = ip;
+  while ((int)instructions.size() < kMaxBlockInstructions) {
+    int address = x86_->getLinearAddress(cs, next_ip);
+    if (!instructions.empty() &&
+        (isStopAddress(address) || (address >> Memory::kPageBits) != page)) {
+      break;
+    }
+
+    Instruction instruction;
+    int length;
+    try {
+      length = x86_->decodeAt(cs, next_ip, &instruction.decoded);
+    } catch (const runtime_error& e) {
+      break;
+    }
+
+    instruction.ip = next_ip;
+    instruction.next_ip = next_ip + length;
+    instruction.crosses_page =
+        ((address + length - 1) >> Memory::kPageBits) != page ||
+        next_ip + length > 0xFFFF;
+    if (instruction.crosses_page && !instructions.empty()) {
+      break;
+    }
+
+    instructions.push_back(instruction);
+    next_ip = instruction.next_ip;
+    if (instruction.crosses_page || isControlTransfer(instruction.decoded)) {
+      break;
+    }
+  }
+
+  if (instructions.empty()) {
+    return nullptr;
+  }
+
+  if (code_used_ + kMaxBlockSize > kCodeSize) {
+    flush();
+  }
+
+  Block* block = new Block();
+  blocks_.push_back(unique_ptr<Block>(block));
+
+  block->cs = cs;
+  block->ip = ip;
+  block->address = start_address;
+  block->instruction_count = instructions.size();
+  block->generation_ptr = x86_->watchCodePage(cs, ip);
+  block->generation = *block->generation_ptr;
+  block->exit_count = 0;
+  block->fallbacks.reserve(instructions.size());
+
+  // Translate it.
+  Assembler as;
+  Assembler::Label chain_entry = as.newLabel();
+  Assembler::Label exit_dynamic = as.newLabel();
+  Assembler::Label epilogue = as.newLabel();
+  Assembler::Label exit_stubs[2] = { as.newLabel(), as.newLabel() };
+  Assembler::Label exit_slots[2] = { as.newLabel(), as.newLabel() };
+
+  as.prologue(offsetof(Context, regs));
+
+  // Chained blocks jump here. Check the code is still valid, there's enough
+  // budget left and no device event is due.
+  as.bind(chain_entry);
+  as.movRAX(block->generation_ptr);
+  as.cmpAtRAX(block->generation);
+  as.jcc(kCondNZ, exit_dynamic);
+  as.cmpCtxImm8(offsetof(Context, budget), block->instruction_count);
+  as.jcc(kCondL, exit_dynamic);
+  as.cmpCtxImm8(offsetof(Context, cycles), 0);
+  as.jcc(kCondGE, exit_dynamic);
+  as.subCtxImm8(offsetof(Context, budget), block->instruction_count);
+
+  // Cycles of the translated instructions are added to the context before
+  // anything that may leave the block.
+  int ip_offset = getRegisterOffset(&regs_->ip);
+  int pending_cycles = 0;
+  bool ended = false;
+  for (size_t i = 0; i < instructions.size(); i++) {
+    const Instruction& instruction = instructions[i];
+    int remaining = instructions.size() - i - 1;
+
+    if (!instruction.crosses_page &&
+        translateInstruction(&as, block, instruction.decoded,
+                             instruction.next_ip, exit_slots,
+                             &pending_cycles)) {
+      ended = isControlTransfer(instruction.decoded);
+      continue;
+    }
+
+    if (pending_cycles != 0) {
+      as.addCtxImm32(offsetof(Context, cycles), pending_cycles);
+      pending_cycles = 0;
+    }
+
+    Fallback fallback;
+    fallback.block = block;
+    fallback.next_ip = instruction.next_ip;
+    fallback.remaining = remaining;
+    block->fallbacks.push_back(fallback);
+
+    as.movRegImm16(ip_offset, instruction.ip);
+    as.callWithContext((const void*)&X86JIT::executeFallback,
+                       &block->fallbacks.back());
+    as.jcc(kCondZ, exit_dynamic);
+  }
+
+  // Fall through to the next block.
+  if (!ended) {
+    if (pending_cycles != 0) {
+      as.addCtxImm32(offsetof(Context, cycles), pending_cycles);
+    }
+    emitExit(&as, block, exit_slots, next_ip, false);
+  }
+
+  as.bind(exit_dynamic);
+  as.clearCtx(offsetof(Context, exit));
+  as.bind(epilogue);
+  as.epilogue();
+
+  for (int i = 0; i < block->exit_count; i++) {
+    as.bind(exit_stubs[i]);
+    as.movRAX(&block->exits[i]);
+    as.storeCtxRAX(offsetof(Context, exit));
+    as.jmp(epilogue);
+  }
+
+  // Chaining slots, initially pointing to the exit stubs.
+  as.align(8);
+  for (int i = 0; i < block->exit_count; i++) {
+    as.bind(exit_slots[i]);
+    as.emitAbs64(exit_stubs[i]);
+  }
+
+  ASSERT(as.getSize() <= kMaxBlockSize);
+
+  byte* code = code_ + code_used_;
+  as.link(code);
+  code_used_ = (code_used_ + as.getSize() + 15) & ~15;
+
+  block->entry = (void (*)(Context*))code;
+  block->chain_entry = code + as.getOffset(chain_entry);
+  for (int i = 0; i < block->exit_count; i++) {
+    block->exits[i].slot = (void**)(code + as.getOffset(exit_slots[i]));
+  }
+
+  block_table_[start_address & (kBlockTableSize - 1)] = block;
+  stats_.blocks_translated++;
+  return block;
+}
+
+
+bool X86JIT::translateInstruction(Assembler* as, Block* block,
+                                  const X86Base::DecodedInstruction& decoded,
+                                  word next_ip, const int* exit_slots,
+                                  int* pending_cycles) {
+  if (decoded.rep_opcode != 0) {
+    return false;
+  }
+
+  int flags_offset = getRegisterOffset(&regs_->flags);
+  int ip_offset = getRegisterOffset(&regs_->ip);
+
+  // Branches to immediate targets. Each path exits through a chainable slot.
+  int cond = -1;
+  word cond_mask = 0;
+  switch (decoded.operation) {
+    case X86Base::OP_JZ:
+    case X86Base::OP_JNZ:
+    case X86Base::OP_JB:
+    case X86Base::OP_JNB:
+    case X86Base::OP_JMP_b:
+    case X86Base::OP_JMP_w:
+    case X86Base::OP_LOOP: {
+      if (!x86_->isImmediateArg(decoded.warg1)) {
+        return false;
+      }
+
+      bool is_jump = true;
+      switch (decoded.operation) {
+        case X86Base::OP_JZ:  cond = kCondNZ; cond_mask = X86Base::F_ZF; break;
+        case X86Base::OP_JNZ: cond = kCondZ;  cond_mask = X86Base::F_ZF; break;
+        case X86Base::OP_JB:  cond = kCondNZ; cond_mask = X86Base::F_CF; break;
+        case X86Base::OP_JNB: cond = kCondZ;  cond_mask = X86Base::F_CF; break;
+        case X86Base::OP_LOOP:
+          cond = kCondNZ;
+          is_jump = false;
+          break;
+      }
+
+      int cycles = *pending_cycles + decoded.cycles;
+      *pending_cycles = 0;
+
+      Assembler::Label taken = as->newLabel();
+      if (cond != -1) {
+        if (decoded.operation == X86Base::OP_LOOP) {
+          as->incDec16(1, getRegisterOffset(&regs_->cx));
+        } else {
+          as->testRegImm16(flags_offset, cond_mask);
+        }
+        as->jcc(cond, taken);
+        as->addCtxImm32(offsetof(Context, cycles), cycles);
+        emitExit(as, block, exit_slots, next_ip, false);
+      }
+      as->bind(taken);
+      as->addCtxImm32(offsetof(Context, cycles),
+                      cycles + decoded.branch_cycles);
+      emitExit(as, block, exit_slots, decoded.immediate_w, is_jump);
+      return true;
+    }
+  }
+
+  // Data movement and arithmetic on registers.
+  bool is_word;
+  const void* arg1;
+  const void* arg2;
+  switch (decoded.operation) {
+    case X86Base::OP_INC_w:
+    case X86Base::OP_DEC_w:
+    case X86Base::OP_MOV_w:
+    case X86Base::OP_ADD_w:
+    case X86Base::OP_SUB_w:
+    case X86Base::OP_CMP_w:
+    case X86Base::OP_OR_w:
+      is_word = true;
+      arg1 = decoded.warg1;
+      arg2 = decoded.warg2;
+      break;
+    case X86Base::OP_ADD_wb:
+      is_word = true;
+      arg1 = decoded.warg1;
+      arg2 = decoded.barg2;
+      break;
+    case X86Base::OP_INC_b:
+    case X86Base::OP_DEC_b:
+    case X86Base::OP_MOV_b:
+    case X86Base::OP_ADD_b:
+    case X86Base::OP_SUB_b:
+    case X86Base::OP_CMP_b:
+    case X86Base::OP_OR_b:
+    case X86Base::OP_AND_b:
+    case X86Base::OP_XOR_b:
+    case X86Base::OP_TEST_b:
+      is_word = false;
+      arg1 = decoded.barg1;
+      arg2 = decoded.barg2;
+      break;
+    default:
+      return false;
+  }
+
+  int dest = getRegisterOffset(arg1);
+  if (dest == -1 || dest == ip_offset ||
+      dest == getRegisterOffset(&regs_->cs)) {
+    return false;
+  }
+
+  // Single operand instructions.
+  switch (decoded.operation) {
+    case X86Base::OP_INC_b:
+    case X86Base::OP_DEC_b:
+      as->incDec8(decoded.operation == X86Base::OP_DEC_b, dest);
+      as->mergeFlags(flags_offset, kFlagsIncDec);
+      *pending_cycles += decoded.cycles;
+      return true;
+    case X86Base::OP_INC_w:
+    case X86Base::OP_DEC_w:
+      as->incDec16(decoded.operation == X86Base::OP_DEC_w, dest);
+      as->mergeFlags(flags_offset, kFlagsIncDec);
+      *pending_cycles += decoded.cycles;
+      return true;
+  }
+
+  // Load the source into CL/CX.
+  int src = getRegisterOffset(arg2);
+  if (decoded.operation == X86Base::OP_ADD_wb) {
+    // X86::ADD_wb zero-extends the byte operand.
+    if (src != -1) {
+      as->loadCXFromByte(src);
+    } else if (x86_->isImmediateArg(arg2)) {
+      as->movCX(decoded.immediate_b);
+    } else {
+      return false;
+    }
+  } else if (src != -1) {
+    if (is_word) {
+      as->loadCX(src);
+    } else {
+      as->loadCL(src);
+    }
+  } else if (x86_->isImmediateArg(arg2)) {
+    if (is_word) {
+      as->movCX(decoded.immediate_w);
+    } else {
+      as->movCL(decoded.immediate_b);
+    }
+  } else {
+    return false;
+  }
+
+  int op;
+  word flags;
+  switch (decoded.operation) {
+    case X86Base::OP_MOV_b: case X86Base::OP_MOV_w:
+      op = kOpMOV; flags = 0; break;
+    case X86Base::OP_ADD_b: case X86Base::OP_ADD_w: case X86Base::OP_ADD_wb:
+      op = kOpADD; flags = kFlagsArith; break;
+    case X86Base::OP_SUB_b: case X86Base::OP_SUB_w:
+      op = kOpSUB; flags = kFlagsArith; break;
+    case X86Base::OP_CMP_b: case X86Base::OP_CMP_w:
+      op = kOpCMP; flags = kFlagsArith; break;
+    case X86Base::OP_OR_b: case X86Base::OP_OR_w:
+      op = kOpOR; flags = kFlagsLogic; break;
+    case X86Base::OP_AND_b:
+      op = kOpAND; flags = kFlagsLogic; break;
+    case X86Base::OP_XOR_b:
+      op = kOpXOR; flags = kFlagsLogic; break;
+    case X86Base::OP_TEST_b:
+      op = kOpTEST; flags = kFlagsLogic; break;
+    default:
+      return false;
+  }
+
+  if (is_word) {
+    as->aluCX(op, dest);
+  } else {
+    as->aluCL(op, dest);
+  }
+  if (flags) {
+    as->mergeFlags(flags_offset, flags);
+  }
+  *pending_cycles += decoded.cycles;
+  return true;
+}
+
+
+void X86JIT::emitExit(Assembler* as, Block* block, const int* exit_slots,
+                      word target_ip, bool is_jump) {
+  ASSERT(block->exit_count < 2);
+  Exit& exit = block->exits[block->exit_count];
+  exit.block = block;
+  exit.slot = nullptr;
+  exit.is_jump = is_jump;
+
+  as->movRegImm16(getRegisterOffset(&regs_->ip), target_ip);
+  as->jmpIndirect(exit_slots[block->exit_count]);
+  block->exit_count++;
+}
+
+
+int X86JIT::executeFallback(Context* ctx, const Fallback* fallback) {
+  X86JIT* jit = ctx->jit;
+  const Block* block = fallback->block;
+
+  // Devices may look at the cycle count.
+  jit->flushCycles();
+  try {
+    jit->x86_->fetchAndDecode();
+    jit->x86_->execute();
+    jit->x86_->materializeFlags();
+  } catch (...) {
+    jit->pending_exception_ = current_exception();
+    ctx->budget += fallback->remaining;
+    jit->startCycles();
+    return 0;
+  }
+  jit->startCycles();
+
+  if (ctx->regs->ip != fallback->next_ip || ctx->regs->cs != block->cs ||
+      *block->generation_ptr != block->generation) {
+    ctx->budget += fallback->remaining;
+    return 0;
+  }
+  return 1;
+}
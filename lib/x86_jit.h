@@ -0,0 +1,161 @@
+// Emulator-Backed Remakes proof of concept.
+// See http://gabrielgambetta.com/remakes.html for background.
+//
+// (C) 2014 Gabriel Gambetta (gabriel.gambetta@gmail.com)
+//
+// Licensed under the Whatever/Credit License: you may do whatever you want with
+// the code; if you make something cool, credit is appreciated.
+//
+#ifndef __X86_JIT_H__
+#define __X86_JIT_H__
+
+#include "x86.h"
+
+#include <exception>
+#include <memory>
+#include <vector>
+
+//
+// Execution engine that translates basic blocks of guest code to native
+// x86-64 code. Register and immediate forms of the common data movement,
+// arithmetic and branch instructions are translated; everything else is
+// executed by calling back into the X86 interpreter, which remains the
+// reference implementation.
+//
+// Blocks end at control transfers, at stop addresses and at page boundaries,
+// so adding a stop address retranslates the blocks of its page.
+// Direct branches between blocks are chained, so hot loops run without
+// returning to the dispatcher, unless X86 tracking needs to see them. Chained
+// code also returns once the next X86 device event is due. Blocks are
+// invalidated when their code page is written to.
+//
+class X86JIT {
+ public:
+  struct Stats {
+    long long blocks_translated;
+    long long blocks_invalidated;
+    long long flushes;
+  };
+
+  X86JIT(X86* x86);
+  ~X86JIT();
+
+  // Whether native translation is available on this host. If it isn't,
+  // run() uses the interpreter.
+  static bool isSupported();
+
+  // Runs up to the given number of instructions, stopping earlier if
+  // execution reaches one of the X86 stop addresses. The stop address
+  // execution starts at, if any, is ignored. Returns the number of
+  // instructions executed.
+  int run(int instructions);
+
+  // Discards all translated code.
+  void flush();
+
+  const Stats& getStats() const;
+
+ private:
+  struct Block;
+
+  // State shared between the dispatcher and the translated code. cycles
+  // counts up from -cycle_bias, reaching 0 when the next device event is due.
+  struct Context {
+    Registers* regs;
+    long long budget;
+    long long cycles;
+    long long cycle_bias;
+    const void* exit;
+    X86JIT* jit;
+  };
+
+  // An exit from a block to a static target, which can be chained.
+  struct Exit {
+    Block* block;
+    void** slot;
+    bool is_jump;
+  };
+
+  // An instruction executed by the interpreter.
+  struct Fallback {
+    Block* block;
+    word next_ip;
+    int remaining;
+  };
+
+  struct Block {
+    word cs, ip;
+    int address;
+    int instruction_count;
+
+    const int* generation_ptr;
+    int generation;
+
+    void (*entry)(Context* ctx);
+    void* chain_entry;
+
+    Exit exits[2];
+    int exit_count;
+    std::vector<Fallback> fallbacks;
+  };
+
+  class Assembler;
+
+  static const int kCodeSize = 4 << 20;
+  static const int kMaxBlockInstructions = 64;
+  static const int kMaxBlockSize = 128 * kMaxBlockInstructions;
+  static const int kBlockTableBits = 14;
+  static const int kBlockTableSize = 1 << kBlockTableBits;
+  static const int kMaxCycleBias = 1 << 30;
+
+  Block* getBlock(word cs, word ip);
+  Block* translate(word cs, word ip);
+  bool translateInstruction(Assembler* as, Block* block,
+                            const X86Base::DecodedInstruction& decoded,
+                            word next_ip, const int* exit_slots,
+                            int* pending_cycles);
+  void emitExit(Assembler* as, Block* block, const int* exit_slots,
+                word target_ip, bool is_jump);
+  void chain(const Exit* exit);
+
+  // Start counting translated cycles, and add them to the X86.
+  void startCycles();
+  void flushCycles();
+
+  int getRegisterOffset(const void* arg) const;
+  bool isStopAddress(int address) const;
+
+  // Called from translated code to execute an instruction with the
+  // interpreter. Returns whether the block can continue.
+  static int executeFallback(Context* ctx, const Fallback* fallback);
+
+  X86* x86_;
+  Registers* regs_;
+
+  Context ctx_;
+
+  // Executable code buffer, allocated linearly and flushed when full.
+  byte* code_;
+  int code_used_;
+
+  std::vector<std::unique_ptr<Block>> blocks_;
+  std::vector<Block*> block_table_;
+
+  // The stop addresses as they were when the blocks were translated. Only
+  // those added since need blocks translated again; removed ones just end
+  // blocks early.
+  const AddressBitmap* stop_addresses_;
+  int stop_addresses_generation_;
+  AddressBitmap translated_stop_addresses_;
+
+  // Taken jumps aren't chained while the X86 tracks entry points.
+  X86::TrackingMode tracking_mode_;
+
+  // Exception thrown by the interpreter while running translated code,
+  // rethrown once control is back in the dispatcher.
+  std::exception_ptr pending_exception_;
+
+  Stats stats_;
+};
+
+#endif  // __X86_JIT_H__
@@ -7,9 +7,20 @@
 // the code; if you make something cool, credit is appreciated.
 //
 #include "x86.h"
+#include "x86_jit.h"
 #include "memory.h"
-
+#include "keyboard.h"
+#include "machine_image.h"
+#include "pit.h"
+#include "replay.h"
+#include "rewind.h"
+#include "snapshot.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
 #include <memory>
+#include <sstream>
 
 #include "gtest/gtest.h"
 
@@ -57,6 +68,17 @@ TEST_F(X86Test, LinearAddress) {
   EXPECT_EQ(linear, (0x1234 << 4) + 0x4567);
 }
 
+TEST_F(X86Test, LinearAddressWrapsAround) {
+  mem_[0x10] = 0x42;
+  regs_->ds = 0xFFFF;
+  mem_[kOffset] = 0xA0;  // MOV AL, [0020h]
+  mem_[kOffset + 1] = 0x20;
+  mem_[kOffset + 2] = 0x00;
+  x86_->step();
+  EXPECT_EQ(0x42, regs_->al);
+}
+
+
 TEST_F(X86Test, PUSH_DS) {
   const int stack_top = kOffset + 100;
 
@@ -116,6 +138,70 @@ TEST_F(X86Test, FLAGS) {
 }
 
 
+TEST_F(X86Test, LazyFlags) {
+  const byte code[] = {
+    0x04, 0x01,  // ADD AL, 01h
+    0x43,        // INC BX
+    0x72, 0x01,  // JB 0106h
+    0x90,        // NOP
+    0x9C,        // PUSHF
+    0x04, 0x01,  // ADD AL, 01h
+    0x9D,        // POPF
+    0x04, 0x01,  // ADD AL, 01h
+    0x9E,        // SAHF
+    0x04, 0x01,  // ADD AL, 01h
+    0xCD, 0x21,  // INT 21h
+  };
+  copy(code, code + sizeof(code), mem_ + kOffset);
+  mem_[0x84] = 0x00;  // INT 21h -> 0000:0300h
+  mem_[0x85] = 0x03;
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  regs_->ss = 0;
+  regs_->sp = 0x1000;
+  regs_->al = 0xFF;
+  regs_->bx = 0;
+
+  // INC and DEC leave CF as the ADD computed it.
+  x86_->step();
+  x86_->step();
+  x86_->step();
+  EXPECT_EQ(kOffset + 6, regs_->ip);
+
+  // PUSHF pushes the computed flags.
+  x86_->step();
+  word flags = mem_[0xFFE] | mem_[0xFFF] << 8;
+  EXPECT_EQ(x86_->getFlags(), flags);
+  EXPECT_EQ(X86::F_CF, flags & (X86::F_CF | X86::F_ZF));
+
+  // POPF and SAHF replace the flags pending from the ADD before them.
+  mem_[0xFFE] = X86::F_ZF;
+  mem_[0xFFF] = 0;
+  regs_->al = 0xFF;
+  x86_->step();
+  x86_->step();
+  EXPECT_FALSE(x86_->getFlag(X86::F_CF));
+  EXPECT_TRUE(x86_->getFlag(X86::F_ZF));
+
+  regs_->al = 0xFF;
+  regs_->ah = X86::F_SF;
+  x86_->step();
+  x86_->step();
+  EXPECT_FALSE(x86_->getFlag(X86::F_CF));
+  EXPECT_FALSE(x86_->getFlag(X86::F_ZF));
+  EXPECT_TRUE(x86_->getFlag(X86::F_SF));
+
+  // So does an interrupt.
+  regs_->al = 0xFF;
+  x86_->step();
+  x86_->step();
+  EXPECT_EQ(0x300, regs_->ip);
+  flags = mem_[0xFFE] | mem_[0xFFF] << 8;
+  EXPECT_EQ(X86::F_CF | X86::F_ZF,
+            flags & (X86::F_CF | X86::F_ZF | X86::F_SF));
+}
+
+
 TEST_F(X86Test, PUSH_AX) {
   const int stack_top = kOffset + 100;
 
@@ -175,11 +261,19 @@ TEST_F(X86Test, XCHG) {
   int off = kOffset;
   mem_[off++] = 0x87;  // XCHG SI, BX
   mem_[off++] = 0xf3;
+  mem_[off++] = 0x86;  // XCHG AH, BL
+  mem_[off++] = 0xe3;
 
   x86_->step();
 
   EXPECT_EQ(0x1234, regs_->bx);
   EXPECT_EQ(0x5678, regs_->si);
+
+  regs_->ah = 0x9A;
+  x86_->step();
+
+  EXPECT_EQ(0x34, regs_->ah);
+  EXPECT_EQ(0x129A, regs_->bx);
 }
 
 
@@ -248,6 +342,38 @@ TEST_F(X86Test, REP_MOVSB) {
 }
 
 
+TEST_F(X86Test, REP_MOVSB_OVERLAP_WRAP) {
+  regs_->ds = 0x1000;
+  regs_->si = 0xFFFE;
+
+  regs_->es = 0x1000;
+  regs_->di = 0xFFFF;
+
+  regs_->cx = 4;
+
+  int off = kOffset;
+  mem_[off++] = 0xFC;  // CLD
+  mem_[off++] = 0xF3;  // REP
+  mem_[off++] = 0xA4;  // MOVSB
+
+  // Offsets wrap around within the segment, and each byte copied is the
+  // source of the next one.
+  mem_[x86_->getLinearAddress(regs_->ds, 0xFFFE)] = 0xAA;
+
+  x86_->step();
+  x86_->step();
+
+  EXPECT_EQ(0x0002, regs_->si);
+  EXPECT_EQ(0x0003, regs_->di);
+  EXPECT_EQ(0, regs_->cx);
+  EXPECT_EQ(0xAA, mem_[x86_->getLinearAddress(regs_->es, 0xFFFF)]);
+  EXPECT_EQ(0xAA, mem_[x86_->getLinearAddress(regs_->es, 0x0000)]);
+  EXPECT_EQ(0xAA, mem_[x86_->getLinearAddress(regs_->es, 0x0001)]);
+  EXPECT_EQ(0xAA, mem_[x86_->getLinearAddress(regs_->es, 0x0002)]);
+  EXPECT_EQ(0x00, mem_[x86_->getLinearAddress(regs_->es, 0x0003)]);
+}
+
+
 TEST_F(X86Test, CALL_RET) {
   int off = kOffset;
   mem_[off++] = 0xE8;  // CALL
@@ -378,3 +504,645 @@ TEST_F(X86Test, RCL) {
   EXPECT_TRUE(x86_->getFlag(X86::F_CF));
   EXPECT_EQ(0b00110101, regs_->dl);
 }
+
+
+TEST_F(X86Test, DescribeCurrentOperation) {
+  regs_->sp = 0x5678;
+  regs_->es = 0x0100;
+
+  int off = kOffset;
+  mem_[off++] = 0x26;  // MOV [ES:0x1122], SP
+  mem_[off++] = 0x89;
+  mem_[off++] = 0x26;
+  mem_[off++] = 0x22;
+  mem_[off++] = 0x11;
+
+  x86_->fetchAndDecode();
+  EXPECT_EQ(kOffset + 5, regs_->ip);
+
+  // Descriptions are built lazily, without disturbing the pending instruction.
+  stringstream ss;
+  x86_->outputCurrentOperation(ss);
+  EXPECT_NE(string::npos, ss.str().find("MOV [ES:1122h], SP"));
+  EXPECT_EQ(kOffset + 5, regs_->ip);
+  EXPECT_EQ(5, x86_->getBytesFetched());
+
+  x86_->execute();
+  EXPECT_EQ(0x78, mem_[0x2122]);
+  EXPECT_EQ(0x56, mem_[0x2123]);
+}
+
+
+TEST_F(X86Test, DecodeCache) {
+  regs_->ds = 0;
+  regs_->ax = 0;
+  regs_->bx = 0x1000;
+  mem_[0x1000] = 0x11;
+  mem_[0x1001] = 0x22;
+
+  int off = kOffset;
+  mem_[off++] = 0x40;  // INC AX
+  mem_[off++] = 0x02;  // ADD AL, [BX]
+  mem_[off++] = 0x07;
+
+  x86_->step();
+  x86_->step();
+  EXPECT_EQ(0x12, regs_->ax);
+  EXPECT_EQ(0, x86_->getDecodeCacheStats().hits);
+
+  // Run the same code again from the cache, with a different memory operand.
+  regs_->ip = kOffset;
+  regs_->bx = 0x1001;
+  x86_->step();
+  x86_->step();
+  EXPECT_EQ(0x35, regs_->ax);
+  EXPECT_EQ(2, x86_->getDecodeCacheStats().hits);
+
+  // Writing to the code invalidates it.
+  memory_->write(kOffset, 0x48);  // DEC AX
+  regs_->ip = kOffset;
+  x86_->step();
+  EXPECT_EQ(0x34, regs_->ax);
+  EXPECT_EQ(1, x86_->getDecodeCacheStats().invalidations);
+
+  // Reading data next to the code doesn't.
+  regs_->ip = kOffset;
+  regs_->bx = kOffset;
+  x86_->step();
+  x86_->step();
+  regs_->ip = kOffset;
+  x86_->step();
+  x86_->step();
+  EXPECT_EQ(0xC2, regs_->ax);
+  EXPECT_EQ(1, x86_->getDecodeCacheStats().invalidations);
+}
+
+
+TEST_F(X86Test, SelfModifyingCode) {
+  regs_->ds = 0;
+  regs_->ax = 0;
+  regs_->bx = kOffset;
+  regs_->cx = 0x48;
+
+  int off = kOffset;
+  mem_[off++] = 0x40;  // INC AX
+  mem_[off++] = 0x88;  // MOV [BX], CL
+  mem_[off++] = 0x0F;
+
+  x86_->step();
+  x86_->step();
+  EXPECT_EQ(1, regs_->ax);
+
+  // The INC AX was overwritten with DEC AX.
+  regs_->ip = kOffset;
+  x86_->step();
+  EXPECT_EQ(0, regs_->ax);
+
+  // An instruction that changes its own displacement.
+  const byte code[] = { 0xFE, 0x06, 0x02, 0x01 };  // INC BYTE [0102h]
+  for (int i = 0; i < 4; i++) {
+    memory_->write(kOffset + i, code[i]);
+  }
+  regs_->ip = kOffset;
+  x86_->step();
+  EXPECT_EQ(0x03, mem_[kOffset + 2]);
+
+  // It's INC BYTE [0103h] now.
+  regs_->ip = kOffset;
+  x86_->step();
+  EXPECT_EQ(0x03, mem_[kOffset + 2]);
+  EXPECT_EQ(0x02, mem_[kOffset + 3]);
+}
+
+
+TEST_F(X86Test, JIT) {
+  int off = kOffset;
+  mem_[off++] = 0xB9;  // MOV CX, 0010h
+  mem_[off++] = 0x10;
+  mem_[off++] = 0x00;
+  mem_[off++] = 0xB8;  // MOV AX, 0000h
+  mem_[off++] = 0x00;
+  mem_[off++] = 0x00;
+  mem_[off++] = 0x01;  // ADD AX, CX
+  mem_[off++] = 0xC8;
+  mem_[off++] = 0x08;  // OR AL, AH
+  mem_[off++] = 0xE0;
+  mem_[off++] = 0xE2;  // LOOP 0106h
+  mem_[off++] = 0xFA;
+  const int end = off;
+  const int instructions = 2 + 0x10 * 3;
+
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  regs_->flags = 0;
+  for (int i = 0; i < instructions; i++) {
+    x86_->step();
+  }
+  Registers expected = *regs_;
+  word expected_flags = x86_->getFlags();
+  EXPECT_EQ(end, expected.ip);
+
+  X86JIT jit(x86_.get());
+  x86_->getStopAddresses()->add(end);
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  x86_->setFlags(0);
+  EXPECT_EQ(instructions, jit.run(1000));
+
+  EXPECT_EQ(expected.ip, regs_->ip);
+  EXPECT_EQ(expected.ax, regs_->ax);
+  EXPECT_EQ(expected.cx, regs_->cx);
+  EXPECT_EQ(expected_flags, x86_->getFlags());
+
+  // A stop address added inside a translated loop is honored, without
+  // discarding the rest of the translated code.
+  x86_->getStopAddresses()->add(kOffset + 8);
+  regs_->ip = kOffset;
+  EXPECT_EQ(3, jit.run(1000));
+  EXPECT_EQ(kOffset + 8, regs_->ip);
+  x86_->getStopAddresses()->remove(kOffset + 8);
+  EXPECT_EQ(instructions - 3, jit.run(1000));
+  EXPECT_EQ(expected.ax, regs_->ax);
+  EXPECT_EQ(0, jit.getStats().flushes);
+}
+
+
+TEST_F(X86Test, RunFor) {
+  int off = kOffset;
+  mem_[off++] = 0xB9;  // MOV CX, 0010h
+  mem_[off++] = 0x10;
+  mem_[off++] = 0x00;
+  mem_[off++] = 0x01;  // ADD AX, CX
+  mem_[off++] = 0xC8;
+  mem_[off++] = 0xE2;  // LOOP 0103h
+  mem_[off++] = 0xFC;
+  const int end = off;
+  mem_[off++] = 0xD7;  // XLAT, not implemented
+
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  x86_->getStopAddresses()->add(end);
+
+  X86::RunResult result = x86_->runFor(-1, 5);
+  EXPECT_EQ(X86::STOP_BUDGET, result.reason);
+  EXPECT_EQ(5, result.instructions);
+
+  // MOV is 4 cycles, ADD 3, LOOP 17 if taken and 5 otherwise.
+  result = x86_->runFor(-1);
+  EXPECT_EQ(X86::STOP_ADDRESS, result.reason);
+  EXPECT_EQ(1 + 0x10 * 2 - 5, result.instructions);
+  EXPECT_EQ(4 + 0x10 * 3 + 0x0F * 17 + 5, x86_->getCycleCount());
+  EXPECT_EQ(end, regs_->ip);
+
+  result = x86_->runFor(-1);
+  EXPECT_EQ(X86::STOP_ERROR, result.reason);
+  EXPECT_EQ(0, result.instructions);
+  EXPECT_TRUE(x86_->isExecutePending());
+}
+
+
+class LatchDevice : public IOHandler {
+ public:
+  LatchDevice() : latched(0) {}
+
+  virtual byte handleIN(int port) override {
+    return latched + port;
+  }
+
+  virtual void handleOUT(int port, byte val) override {
+    latched = val;
+  }
+
+  byte latched;
+};
+
+
+TEST_F(X86Test, DeviceBus) {
+  LatchDevice device;
+  x86_->registerIOHandler(&device, 0x3D8, 4);
+  mem_[kOffset] = 0xEE;      // OUT DX, AL
+  mem_[kOffset + 1] = 0xEC;  // IN AL, DX
+  mem_[kOffset + 2] = 0xE4;  // IN AL, 40h
+  mem_[kOffset + 3] = 0x40;
+
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  regs_->dx = 0x3DA;
+  regs_->al = 0x10;
+  x86_->runFor(-1, 2);
+  EXPECT_EQ(0x10, device.latched);
+  EXPECT_EQ((0x10 + 0x3DA) & 0xFF, regs_->al);
+
+  x86_->runFor(-1, 1);
+  EXPECT_EQ(0xFF, regs_->al);
+  EXPECT_EQ(1, x86_->getDeviceBus()->getStats().unhandled_ins);
+  EXPECT_EQ(0, x86_->getDeviceBus()->getStats().unhandled_outs);
+}
+
+
+TEST_F(X86Test, Rewind) {
+  VGA vga(x86_.get());
+  RewindBuffer rewind(x86_.get(), &vga, nullptr, nullptr, 2 << 20);
+  regs_->ax = 1;
+  memory_->write(0x1000, 1);
+  rewind.capture();
+
+  regs_->ax = 2;
+  memory_->write(0x1000, 2);
+  memory_->write(0x1800, 2);
+  rewind.capture();
+
+  regs_->ax = 3;
+  memory_->write(0x1000, 3);
+  EXPECT_EQ(1, rewind.rewind(1));
+  EXPECT_EQ(2, regs_->ax);
+  EXPECT_EQ(2, memory_->read(0x1000));
+  EXPECT_EQ(2, rewind.getEntryCount());
+
+  EXPECT_EQ(2, rewind.rewind(5));
+  EXPECT_EQ(1, regs_->ax);
+  EXPECT_EQ(1, memory_->read(0x1000));
+  EXPECT_EQ(0, memory_->read(0x1800));
+  EXPECT_EQ(1, rewind.getEntryCount());
+}
+
+
+TEST_F(X86Test, TimerInterrupt) {
+  PIT pit(x86_.get());
+  mem_[0x20] = 0x00;         // INT 08h -> 0000:0200h
+  mem_[0x21] = 0x02;
+  mem_[kOffset] = 0xFB;      // STI
+  mem_[kOffset + 1] = 0xEB;  // JMP 0101h
+  mem_[kOffset + 2] = 0xFE;
+  mem_[0x200] = 0x43;        // INC BX
+  mem_[0x201] = 0xCF;        // IRET
+
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  regs_->sp = 0xFFFE;
+
+  // Interrupts are disabled until STI.
+  x86_->runFor(pit.getTimerPeriod() * 3 + 100);
+  EXPECT_EQ(3, regs_->bx);
+  EXPECT_EQ(0xFFFE, regs_->sp);
+  EXPECT_EQ(kOffset + 1, regs_->ip);
+  EXPECT_TRUE(x86_->getFlag(X86::F_IF));
+}
+
+
+TEST_F(X86Test, TimerAfterReset) {
+  PIT pit(x86_.get());
+  x86_->runFor(1000);
+  pit.handleOUT(0x43, 0x34);  // Channel 0, low then high byte, mode 2.
+  pit.handleOUT(0x40, 0x00);
+  pit.handleOUT(0x40, 0x80);
+  x86_->runFor(1000);
+  x86_->reset();
+
+  // Channel 0 keeps counting down from where it was.
+  pit.handleOUT(0x43, 0x00);  // Latch channel 0.
+  int first = pit.handleIN(0x40) | (pit.handleIN(0x40) << 8);
+  x86_->runFor(400);
+  pit.handleOUT(0x43, 0x00);
+  int second = pit.handleIN(0x40) | (pit.handleIN(0x40) << 8);
+  EXPECT_LT(first, 0x8000);
+  EXPECT_LT(second, first);
+}
+
+
+TEST_F(X86Test, InterruptVectors) {
+  mem_[0x84] = 0x00;     // INT 21h -> 0000:0300h
+  mem_[0x85] = 0x03;
+  mem_[kOffset] = 0x90;  // NOP, where the INT 40h vector would be.
+  mem_[kOffset + 1] = 0x90;
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  regs_->sp = 0x1000;
+
+  // Vectors past 3Fh overlap the program, so they're left to the devices.
+  EXPECT_FALSE(x86_->interrupt(0x40));
+  EXPECT_EQ(kOffset, regs_->ip);
+  EXPECT_TRUE(x86_->interrupt(0x21));
+  EXPECT_EQ(0x300, regs_->ip);
+  EXPECT_EQ(kOffset, *(word*)&mem_[0xFFA]);
+}
+
+TEST_F(X86Test, MachineImage) {
+  const char kFilename[] = "image_test.tmp";
+  const unsigned long long kProgramHash = 1;
+
+  VGA vga(x86_.get());
+  PIT pit(x86_.get());
+  mem_[0x20] = 0x00;         // INT 08h -> 0000:0200h
+  mem_[0x21] = 0x02;
+  mem_[kOffset] = 0xFB;      // STI
+  mem_[kOffset + 1] = 0xEB;  // JMP 0101h
+  mem_[kOffset + 2] = 0xFE;
+  mem_[0x200] = 0x43;        // INC BX
+  mem_[0x201] = 0xCF;        // IRET
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  regs_->sp = 0xFFFE;
+
+  x86_->runFor(pit.getTimerPeriod() + 100);
+  MachineImage(x86_.get(), &vga, &pit).save(kFilename, kProgramHash);
+  x86_->runFor(pit.getTimerPeriod() * 2);
+  EXPECT_EQ(3, regs_->bx);
+
+  // Resumed on another machine, the timer keeps going from where it was.
+  Memory memory(2 << 16);
+  X86 x86(&memory);
+  VGA other_vga(&x86);
+  PIT other_pit(&x86);
+  MachineImage image(&x86, &other_vga, &other_pit);
+  EXPECT_FALSE(image.load("missing_image_test.tmp", kProgramHash));
+  EXPECT_FALSE(image.load(kFilename, kProgramHash + 1));
+
+  // A truncated image is as good as none, and leaves the machine alone.
+  const char kTruncatedFilename[] = "truncated_image_test.tmp";
+  {
+    ifstream in(kFilename, ios::in | ios::binary);
+    vector<char> data((istreambuf_iterator<char>(in)),
+                      istreambuf_iterator<char>());
+    ofstream out(kTruncatedFilename, ios::out | ios::binary);
+    out.write(data.data(), data.size() - 4);
+  }
+  EXPECT_FALSE(image.load(kTruncatedFilename, kProgramHash));
+  remove(kTruncatedFilename);
+  EXPECT_EQ(0, x86.getRegisters()->bx);
+
+  EXPECT_TRUE(image.load(kFilename, kProgramHash));
+  remove(kFilename);
+  EXPECT_EQ(1, x86.getRegisters()->bx);
+
+  x86.runFor(pit.getTimerPeriod() * 2);
+  EXPECT_EQ(x86_->getCycleCount(), x86.getCycleCount());
+  EXPECT_EQ(Replay::hashState(x86_.get()), Replay::hashState(&x86));
+}
+
+
+TEST_F(X86Test, MachineImageAfterReset) {
+  const char kFilename[] = "reset_image_test.tmp";
+  const unsigned long long kProgramHash = 1;
+
+  // Resetting leaves the PIT channels started before cycle 0.
+  VGA vga(x86_.get());
+  PIT pit(x86_.get());
+  x86_->runFor(pit.getTimerPeriod() / 2);
+  x86_->reset();
+  x86_->runFor(100);
+  MachineImage(x86_.get(), &vga, &pit).save(kFilename, kProgramHash);
+
+  Memory memory(2 << 16);
+  X86 x86(&memory);
+  VGA other_vga(&x86);
+  PIT other_pit(&x86);
+  EXPECT_TRUE(MachineImage(&x86, &other_vga, &other_pit).load(
+      kFilename, kProgramHash));
+  remove(kFilename);
+
+  PIT::State state, other_state;
+  pit.saveState(&state);
+  other_pit.saveState(&other_state);
+  EXPECT_GT(0, state.channels[0].start_cycle);
+  EXPECT_EQ(state.channels[0].start_cycle,
+            other_state.channels[0].start_cycle);
+  EXPECT_EQ(Replay::hashState(x86_.get()), Replay::hashState(&x86));
+}
+
+
+// Stores the characters read with INT 16h at DI.
+static void loadKeyLoop(byte* mem, Registers* regs) {
+  const byte code[] = {
+    0xFB,        // STI
+    0xB4, 0x00,  // MOV AH, 0
+    0xCD, 0x16,  // INT 16h
+    0x88, 0x05,  // MOV [DI], AL
+    0x47,        // INC DI
+    0xEB, 0xF7,  // JMP 0101h
+  };
+  copy(code, code + sizeof(code), mem + kOffset);
+  regs->cs = 0;
+  regs->ip = kOffset;
+  regs->sp = 0xFFFE;
+  regs->di = 0x200;
+}
+
+
+TEST_F(X86Test, Replay) {
+  const int kCyclesPerFrame = 1000;
+  const char kFilename[] = "replay_test.tmp";
+
+  loadKeyLoop(mem_, regs_);
+  Keyboard keyboard(x86_.get());
+  ReplayRecorder recorder(x86_.get(), &keyboard, kCyclesPerFrame);
+  recorder.start();
+  x86_->runFor(kCyclesPerFrame * 10);
+  recorder.handleKey(0x1E, true);  // A
+  recorder.handleKey(0x1E, false);
+  x86_->runFor(kCyclesPerFrame * 50);
+  recorder.stop();
+  EXPECT_EQ('a', mem_[0x200]);
+  EXPECT_EQ(0x201, regs_->di);
+  recorder.getReplay().save(kFilename);
+
+  // Played back on another machine in the same state, the key arrives at
+  // the same time.
+  Memory memory(2 << 16);
+  X86 x86(&memory);
+  Keyboard other_keyboard(&x86);
+  loadKeyLoop(memory.getPointer(0), x86.getRegisters());
+
+  Replay replay;
+  replay.load(kFilename);
+  remove(kFilename);
+  EXPECT_EQ(recorder.getReplay().events.size(), replay.events.size());
+
+  ReplayPlayer player(&x86, &other_keyboard, replay);
+  EXPECT_TRUE(player.start());
+  while (!player.isFinished()) {
+    x86.runFor(kCyclesPerFrame);
+  }
+  EXPECT_EQ(-1, player.getMismatchFrame());
+  EXPECT_EQ('a', memory.read(0x200));
+}
+
+
+static void expectSameState(const PIT::State& a, const PIT::State& b) {
+  for (int i = 0; i < PIT::kChannels; i++) {
+    EXPECT_EQ(a.channels[i].reload, b.channels[i].reload);
+    EXPECT_EQ(a.channels[i].access, b.channels[i].access);
+    EXPECT_EQ(a.channels[i].mode, b.channels[i].mode);
+    EXPECT_EQ(a.channels[i].write_high, b.channels[i].write_high);
+    EXPECT_EQ(a.channels[i].read_high, b.channels[i].read_high);
+    EXPECT_EQ(a.channels[i].low_byte, b.channels[i].low_byte);
+    EXPECT_EQ(a.channels[i].latched, b.channels[i].latched);
+    EXPECT_EQ(a.channels[i].latch, b.channels[i].latch);
+    EXPECT_EQ(a.channels[i].start_cycle, b.channels[i].start_cycle);
+  }
+  EXPECT_EQ(a.port_61, b.port_61);
+}
+
+
+static void expectSameState(const Keyboard::State& a,
+                            const Keyboard::State& b) {
+  EXPECT_EQ(a.queue, b.queue);
+  EXPECT_EQ(a.output, b.output);
+  EXPECT_EQ(a.output_full, b.output_full);
+  EXPECT_EQ(a.delivery_scheduled, b.delivery_scheduled);
+  EXPECT_EQ(a.left_shift, b.left_shift);
+  EXPECT_EQ(a.right_shift, b.right_shift);
+  EXPECT_EQ(a.buffer, b.buffer);
+}
+
+
+TEST_F(X86Test, MachineSnapshots) {
+  const int kCyclesPerFrame = 1000;
+
+  loadKeyLoop(mem_, regs_);
+  VGA vga(x86_.get());
+  PIT pit(x86_.get());
+  Keyboard keyboard(x86_.get());
+  MachineSnapshots snapshots(x86_.get(), &vga, &pit, &keyboard);
+
+  // CGA 320x200 without clearing VRAM, which is past this memory.
+  VGA::State cga_mode = { 0x04, 0 };
+  vga.restoreState(cga_mode);
+  x86_->runFor(kCyclesPerFrame * 5);
+  keyboard.handleKey(0x2A, true);  // Left shift, still held.
+  keyboard.handleKey(0x1E, true);  // A, not read yet.
+
+  unsigned long long hash = Replay::hashState(x86_.get());
+  VGA::State vga_state;
+  PIT::State pit_state;
+  Keyboard::State keyboard_state;
+  vga.saveState(&vga_state);
+  pit.saveState(&pit_state);
+  keyboard.saveState(&keyboard_state);
+  int id = snapshots.take();
+
+  // Frames ahead, with every device changing, like when running ahead.
+  for (int restores = 0; restores < 2; restores++) {
+    for (int frame = 0; frame < 5; frame++) {
+      x86_->runFor(kCyclesPerFrame);
+      keyboard.handleKey(0x1E, false);
+      keyboard.handleKey(0x30, true);  // B
+      pit.handleOUT(0x43, 0x34);
+      pit.handleOUT(0x40, frame);
+      pit.handleOUT(0x40, 0x10);
+    }
+    vga.setPalette(1);
+    EXPECT_NE(hash, Replay::hashState(x86_.get()));
+
+    snapshots.restore(id);
+    EXPECT_EQ(hash, Replay::hashState(x86_.get()));
+    VGA::State restored_vga;
+    PIT::State restored_pit;
+    Keyboard::State restored_keyboard;
+    vga.saveState(&restored_vga);
+    pit.saveState(&restored_pit);
+    keyboard.saveState(&restored_keyboard);
+    EXPECT_EQ(vga_state.mode, restored_vga.mode);
+    EXPECT_EQ(vga_state.palette, restored_vga.palette);
+    expectSameState(pit_state, restored_pit);
+    expectSameState(keyboard_state, restored_keyboard);
+  }
+
+  snapshots.release(id);
+  EXPECT_FALSE(snapshots.contains(id));
+  EXPECT_EQ(0, memory_->getSnapshotPageCount());
+
+  // The key still pending when the snapshot was taken is read afterwards.
+  x86_->runFor(kCyclesPerFrame * 5);
+  EXPECT_EQ('A', mem_[0x200]);
+}
+
+TEST_F(X86Test, ReplayAfterRewind) {
+  const int kCyclesPerFrame = 1000;
+  const char kFilename[] = "replay_rewind_test.tmp";
+
+  loadKeyLoop(mem_, regs_);
+  VGA vga(x86_.get());
+  Keyboard keyboard(x86_.get());
+  RewindBuffer rewind(x86_.get(), &vga, nullptr, &keyboard, 2 << 20);
+  ReplayRecorder recorder(x86_.get(), &keyboard, kCyclesPerFrame);
+  recorder.start();
+  x86_->runFor(kCyclesPerFrame * 50);
+  rewind.capture();
+  x86_->runFor(kCyclesPerFrame * 35);
+  recorder.handleKey(0x1E, true);  // A
+  recorder.handleKey(0x1E, false);
+  x86_->runFor(kCyclesPerFrame * 5);
+
+  // The frames after the rewound state are recorded again, with B instead.
+  rewind.rewind(1);
+  recorder.truncate();
+  EXPECT_GE(50, recorder.getReplay().events.back().frame);
+  x86_->runFor(kCyclesPerFrame * 5);
+  recorder.handleKey(0x30, true);  // B
+  recorder.handleKey(0x30, false);
+  x86_->runFor(kCyclesPerFrame * 40);
+  recorder.stop();
+  EXPECT_EQ('b', mem_[0x200]);
+  EXPECT_EQ(0x201, regs_->di);
+  recorder.getReplay().save(kFilename);
+
+  Memory memory(2 << 16);
+  X86 x86(&memory);
+  Keyboard other_keyboard(&x86);
+  loadKeyLoop(memory.getPointer(0), x86.getRegisters());
+
+  Replay replay;
+  replay.load(kFilename);
+  remove(kFilename);
+  for (size_t i = 1; i < replay.events.size(); i++) {
+    EXPECT_LE(replay.events[i - 1].frame, replay.events[i].frame);
+  }
+
+  ReplayPlayer player(&x86, &other_keyboard, replay);
+  EXPECT_TRUE(player.start());
+  while (!player.isFinished()) {
+    x86.runFor(kCyclesPerFrame);
+  }
+  EXPECT_EQ(-1, player.getMismatchFrame());
+  EXPECT_EQ('b', memory.read(0x200));
+}
+
+
+TEST_F(X86Test, TrackingMode) {
+  mem_[kOffset] = 0xE8;  // CALL 0200h
+  mem_[kOffset + 1] = 0xFD;
+  mem_[kOffset + 2] = 0x00;
+  mem_[0x200] = 0xE8;    // CALL 0200h
+  mem_[0x201] = 0xFD;
+  mem_[0x202] = 0xFF;
+
+  regs_->cs = 0;
+  regs_->ip = kOffset;
+  regs_->sp = 0xFFFE;
+  x86_->step();
+  EXPECT_TRUE(x86_->getCallStack().empty());
+  EXPECT_FALSE(x86_->getEntryPoints().contains(0x200));
+
+  x86_->setTrackingMode(X86::TRACK_CALL_STACK);
+  for (int i = 0; i < X86::kCallStackSize + 10; i++) {
+    x86_->step();
+  }
+  EXPECT_TRUE(x86_->getEntryPoints().contains(0x200));
+
+  // Only the innermost calls are kept.
+  vector<pair<word, word>> call_stack = x86_->getCallStack();
+  ASSERT_EQ((int)X86::kCallStackSize, (int)call_stack.size());
+  EXPECT_EQ(0x200, call_stack.front().second);
+  EXPECT_EQ(0x200, call_stack.back().second);
+
+  // Saved states hold the call stack only while it's tracked.
+  X86::State state;
+  x86_->saveState(&state);
+  x86_->step();
+  x86_->restoreState(state);
+  EXPECT_EQ(call_stack, x86_->getCallStack());
+  x86_->setTrackingMode(X86::TRACK_ENTRY_POINTS);
+  x86_->saveState(&state);
+  EXPECT_TRUE(state.call_stack.empty());
+}
@@ -18,7 +18,7 @@
 
 #include "lib/loader.h"
 #include "lib/memory.h"
-#include "lib/x86_base.h"
+#include "lib/x86_base_t.h"
 
 using namespace std;
 
@@ -50,9 +50,10 @@ struct EntryPoint {
 };
 
 
-class X86Disassembler : public X86Base {
+class X86Disassembler : public X86BaseT<X86Disassembler> {
  public:
   X86Disassembler(Memory* mem) : mem_(mem) {
+    describe_ = true;
     dump_raw_ = false;
   }
 
@@ -131,6 +132,10 @@ class X86Disassembler : public X86Base {
     return mem_->getPointer((segment << 4) + offset);
   }
 
+  virtual const word* getMem16ReadPtr(word segment, word offset) override {
+    return (const word*)mem_->getReadPointer((segment << 4) + offset);
+  }
+
   virtual bool getFlag(word mask) const override {
     return false;
   }
@@ -6,34 +6,63 @@
 // Licensed under the Whatever/Credit License: you may do whatever you want with
 // the code; if you make something cool, credit is appreciated.
 //
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <signal.h>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 
+#include "lib/keyboard.h"
 #include "lib/loader.h"
+#include "lib/machine_image.h"
 #include "lib/memory.h"
 #include "lib/monitor.h"
+#include "lib/pit.h"
+#include "lib/replay.h"
+#include "lib/rewind.h"
+#include "lib/triple_buffer.h"
 #include "lib/vga.h"
 #include "lib/x86.h"
+#include "lib/x86_jit.h"
 
 using namespace std;
 
 const char kPrompt[] = ">>> ";
 const int kFrameRate = 30;
+const int kCyclesPerFrame = X86::kClockRate / kFrameRate;
+const int kJITBatch = 10000;
+
+// About two minutes of frames for goody, where little memory changes between
+// them.
+const int kRewindSize = 8 << 20;
 
 class Runner {
  public:
-  Runner (X86* x86, VGA* vga, Monitor* monitor) : x86_(x86), vga_(vga), monitor_(monitor) {
+  Runner (X86* x86, VGA* vga, PIT* pit, Keyboard* keyboard, Monitor* monitor)
+      : x86_(x86), vga_(vga), keyboard_(keyboard), monitor_(monitor),
+        jit_(x86), rewind_(x86, vga, pit, keyboard, kRewindSize),
+        image_(x86, vga, pit, keyboard),
+        recorder_(x86, keyboard, kCyclesPerFrame) {
     error_ = false;
+    jit_enabled_ = false;
+    threaded_ = false;
     instance_ = this;
     running_ = false;
     breakpoint_once_ = -1;
+    next_rewind_capture_ = 0;
+
+    x86_->setTrackingMode(X86::TRACK_CALL_STACK);
+    startRecording("");
 
     signal(SIGINT, &Runner::catchSignal);
     signal(SIGABRT, &Runner::catchSignal);
@@ -104,35 +133,230 @@ class Runner {
 
   void doStep(int steps) {
     running_ = true;
-    bool first = true;
 
-    int next_video_update = 0;
+    // The breakpoints are already stop addresses; the one-time breakpoint is
+    // only one while this runs.
+    AddressBitmap* stop_addresses = x86_->getStopAddresses();
+    bool remove_breakpoint_once = false;
+    if (breakpoint_once_ != -1 && !stop_addresses->contains(breakpoint_once_)) {
+      stop_addresses->add(breakpoint_once_);
+      remove_breakpoint_once = true;
+    }
+
+    if (threaded_) {
+      runThreaded(steps);
+    } else {
+      runSteps(steps);
+    }
+
+    if (remove_breakpoint_once) {
+      stop_addresses->remove(breakpoint_once_);
+    }
+    breakpoint_once_ = -1;
+    running_ = false;
+
+    // Back on this thread, since it hands the window's keys to the recorder.
+    if (player_ && player_->isFinished()) {
+      finishReplay();
+    }
+  }
+
+  // Runs the emulation on a separate thread while this one shows the frames
+  // it captures, so presenting never holds back the CPU. The emulation thread
+  // owns the X86 and the VGA until it finishes.
+  void runThreaded(int steps) {
+    atomic<bool> done(false);
+    exception_ptr exception;
+    thread emulation([&]() {
+      try {
+        runSteps(steps);
+      } catch (...) {
+        exception = current_exception();
+      }
+      done = true;
+    });
 
-    while ((steps == -1 || steps--) && !error_) {
+    while (!done) {
+      if (frames_.consume()) {
+        monitor_->update(frames_.getReadBuffer());
+      } else {
+        this_thread::sleep_for(chrono::milliseconds(1));
+      }
+    }
+    emulation.join();
+
+    // Show the final state of the screen.
+    if (vga_->captureFrame(frames_.getWriteBuffer())) {
+      frames_.publish();
+    }
+    if (frames_.consume()) {
+      monitor_->update(frames_.getReadBuffer());
+    }
+
+    if (exception) {
+      rethrow_exception(exception);
+    }
+  }
+
+  void runSteps(int steps) {
+    bool first = true;
+    long long next_video_update = 0;
+    const AddressBitmap* stop_addresses = x86_->getStopAddresses();
+
+    while ((steps == -1 || steps > 0) && !error_) {
       if (!x86_->isExecutePending()) {
         fetched_address_ = x86_->getCS_IP();
-        x86_->fetchAndDecode();
       }
 
       // Handle breakpoints.
       if (fetched_address_ == breakpoint_once_) {
         break;
       }
-      if (!first && breakpoints_.count(fetched_address_) != 0) {
+      if (!first && stop_addresses->contains(fetched_address_)) {
         cout << "Breakpoint." << endl;
         break;
       }
-
-      x86_->execute();
       first = false;
 
-      if (clock() >= next_video_update) {
-        monitor_->update();
-        next_video_update = clock() + (CLOCKS_PER_SEC / kFrameRate);
+      if (x86_->getCycleCount() >= next_video_update) {
+        if (!threaded_) {
+          monitor_->update();
+        } else if (vga_->captureFrame(frames_.getWriteBuffer())) {
+          frames_.publish();
+        }
+        next_video_update = x86_->getCycleCount() + kCyclesPerFrame;
+
+        // Video updates also happen when a run starts, so they can be
+        // closer together than a frame.
+        if (x86_->getCycleCount() >= next_rewind_capture_) {
+          rewind_.capture();
+          next_rewind_capture_ = next_video_update;
+        }
+      }
+
+      // Run up to the next breakpoint or video update.
+      int executed;
+      if (jit_enabled_) {
+        int batch = (steps == -1) ? kJITBatch : min(steps, kJITBatch);
+        executed = jit_.run(batch);
+      } else {
+        X86::RunResult result = x86_->runFor(
+            next_video_update - x86_->getCycleCount(), steps);
+        if (result.reason == X86::STOP_ERROR) {
+          cerr << "ERROR: " << result.error << endl;
+          break;
+        }
+        executed = result.instructions;
+      }
+
+      if (steps != -1) {
+        steps -= executed;
+      }
+
+      if (player_ && player_->isFinished()) {
+        break;
       }
     }
-    breakpoint_once_ = -1;
-    running_ = false;
+  }
+
+
+  void doJIT(const string& mode) {
+    if (mode == "on") {
+      jit_enabled_ = true;
+    } else if (mode == "off") {
+      jit_enabled_ = false;
+    } else {
+      cerr << "Syntax: jit <on|off>" << endl;
+      return;
+    }
+    if (jit_enabled_ && !X86JIT::isSupported()) {
+      cout << "Block translation not supported, using the interpreter." << endl;
+    }
+    cout << "JIT " << mode << "." << endl;
+  }
+
+
+  void doThread(const string& mode) {
+    if (mode == "on") {
+      threaded_ = true;
+    } else if (mode == "off") {
+      threaded_ = false;
+    } else {
+      cerr << "Syntax: thread <on|off>" << endl;
+      return;
+    }
+    cout << "Threaded emulation " << mode << "." << endl;
+  }
+
+
+  void doRewind(int frames) {
+    int rewound = rewind_.rewind(frames);
+    recorder_.truncate();
+    next_rewind_capture_ = x86_->getCycleCount() + kCyclesPerFrame;
+    cout << "Rewound " << dec << rewound << " frames, "
+         << rewind_.getEntryCount() - 1 << " left." << endl;
+  }
+
+
+  // Keys from the window go through the recorder, which saves them when the
+  // recording stops if there's a filename.
+  void startRecording(const string& filename) {
+    record_filename_ = filename;
+    recorder_.start();
+    monitor_->setKeyHandler(&recorder_);
+    clearRewind();
+  }
+
+  void doRecord(const string& filename) {
+    if (filename != "stop") {
+      startRecording(filename);
+      cout << "Recording to " << filename << "." << endl;
+      return;
+    }
+    if (record_filename_.empty()) {
+      cerr << "Not recording." << endl;
+      return;
+    }
+    Replay replay = recorder_.getReplay();
+    replay.block_translation = jit_enabled_;
+    replay.save(record_filename_);
+    cout << "Saved " << dec << replay.frame_count << " frames to "
+         << record_filename_ << "." << endl;
+    startRecording("");
+  }
+
+  // The window's keys are ignored while the replay plays. It's played with
+  // the JIT on or off, like it was recorded.
+  void doPlay(const string& filename) {
+    Replay replay;
+    replay.load(filename);
+    if (replay.cycles_per_frame != kCyclesPerFrame) {
+      cerr << "The replay has a different frame rate." << endl;
+      return;
+    }
+    recorder_.stop();
+    monitor_->setKeyHandler(nullptr);
+    clearRewind();
+
+    player_.reset(new ReplayPlayer(x86_, keyboard_, replay));
+    if (!player_->start()) {
+      cerr << "The replay was recorded from a different state." << endl;
+    }
+    jit_enabled_ = replay.block_translation;
+    cout << "Playing " << dec << replay.frame_count << " frames, JIT "
+         << (jit_enabled_ ? "on" : "off") << "." << endl;
+  }
+
+  void finishReplay() {
+    int mismatch_frame = player_->getMismatchFrame();
+    if (mismatch_frame == -1) {
+      cout << "Replay finished." << endl;
+    } else {
+      cout << "Replay finished, diverged at frame " << dec << mismatch_frame
+           << "." << endl;
+    }
+    player_.reset();
+    startRecording("");
   }
 
 
@@ -144,12 +368,44 @@ class Runner {
 
   void doLoad(const string& filename) {
     x86_->clearExecutionState();
-    Loader::loadCOM(filename, x86_->getMemory(), x86_, start_offset_, end_offset_);
+    Loader::loadCOM(filename, x86_->getMemory(), x86_, start_offset_,
+                    end_offset_);
+    program_filename_ = filename;
+    jit_.flush();
+    clearRewind();
     cout << "File loaded, [" << Hex16 << start_offset_ << " - " 
       << Hex16 << end_offset_ << "]" << endl;
   }
 
 
+  // Images are tied to the loaded program, e.g. to skip its startup code
+  // from then on with "load" followed by "image load".
+  void doImage(const string& mode, const string& filename) {
+    if (program_filename_.empty()) {
+      cerr << "No program loaded." << endl;
+      return;
+    }
+    unsigned long long program_hash =
+        MachineImage::hashFile(program_filename_);
+    if (mode == "save") {
+      image_.save(filename, program_hash);
+      cout << "Saved the machine to " << filename << "." << endl;
+    } else if (mode == "load") {
+      if (!image_.load(filename, program_hash)) {
+        cerr << "No image of " << program_filename_ << " in " << filename
+             << "." << endl;
+        return;
+      }
+      // The recorder's and the player's events weren't in the image.
+      player_.reset();
+      startRecording("");
+      cout << "Loaded the machine from " << filename << "." << endl;
+    } else {
+      cerr << "Syntax: image <save|load> <filename>" << endl;
+    }
+  }
+
+
   void doState() {
     Registers* regs = x86_->getRegisters();
     cout << "AX " << Hex16 << regs->ax << "  "
@@ -170,9 +426,10 @@ class Runner {
     cout << "IP " << Hex16 << regs->ip - x86_->getBytesFetched() << "  "
          << "FLAGS ";
   
+    word flags = x86_->getFlags();
     for (int i = 15; i >= 0; i--) {
-      int mask = i << 15;
-      if (regs->flags & mask) {
+      int mask = 1 << i;
+      if (flags & mask) {
         cout << FLAG_NAME[i]; 
       } else {
         cout << "-";
@@ -193,9 +450,11 @@ class Runner {
     int addr = parseNumber(addr_string);
     if (breakpoints_.find(addr) != breakpoints_.end()) {
       breakpoints_.erase(addr);
+      x86_->getStopAddresses()->remove(addr);
       cout << "Removed breakpoint at " << Hex16 << addr << "h." << endl;
     } else {
       breakpoints_.insert(addr);
+      x86_->getStopAddresses()->add(addr);
       cout << "Set breakpoint at " << Hex16 << addr << "h." << endl;
     }
   }
@@ -208,6 +467,10 @@ class Runner {
   void doPoke(const string& addr_string, const string& val_str) {
     int addr = parseNumber(addr_string);
     int value = parseNumber(val_str);
+    if (addr < 0 || addr >= x86_->getMemory()->getSize()) {
+      cerr << "Address out of range" << endl;
+      return;
+    }
     x86_->getMemory()->write(addr, value);
     x86_->refetch();
   }
@@ -239,8 +502,36 @@ class Runner {
     cout << endl;
   }
 
+  void doStats() {
+    const DecodeCache::Stats& stats = x86_->getDecodeCacheStats();
+    cout << dec << "Decode cache: " << stats.hits << " hits, "
+         << stats.misses << " misses, "
+         << stats.invalidations << " invalidations" << endl;
+
+    const X86JIT::Stats& jit_stats = jit_.getStats();
+    cout << "JIT: " << jit_stats.blocks_translated << " blocks translated, "
+         << jit_stats.blocks_invalidated << " invalidated, "
+         << jit_stats.flushes << " flushes" << endl;
+
+    const DeviceBus::Stats& bus_stats = x86_->getDeviceBus()->getStats();
+    cout << "Unhandled: " << bus_stats.unhandled_interrupts << " interrupts, "
+         << bus_stats.unhandled_ins << " INs, "
+         << bus_stats.unhandled_outs << " OUTs" << endl;
+
+    cout << "Rewind: " << rewind_.getEntryCount() << " frames, "
+         << rewind_.getSize() / 1024 << " KB" << endl;
+
+    cout << "Cycles: " << x86_->getCycleCount() << endl;
+    cout << endl;
+  }
+
+  void clearRewind() {
+    rewind_.clear();
+    next_rewind_capture_ = 0;
+  }
+
   void doEntryPoints() {
-    auto entry_points = x86_->getEntryPoints();
+    auto entry_points = x86_->getEntryPoints().getAddresses();
     for (int address : entry_points) {
       cout << "EntryPoint " << Hex16 << address << "h" << endl;
     }
@@ -268,6 +559,38 @@ class Runner {
       } else if (action == "r" || action == "run") {
         // RUN - run until stopped.
         doRun();
+      } else if (action == "rewind") {
+        // REWIND <frames> - go back to the state of a number of frames ago,
+        // counting from the start of the current one.
+        if (tokens.size() > 1) {
+          doRewind(stoi(tokens[1]));
+        } else {
+          cerr << "Syntax: " << action << " <frames>" << endl;
+        }
+      } else if (action == "record") {
+        // RECORD <filename|stop> - record the keys pressed in the window from
+        // now on, or stop and save the recording.
+        if (tokens.size() > 1) {
+          doRecord(tokens[1]);
+        } else {
+          cerr << "Syntax: " << action << " <filename|stop>" << endl;
+        }
+      } else if (action == "play") {
+        // PLAY <filename> - play a recording back from now on; running stops
+        // when it ends.
+        if (tokens.size() > 1) {
+          doPlay(tokens[1]);
+        } else {
+          cerr << "Syntax: " << action << " <filename>" << endl;
+        }
+      } else if (action == "image") {
+        // IMAGE <save|load> <filename> - save the whole machine to a file,
+        // or resume from one saved with the same program loaded.
+        if (tokens.size() > 2) {
+          doImage(tokens[1], tokens[2]);
+        } else {
+          cerr << "Syntax: " << action << " <save|load> <filename>" << endl;
+        }
       } else if (action == "skip") {
         // SKIP - skip over the current instruction.
         doSkip();
@@ -296,7 +619,8 @@ class Runner {
         // STATE - print the state of the registers.
         doState();
       } else if (action == "break") {
-        // BREAK <address> - add/remove a permanent breakpoint at the given address.
+        // BREAK <address> - add/remove a permanent breakpoint at the given
+        // address.
         if (tokens.size() > 1) {
           doBreak(tokens[1]);
         } else {
@@ -321,6 +645,9 @@ class Runner {
         x86_->reset();
         vga_->setVideoMode(0);
         breakpoints_.clear();
+        x86_->getStopAddresses()->clear();
+        player_.reset();
+        startRecording("");
       } else if (action == "over") {
         // OVER - runs until the instruction following the current one
         // in memory. Mostly equivalent to STEP, except for CALL and the
@@ -347,6 +674,24 @@ class Runner {
         // ENTRYPOINTS - print all collected entry points in a format suitable
         // for the disassembler .cfg.
         doEntryPoints();
+      } else if (action == "stats") {
+        // STATS - print decode cache, JIT, device bus and rewind statistics.
+        doStats();
+      } else if (action == "jit") {
+        // JIT <on|off> - run with the block translator or the interpreter.
+        if (tokens.size() > 1) {
+          doJIT(tokens[1]);
+        } else {
+          cerr << "Syntax: " << action << " <on|off>" << endl;
+        }
+      } else if (action == "thread") {
+        // THREAD <on|off> - run the emulation on its own thread while this
+        // one presents the frames.
+        if (tokens.size() > 1) {
+          doThread(tokens[1]);
+        } else {
+          cerr << "Syntax: " << action << " <on|off>" << endl;
+        }
       } else {
         cerr << "Unknown command '" << action << "'" << endl;
       }
@@ -358,9 +703,34 @@ class Runner {
  private:
   X86* x86_;
   VGA* vga_;
+  Keyboard* keyboard_;
   Monitor* monitor_;
 
-  bool error_;
+  // Block translator, used instead of the interpreter when enabled.
+  X86JIT jit_;
+  bool jit_enabled_;
+
+  // The state at the start of recent frames, and the cycle at which the
+  // next one is captured.
+  RewindBuffer rewind_;
+  long long next_rewind_capture_;
+
+  // Saves and loads the machine, for the program last loaded.
+  MachineImage image_;
+  string program_filename_;
+
+  // Input recording, always on, and playback, which replaces it.
+  ReplayRecorder recorder_;
+  string record_filename_;
+  unique_ptr<ReplayPlayer> player_;
+
+  // Whether the emulation runs on its own thread, handing frames over to
+  // this one.
+  bool threaded_;
+  TripleBuffer<VGA::Frame> frames_;
+
+  // Set by the signal handler, possibly while the emulation thread runs.
+  atomic<bool> error_;
   bool running_;
 
   // Start and end offset of the loaded binary.
@@ -383,9 +753,11 @@ int main (int argc, char** argv) {
   Memory mem(1 << 20);  // 1 MB
   X86 x86(&mem);
   VGA vga(&x86);
+  PIT pit(&x86);
+  Keyboard keyboard(&x86);
   Monitor monitor(&vga);
 
-  Runner runner(&x86, &vga, &monitor);
+  Runner runner(&x86, &vga, &pit, &keyboard, &monitor);
   runner.runScript("runner.cmd");
   runner.run();
 